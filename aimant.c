@@ -27,6 +27,8 @@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  *
  */
 
+#define _GNU_SOURCE /* tee(2), pthread_setaffinity_np(3) */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +42,17 @@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/prctl.h>
 
 #include "subprocess.h"
 #include "str.h"
@@ -51,21 +64,22 @@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "getopt_x.h"
 
 #include "aimant.h"
+#include "checkpoint.h"
+#include "stats.h"
+#include "uring.h"
+#include "pagepool.h"
+#include "executor.h"
+#include "timer.h"
+#include "recorder.h"
+#include "probes.h"
+#include "perfctr.h"
+#include "shard.h"
+#include "nginx.h"
+#include "hash.h"
+#include "alloc.h"
 
 #define MAXLINE 10000
 
-//#define DEBUG_INFO_ENABLED
-
-#ifndef DEBUG_INFO_ENABLED
-#  if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
-#    define DEBUG_INFO(...)	    //
-#  elif defined (__GNUC__)
-#    define DEBUG_INFO(format...)   //
-#  endif
-#else
-#  define DEBUG_INFO DEBUG
-#endif
-
 //#define SIMULATE_PARTIAL_SINK_FEED
 
 /* "create the sink, then the tap, close the tap and drain the sink"
@@ -74,24 +88,97 @@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define MAX2(a, b) ((a) >= (b) ? (a) : (b))
 #define MAX3(a, b, c) MAX2(MAX2(a, b), c)
 
-#define DELTA_USEC(a,b) (((a)->tv_sec - (b)->tv_sec) * 1000000 + (a)->tv_usec - (b)->tv_usec)
-#define DELTA_MSEC(a,b) (DELTA_USEC(a,b) / 1000)
-
 int sink_open(struct sink *x, int search_path, char **argv)
 {
 	assert(x->sp->argv == NULL);
 	memset(x, 0, sizeof(struct sink));
 	x->sp->search_path = search_path;
 	x->sp->argv = argv;
-	assert(subprocess_fork(x->sp) == 0);
+	if (subprocess_spawn(x->sp)) {
+		return -1;
+	}
 	x->fd = x->sp->child_fdin;
+	x->is_pipe = 1;
 	DEBUG_INFO("sink_open(x,search_path=%i,argv=[argv[0]=[%s]]): done", search_path, argv[0]);
 	return 0;
 }
 
+/* a unix socket (stream) or a fifo someone else reads from, a
+ * regular file gets appended to
+ */
+int sink_open_path(struct sink *x, const char *path)
+{
+	struct stat st[1];
+
+	memset(st, 0, sizeof(st));
+	memset(x, 0, sizeof(struct sink));
+	x->sp->child_fdin = -1;
+	x->sp->child_fdout = -1;
+	x->sp->child_fderr = -1;
+	x->fd = -1;
+
+	if (stat(path, st) == 0 && S_ISSOCK(st->st_mode)) {
+		struct sockaddr_un sun[1];
+		memset(sun, 0, sizeof(sun));
+		sun->sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(sun->sun_path)) {
+			errno = ENAMETOOLONG;
+			return -1;
+		}
+		strcpy(sun->sun_path, path);
+		if ((x->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+			return -1;
+		}
+		if (connect(x->fd, (struct sockaddr *)sun, sizeof(sun))) {
+			int save_errno = errno;
+			DEBUG("connect(path=[%s]), errno=%i", path, save_errno);
+			close(x->fd);
+			x->fd = -1;
+			errno = save_errno;
+			return -1;
+		}
+	} else {
+		/* O_NONBLOCK: opening a fifo without reader fails
+		 * (ENXIO) instead of hanging
+		 */
+		if ((x->fd = open(path, O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK, 0644)) < 0) {
+			int save_errno = errno;
+			DEBUG("open(path=[%s]), errno=%i", path, save_errno);
+			errno = save_errno;
+			return -1;
+		}
+		x->is_pipe = S_ISFIFO(st->st_mode);
+	}
+
+	assert(make_fd_non_blocking(x->fd) == 0);
+
+	DEBUG_INFO("sink_open_path(x,path=[%s]): done, fd=%i, is_pipe=%i", path, x->fd, x->is_pipe);
+
+	return 0;
+}
+
+/* a child terminated in background is done
+ */
+static void subprocess_gone(struct subprocess *sp, void *arg)
+{
+	static long long *count = NULL;
+	if (count == NULL) {
+		count = stats_counter("subprocess.reaped_async");
+	}
+	*count += 1;
+	fr_record(FR_CHILD_EXIT, sp->pid, sp->exit_status);
+	DEBUG_INFO("%s pid %i reaped, exit status %i", (char *)arg, sp->pid, sp->exit_status);
+}
+
 void sink_close(struct sink *x)
 {
-	assert(x->sp->pid > 0);
+	if (x->sp->pid == 0) {
+		if (x->fd >= 0) {
+			close(x->fd);
+		}
+		x->fd = -1;
+		return;
+	}
 
 	/* we are no more interested in tap output
 	 */
@@ -102,6 +189,23 @@ void sink_close(struct sink *x)
 	x->fd = -1;
 }
 
+/* same as sink_close, without waiting for the child
+ */
+void sink_close_async(struct sink *x)
+{
+	if (x->sp->pid == 0) {
+		sink_close(x);
+		return;
+	}
+
+	if (subprocess_terminate_async(x->sp, subprocess_gone, "sink")) {
+		sink_close(x);
+		return;
+	}
+
+	x->fd = -1;
+}
+
 int fd_tap_open(struct fd_tap *x, int fd)
 {
 	memset(x, 0, sizeof(struct fd_tap));
@@ -141,40 +245,94 @@ void file_tap_close(struct file_tap *x)
 }
 #endif
 
-static int tail_fn0(char *filename);
-static int tail_f(char *filename);
+static int tail0(char *filename, off_t offset);
+
+#define CAT_TAP_SEEK_END ((off_t)-1)
+
+/* cat taps are this same program, spawned with CAT_TAP_ARG path offset
+ */
+#define CAT_TAP_ARG "--tail0"
+#define CAT_TAP_EXE "/proc/self/exe"
+
+/* start is timer_now_usec(), monotonic so a clock step can't show up
+ * as a slow (or negative) spawn
+ */
+static void spawn_stats(long long start, int pid)
+{
+	static long long *count = NULL, *last, *max, *total;
+	long long usec;
+	if (count == NULL) {
+		count = stats_counter("spawn.count");
+		last = stats_counter("spawn.usec_last");
+		max = stats_counter("spawn.usec_max");
+		total = stats_counter("spawn.usec_total");
+	}
+	usec = timer_now_usec() - start;
+	*count += 1;
+	*last = usec;
+	*total += usec;
+	if (usec > *max) *max = usec;
+	fr_record(FR_CHILD_SPAWN, pid, usec);
+}
 
-int cat_tap_open(struct cat_tap *x, const char *path, int seek_end)
+/* start is a file offset or CAT_TAP_SEEK_END, the end is resolved
+ * here (not in the child) so x->offset is exact from the beginning
+ */
+int cat_tap_open(struct cat_tap *x, const char *path, off_t start)
 {
-	int pid;
+	int pid, r;
+	struct stat st[1];
+	long long t0;
+	char offset_s[32];
+	char *argv[] = {CAT_TAP_EXE, CAT_TAP_ARG, NULL, offset_s, NULL};
 
 	assert(x->path->s == NULL);
-	assert(x->sp->argv == NULL); /* not used since we won't execve */
+	assert(x->sp->argv == NULL); /* only set while spawning */
 	memset(x, 0, sizeof(struct cat_tap));
 
+	if (stat(path, st)) {
+		int save_errno = errno;
+		DEBUG("stat(path=[%s]), errno=%i", path, save_errno);
+		errno = save_errno;
+		return -1;
+	}
+
 	str_copyz(x->path, path);
 
-	if ((pid = subprocess_fork0(x->sp)) == 0) {
-		/* child
+	x->dev = st->st_dev;
+	x->ino = st->st_ino;
+	x->offset = start == CAT_TAP_SEEK_END || start > st->st_size ? st->st_size : start;
+
+	t0 = timer_now_usec();
+
+	argv[2] = x->path->s;
+	snprintf(offset_s, sizeof(offset_s), "%lli", (long long)x->offset);
+	x->sp->argv = argv;
+	r = subprocess_spawn(x->sp);
+	x->sp->argv = NULL; /* only needed to spawn */
+
+	if (r) {
+		/* no /proc probably, fork and tail from here
 		 */
-		int i;
-		for (i = getdtablesize(); i >= 0; i--) {
-			if (i <= STDERR_FILENO) continue;
-			close(i);
-		}
-		if (seek_end) {
-		  assert(tail_fn0(x->path->s) == 0);
-		} else {
-		  assert(tail_f(x->path->s) == 0);
+		if ((pid = subprocess_fork0(x->sp)) == 0) {
+			int i;
+			if (close_range(STDERR_FILENO + 1, ~0U, 0)) {
+				for (i = getdtablesize(); i > STDERR_FILENO; i--) {
+					close(i);
+				}
+			}
+			assert(tail0(x->path->s, x->offset) == 0);
+			exit(0);
+		} else if (pid < 0) {
+			return -1;
 		}
-		exit(0);
-	} else if (pid < 0) {
-		return -1;
 	}
 
+	spawn_stats(t0, x->sp->pid);
+
 	x->fd = x->sp->child_fdout;
 
-	DEBUG_INFO("cat_tap_open(x, path=[%s]): done, pid=%i", path, x->sp->pid);
+	DEBUG_INFO("cat_tap_open(x, path=[%s], offset=%lli): done, pid=%i", path, (long long)x->offset, x->sp->pid);
 
 	return 0;
 }
@@ -198,13 +356,41 @@ void cat_tap_close(struct cat_tap *x)
 	str_free(x->path);
 }
 
-int fd_tap_read(struct fd_tap *x, void *buf, int bufsz)
+/* same as cat_tap_close, without waiting for the child, a tap
+ * blocked on a huge file must not hold the log ingestion
+ */
+void cat_tap_close_async(struct cat_tap *x)
 {
-	int n = read(x->fd, buf, bufsz);
+	assert(x->sp->pid > 0);
+	assert(x->sp->argv == NULL);
+
+	subprocess_close_child_fdout(x->sp);
+	subprocess_close_child_fderr(x->sp);
+
+	DEBUG_INFO("sending SIGTERM to cat_tap pid %i", x->sp->pid);
+	assert(kill(x->sp->pid, SIGTERM) == 0);
+
+	if (subprocess_terminate_async(x->sp, subprocess_gone, "cat_tap")) {
+		assert(subprocess_terminate(x->sp) == 0);
+	}
+
+	x->fd = -1;
+	str_free(x->path);
+}
+
+/* bookkeeping of a read that returned n (errno is set if -1), done
+ * here or through io_uring, same read semantics
+ */
+int fd_tap_read_result(struct fd_tap *x, int n)
+{
+	PROBE2(fd_tap_read, x->fd, n);
 	if (n < 0) {
 		int save_errno = errno;
 		assert(n == -1);
-		if (errno == EAGAIN) return -1;
+		if (errno == EAGAIN) {
+			fr_record(FR_TAP_EAGAIN, x->fd, 0);
+			return -1;
+		}
 		if (errno == EINTR) return -1;
 		DEBUG("read(), errno=%i", save_errno);
 		errno = save_errno;
@@ -213,14 +399,21 @@ int fd_tap_read(struct fd_tap *x, void *buf, int bufsz)
 	}
 	if (n) {
 		x->bytes_read += n;
+		fr_record(FR_TAP_READ, x->fd, n);
 		//get_current_timeval(x->time_read);
 	} else {
 		assert(x->got_eof == 0);
 		x->got_eof = 1;
+		fr_record(FR_TAP_EOF, x->fd, 0);
 	}
 	return n;
 }
 
+int fd_tap_read(struct fd_tap *x, void *buf, int bufsz)
+{
+	return fd_tap_read_result(x, read(x->fd, buf, bufsz));
+}
+
 #if 1
 int file_tap_read(struct file_tap *x, void *buf, int bufsz)
 {
@@ -246,13 +439,16 @@ int file_tap_read(struct file_tap *x, void *buf, int bufsz)
 }
 #endif
 
-int cat_tap_read(struct cat_tap *x, void *buf, int bufsz)
+int cat_tap_read_result(struct cat_tap *x, int n)
 {
-	int n = read(x->fd, buf, bufsz);
+	PROBE3(cat_tap_read, x->fd, n, x->offset);
 	if (n < 0) {
 		int save_errno = errno;
 		assert(n == -1);
-		if (errno == EAGAIN) return -1;
+		if (errno == EAGAIN) {
+			fr_record(FR_TAP_EAGAIN, x->fd, 0);
+			return -1;
+		}
 		if (errno == EINTR) return -1;
 		DEBUG("read(), errno=%i", save_errno);
 		errno = save_errno;
@@ -261,47 +457,181 @@ int cat_tap_read(struct cat_tap *x, void *buf, int bufsz)
 	}
 	if (n) {
 		x->bytes_read += n;
+		x->offset += n;
+		fr_record(FR_TAP_READ, x->fd, n);
 		//get_current_timeval(x->time_read);
 	} else {
 		assert(x->got_eof == 0);
 		x->got_eof = 1;
+		fr_record(FR_TAP_EOF, x->fd, 0);
 	}
 	return n;
 }
 
+int cat_tap_read(struct cat_tap *x, void *buf, int bufsz)
+{
+	return cat_tap_read_result(x, read(x->fd, buf, bufsz));
+}
+
 #define BUFFER_ID_TAP_STDIN 1
 #define BUFFER_ID_TAP_CURRENT 2
 #define BUFFER_ID_TAP_HANGING_NORMAL 3
 #define BUFFER_ID_TAP_HANGING_SETTLE 4
+#define BUFFER_ID_SPLIT_FLUSH 5 /* a partial line left at the end */
+
+/* page aligned chunks for vmsplice(2), NULL if disabled
+ */
+static struct page_pool *page_pool = NULL;
+
+/* the data read from a tap is kept once and shared by all sinks, each
+ * sink has its own queue of buffers (cursors) pointing to chunks
+ */
+struct chunk {
+	int refs;
+	int id;
+	struct str buf[1];
+	ino_t ino; /* source file, 0 if not from a file */
+	off_t offset; /* source file offset of buf end */
+	int pooled; /* buf->s is from page_pool */
+	unsigned long long spliced; /* pipe position past its last byte, 0 if never vmspliced */
+	struct chunk *next; /* in chunk_pool */
+	struct chunk *origin; /* split piece: the chunk it was cut from, holds a ref */
+	int pieces; /* split pieces cut from this chunk and not written yet */
+};
+
+/* released chunks are kept for reuse (main thread only), along with
+ * their heap buffer, up to CHUNK_POOL_BYTES of buffers
+ */
+#define CHUNK_POOL_BYTES 0x1000000 /* 16777216 / 16M */
+
+static struct chunk *chunk_pool = NULL;
+static long chunk_pool_bytes = 0;
 
 DEFINE_ITEM(buffer,
-	    int id;
-	    struct str buf[1];
+	    struct chunk *chunk;
 	    int pos; /* buffer position */
+	    int end; /* chunk->buf->len, unless a range of it */
   );
 
-DEFINE_QUEUE(buffer_queue, buffer);
+DEFINE_FIFO(buffer_queue, buffer);
 
-struct buffer *buffer_new(struct buffer *tail, int id, void *buf, int bufsz)
+struct chunk *chunk_new(int id, void *buf, int bufsz)
 {
-	struct buffer *r = buffer_new0(tail);
+	struct chunk *r;
+	char *p;
+	int capacity;
+	if ((r = chunk_pool)) {
+		struct str keep = *r->buf;
+		chunk_pool = r->next;
+		chunk_pool_bytes -= keep.a;
+		memset(r, 0, sizeof(struct chunk));
+		*r->buf = keep;
+		r->buf->len = 0;
+	} else {
+		r = alloc_calloc(ALLOC_CHUNK, 1, sizeof(struct chunk));
+		assert(r);
+	}
 	r->id = id;
-#if 0
-	DEBUG_INFO("%i -> %i", r->_position, tail ? tail->_position : -1);
-	str_copyf(r->buf, "%s got %i bytes\n", id, bufsz);
-#else
-	str_copyn(r->buf, buf, bufsz);
-#endif
-	r->pos = 0;
+	if (page_pool && (p = page_pool_get(page_pool, bufsz + 1, &capacity))) {
+		str_free(r->buf);
+		memcpy(p, buf, bufsz);
+		p[bufsz] = 0;
+		r->buf->s = p;
+		r->buf->len = bufsz;
+		r->buf->a = capacity;
+		r->pooled = 1;
+	} else {
+		str_copyn(r->buf, buf, bufsz);
+	}
+	return r;
+}
+
+void chunk_release(struct chunk *x)
+{
+	assert(x->refs > 0);
+	if (--x->refs == 0) {
+		struct chunk *origin = x->origin;
+		if (x->pooled) {
+			page_pool_put(page_pool, x->buf->s, x->spliced);
+			x->buf->s = NULL;
+			x->buf->a = 0;
+		}
+		if (chunk_pool_bytes + x->buf->a <= CHUNK_POOL_BYTES) {
+			x->next = chunk_pool;
+			chunk_pool = x;
+			chunk_pool_bytes += x->buf->a;
+		} else {
+			str_free(x->buf);
+			alloc_free(ALLOC_CHUNK, x);
+		}
+		if (origin) {
+			chunk_release(origin);
+		}
+	}
+}
+
+static void chunk_pool_free()
+{
+	while (chunk_pool) {
+		struct chunk *t = chunk_pool->next;
+		str_free(chunk_pool->buf);
+		alloc_free(ALLOC_CHUNK, chunk_pool);
+		chunk_pool = t;
+	}
+	chunk_pool_bytes = 0;
+}
+
+struct buffer *buffer_new(struct chunk *chunk, int pos)
+{
+	struct buffer *r = buffer_new0(NULL);
+	r->chunk = chunk;
+	r->chunk->refs++;
+	r->pos = pos;
+	r->end = chunk->buf->len;
+	PROBE3(buffer_new, chunk->buf->len, pos, chunk->refs);
+	return r;
+}
+
+/* pos .. end of the chunk only
+ */
+struct buffer *buffer_new_range(struct chunk *chunk, int pos, int end)
+{
+	struct buffer *r = buffer_new(chunk, pos);
+	assert(pos <= end && end <= chunk->buf->len);
+	r->end = end;
 	return r;
 }
 
+/* checkpoint, NULL if disabled
+ */
+static struct checkpoint *checkpoint = NULL;
+
+#define CHECKPOINT_SAVE_MSEC 1000
+#define SINK_PIPE_SIZE 0x100000 /* 1048576, with -V */
+#define STATS_DUMP_MSEC 1000
+#define ALLOC_WARMUP_LOOPS 1000 /* or the first rotation, with -A */
+
+/* remember where a chunk came from, so the checkpoint can move
+ * forward once the sink has it all
+ */
+static void cat_tap_mark(struct cat_tap *x, struct chunk *c)
+{
+	c->ino = x->ino;
+	c->offset = x->offset;
+	if (checkpoint) {
+		struct checkpoint_slot *slot;
+		if ((slot = checkpoint_slot_by_ino(checkpoint, x->dev, x->ino)) && x->offset > slot->offset) {
+			slot->offset = x->offset;
+		}
+	}
+}
+
 void buffer_free(struct buffer *x)
 {
 	while (x) {
 		struct buffer *t = x->tail;
-		str_free(x->buf);
-		free(x);
+		chunk_release(x->chunk);
+		buffer_recycle(x);
 		x = t;
 	}
 }
@@ -309,80 +639,533 @@ void buffer_free(struct buffer *x)
 void buffer_queue_free(struct buffer_queue *x)
 {
 	if (x) {
-		buffer_free(x->enqueue);
-		buffer_free(x->dequeue);
-		free(x);
+		buffer_free(x->head);
+		alloc_free(ALLOC_ITEM, x);
 	}
 }
 
-/* same write semantics
+/* split, with -O one stream goes over several svlogd line by line,
+ * each gets a piece (a chunk of its own) of every chunk read, lines
+ * are assigned by the hash of a field or round-robin, and with -r or
+ * -D a line matching a route goes to its sink instead, lines caught
+ * by a -x filter go nowhere (or are sampled), NULL if disabled
+ *
+ * a partial line waits (per source) for the rest, and goes as it is
+ * once its source is done, the checkpoint only moves past a source
+ * chunk once every piece of it and of the ones before is written
  */
-int sink_write(struct sink *x, struct buffer *b)
-{
+
+#define SPLIT_LINE_MAX 0x10000 /* 65536, a longer line goes as is */
+
+/* "~text" anywhere in the line, "N=text" or "N^text" field N (1-based
+ * and blank separated) is or starts with text
+ */
+struct route {
+	int field; /* 0 for anywhere in the line */
+	int prefix;
+	struct strview text[1];
+	int sink; /* index in split->sinks */
+};
+
+/* "[M/]predicate", predicate as in a route, matching lines are dropped
+ * or, with M, one in M is kept, picked by the hash of the line so the
+ * same line always gets the same fate
+ */
+struct filter {
+	struct route r[1]; /* r->sink is not used */
+	unsigned int sample; /* 0 to drop all */
+	long long kept, dropped, dropped_bytes;
+};
+
+#define FILTER_MAX 8
+
+struct split {
+	struct sink *sinks[SINK_MAX]; /* the group first (sinks[0] is the primary), then routes */
 	int n;
+	int ngroup; /* lines no route takes are split between these */
+	struct route routes[SINK_MAX];
+	int nroutes; /* the first one matching wins */
+	struct filter filters[FILTER_MAX];
+	int nfilters; /* before routes, the first one matching wins */
+	int field; /* hashed, 1-based and blank separated, 0 for round-robin */
+	int ranges; /* -x alone, lines kept go as ranges of the chunk read */
+	unsigned int next; /* round-robin */
+	struct str piece[SINK_MAX][1]; /* being cut, one per sink */
+	struct strframer framer[1]; /* per source, end is the offset past the partial line */
+	struct chunk *fed; /* being framed */
+	int run_start, run_end; /* with ranges, the lines of fed kept so far, -1 if none */
+	struct buffer_queue *unacked; /* source chunks, oldest first */
+	long long lines[SINK_MAX];
+};
 
-	/* since we are using non-blocking io, try to write directly
-	 */
-	assert(x->sp->child_fdin >= 0);
-	assert(x->sp->child_fdin == x->fd);
+static struct split *split = NULL;
 
-#ifdef SIMULATE_PARTIAL_SINK_FEED
-	if (b->pos == 0) {
-		n = write(x->fd, b->buf->s, b->buf->len / 2);
+/* -N, counts what goes by as nginx access log lines, NULL if disabled
+ */
+static struct nginx *nginx = NULL;
+
+/* FNV-1a low bits follow the parity of the bytes, mixed before they
+ * are taken modulo a small count
+ */
+static unsigned int line_hash(const char *p, int len)
+{
+	return hash_u64(hash_bytes(p, len));
+}
+
+/* field n of a line, 0 if it has fewer
+ */
+static int line_field(const char *p, int len, int n, struct strview *token)
+{
+	struct strview v[1];
+	int i;
+	strview_init(v, p, len);
+	for (i = 0; i < n && strview_tokenize(v, " \t\n", token); i++)
+		;
+	return i == n;
+}
+
+static int route_match(struct route *r, const char *p, int len)
+{
+	struct strview v[1];
+	if (r->field == 0) {
+		strview_init(v, p, len);
+		return strview_find(v, r->text) >= 0;
+	}
+	if (!line_field(p, len, r->field, v)) {
+		return 0;
+	}
+	if (r->prefix && v->len > r->text->len) {
+		strview_slice(v, v, 0, r->text->len);
+	}
+	return strview_equal(v, r->text);
+}
+
+/* "dir:~text", "dir:N=text" or "dir:N^text", r->sink is not set, 0 on
+ * success, -1 if spec is not valid
+ */
+static int route_parse_predicate(struct route *r, const char *p)
+{
+	char *end;
+
+	memset(r, 0, sizeof(struct route));
+	if (*p == '~') {
+		strview_ofz(r->text, p + 1);
 	} else {
-		n = write(x->fd, b->buf->s + b->pos, b->buf->len - b->pos);
+		r->field = strtol(p, &end, 10);
+		if (end == p || r->field < 1 || (*end != '=' && *end != '^')) return -1;
+		r->prefix = *end == '^';
+		strview_ofz(r->text, end + 1);
 	}
-#else
-	n = write(x->fd, b->buf->s + b->pos, b->buf->len - b->pos);
-#endif
-	if (n < 0) {
-		int save_errno = errno;
-		assert(n == -1);
-		if (errno == EAGAIN) return -1;
-		if (errno == EINTR) return -1;
-		if (errno == EPIPE) {
-			DEBUG("sink pid=%i got EPIPE", x->sp->pid);
-			if (x->sp->child_fderr >= 0) {
-				char buf[4096];
-				int n;
-				if ((n = read(x->sp->child_fderr, buf, sizeof(buf)-1)) > 0) {
-					buf[n] = 0;
-					DEBUG("sink pid=%i stderr=[%s]", x->sp->pid, buf);
-				}
-			}
-			errno = save_errno;
-			return -1;
+	return r->text->len ? 0 : -1;
+}
+
+static int route_parse(struct route *r, const char *spec)
+{
+	const char *p = strchr(spec, ':');
+	if (p == NULL || p == spec) return -1;
+	return route_parse_predicate(r, p + 1);
+}
+
+/* "~text", "N=text", "N^text" or any of these after "M/", 0 on success,
+ * -1 if spec is not valid
+ */
+static int filter_parse(struct filter *x, const char *spec)
+{
+	const char *p = spec;
+	char *end;
+
+	memset(x, 0, sizeof(struct filter));
+	if (*p >= '0' && *p <= '9') {
+		long m = strtol(p, &end, 10);
+		if (*end == '/') {
+			if (m < 1) return -1;
+			x->sample = m;
+			p = end + 1;
 		}
-		DEBUG("write(), errno=%i", save_errno);
-		errno = save_errno;
-		perror("write()");
-		exit(1);
 	}
-	if (n) {
-		b->pos += n;
-	} else {
-		DEBUG_INFO("sink pid=%i got EOF", x->sp->pid);
-		assert(x->got_eof == 0);
-		x->got_eof = 1;
+	return route_parse_predicate(x->r, p);
+}
+
+/* 1 if the line is to go
+ */
+static int filter_line(struct split *s, const char *p, int len)
+{
+	int i;
+	for (i = 0; i < s->nfilters; i++) {
+		struct filter *x = s->filters + i;
+		if (!route_match(x->r, p, len)) continue;
+		if (x->sample && line_hash(p, len) % x->sample == 0) {
+			x->kept++;
+			return 0;
+		}
+		x->dropped++;
+		x->dropped_bytes += len;
+		return 1;
 	}
-	return n;
+	return 0;
 }
 
-/* same write semantics (except for EOF, must use x->got_eof), EAGAIN
- * and EINTR are ignored
+/* the sink (index in s->sinks) a line goes to, -1 if filtered out
  */
-int sink_write_from_queue(struct sink *x, struct buffer_queue *q)
+static int split_pick(struct split *s, const char *p, int len)
 {
-	struct buffer *b;
-	int total = 0;
-	while ((b = buffer_queue_dequeue(q))) {
-		int n;
-		n = sink_write(x, b);
-		if (n < 0) {
-			int save_errno = errno;
-			assert(n == -1);
-			if (errno == EAGAIN) {
-				DEBUG_INFO("sink is busy. how many buffers remaining? %i", buffer_queue_len(q));
+	struct strview token[1];
+	int i, j = -1;
+
+	if (s->nfilters && filter_line(s, p, len)) {
+		return -1;
+	}
+	for (i = 0; i < s->nroutes && j < 0; i++) {
+		if (route_match(s->routes + i, p, len)) {
+			j = s->routes[i].sink;
+		}
+	}
+	if (j >= 0) {
+		/* routed */
+	} else if (s->field) {
+		j = line_field(p, len, s->field, token) ? line_hash(token->s, token->len) % s->ngroup : 0;
+	} else {
+		j = s->next++ % s->ngroup;
+	}
+	return j;
+}
+
+static void split_line(struct split *s, const char *p, int len)
+{
+	int j = split_pick(s, p, len);
+	if (j < 0) return;
+	str_catn(s->piece[j], p, len);
+	s->lines[j]++;
+}
+
+/* move the checkpoint past the oldest source chunks with all their
+ * pieces written
+ */
+static void split_ack(struct split *s)
+{
+	struct buffer *b;
+	while ((b = s->unacked->head) && b->chunk->pieces == 0) {
+		b = buffer_queue_dequeue(s->unacked);
+		checkpoint_ack(checkpoint, b->chunk->ino, b->chunk->offset);
+		buffer_free(b);
+	}
+}
+
+static void split_cut(struct split *s, struct chunk *c);
+static void split_pieces(struct split *s, struct chunk *c);
+
+static void split_range(struct sink *x, struct chunk *c, int start, int end)
+{
+	if (x->fd < 0 || x->got_eof) {
+		x->dropped += end - start;
+		return;
+	}
+	buffer_queue_enqueue(x->q, buffer_new_range(c, start, end));
+	c->pieces++;
+	x->lag += end - start;
+}
+
+/* the run of kept lines of s->fed goes to the primary as a range
+ */
+static void split_run(struct split *s)
+{
+	if (s->run_start >= 0) {
+		split_range(s->sinks[0], s->fed, s->run_start, s->run_end);
+		s->run_start = -1;
+	}
+}
+
+/* a line from the framer, with s->ranges the whole lines of the chunk
+ * being fed that are kept go as ranges of it, only a line cut by the
+ * chunk boundary (or evicted, or too long) is copied into a piece
+ */
+static void split_framed(void *ctx, const char *p, int len)
+{
+	struct split *s = ctx;
+	struct chunk *c = s->fed;
+	int at;
+
+	if (!s->ranges || c == NULL || p < c->buf->s || p >= c->buf->s + c->buf->len) {
+		split_line(s, p, len);
+		return;
+	}
+	at = p - c->buf->s;
+	if (split_pick(s, p, len) < 0) {
+		split_run(s);
+		return;
+	}
+	s->lines[0]++;
+	if (s->run_start < 0) {
+		/* the line completed from the carry goes first
+		 */
+		split_pieces(s, c);
+		s->run_start = at;
+	}
+	s->run_end = at + len;
+}
+
+/* cut c into one piece per sink and enqueue them, c keeps a ref for
+ * the checkpoint until all are written
+ */
+static void split_enqueue(struct split *s, struct chunk *c)
+{
+	int left;
+
+	s->fed = c;
+	s->run_start = -1;
+	left = strframer_feed(s->framer, c->ino, c->buf->s, c->buf->len);
+	split_run(s);
+	s->fed = NULL;
+	strframer_source(s->framer, c->ino)->end = c->offset;
+
+	/* what waits in the carry is not written yet
+	 */
+	if (checkpoint && c->ino) {
+		c->offset -= left;
+	}
+
+	split_cut(s, c);
+}
+
+/* the lines split so far go to their sinks, a piece each, and c waits
+ * for all of them
+ */
+static void split_pieces(struct split *s, struct chunk *c)
+{
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		struct sink *x = s->sinks[i];
+		struct chunk *piece;
+		if (s->piece[i]->len == 0) continue;
+		if (x->fd < 0 || x->got_eof ||
+		    (x->policy == SINK_POLICY_DROP && x->lag + s->piece[i]->len > x->max_lag)) {
+			x->dropped += s->piece[i]->len;
+			s->piece[i]->len = 0;
+			continue;
+		}
+		piece = chunk_new(c->id, s->piece[i]->s, s->piece[i]->len);
+		piece->origin = c;
+		c->refs++;
+		c->pieces++;
+		buffer_queue_enqueue(x->q, buffer_new(piece, 0));
+		x->lag += s->piece[i]->len;
+		s->piece[i]->len = 0;
+	}
+}
+
+/* the pieces left, and c waits for all of them
+ */
+static void split_cut(struct split *s, struct chunk *c)
+{
+	split_pieces(s, c);
+
+	/* a chunk with no piece (filtered out whole, or its lines all
+	 * wait in the carry) has none to wait for, nor is queued (the
+	 * caller releases it, it must not be released here)
+	 */
+	if (!checkpoint || !c->ino) {
+		return;
+	} else if (c->pieces == 0 && !s->unacked->head) {
+		checkpoint_ack(checkpoint, c->ino, c->offset);
+	} else {
+		buffer_queue_enqueue(s->unacked, buffer_new(c, 0));
+	}
+}
+
+/* the partial line of ino (of every source if all) goes as it is, the
+ * source is done or we are exiting, returns the bytes flushed
+ */
+static int split_flush(struct split *s, ino_t ino, int all)
+{
+	int i, len, n = 0;
+
+	for (i = 0; i < STRFRAMER_SOURCES; i++) {
+		struct strframer_source *k = s->framer->sources + i;
+		struct chunk *c;
+		if (k->used == 0 || !(all || k->id == ino)) continue;
+		if ((len = strframer_flush(s->framer, k->id, 0)) == 0) continue;
+		n += len;
+		c = chunk_new(BUFFER_ID_SPLIT_FLUSH, "", 0);
+		c->ino = k->id;
+		c->offset = k->end;
+		split_cut(s, c);
+		if (c->refs == 0) {
+			c->refs++;
+			chunk_release(c);
+		}
+	}
+
+	return n;
+}
+
+/* the partial lines of ino (of every source if all) go as they are,
+ * to nginx and split, returns the bytes that went to split sinks
+ */
+static int flush_partial_lines(ino_t ino, int all)
+{
+	if (nginx) {
+		nginx_flush(nginx, ino, all);
+	}
+	return split ? split_flush(split, ino, all) : 0;
+}
+
+/* all of c is written to x (or given up on, x was detached)
+ */
+static void sink_ack(struct sink *x, struct chunk *c)
+{
+	if (c->origin) {
+		assert(c->origin->pieces > 0);
+		c->origin->pieces--;
+		split_ack(split);
+	} else if (x->split) {
+		/* a range of the source chunk itself
+		 */
+		assert(c->pieces > 0);
+		c->pieces--;
+		split_ack(split);
+	} else if (checkpoint && x->primary && c->ino) {
+		checkpoint_ack(checkpoint, c->ino, c->offset);
+	}
+}
+
+static struct split *split_new(int field)
+{
+	struct split *s = alloc_calloc(ALLOC_OTHER, 1, sizeof(struct split));
+	assert(s);
+	s->field = field;
+	strframer_init(s->framer, SPLIT_LINE_MAX, split_framed, s);
+	s->unacked = buffer_queue_new0();
+	return s;
+}
+
+/* svlogd, the split group and lossless routes, losing one of them
+ * is fatal
+ */
+static int sink_vital(struct sink *x)
+{
+	return x->primary || (x->split && x->policy == SINK_POLICY_BLOCK);
+}
+
+static void split_free(struct split *s)
+{
+	int i;
+	for (i = 0; i < SINK_MAX; i++) {
+		str_free(s->piece[i]);
+	}
+	strframer_free(s->framer);
+	buffer_queue_free(s->unacked);
+	alloc_free(ALLOC_OTHER, s);
+}
+
+/* hand the pages over instead of copying them, the chunk can't be
+ * recycled until the reader went past it
+ */
+static int sink_vmsplice(struct sink *x, struct buffer *b)
+{
+	struct iovec iov[1];
+	int n;
+	iov->iov_base = b->chunk->buf->s + b->pos;
+	iov->iov_len = b->end - b->pos;
+	/* pooled chunks start on a page boundary, a range leaves
+	 * the rest of the chunk to be read again
+	 */
+	n = vmsplice(x->fd, iov, 1, SPLICE_F_NONBLOCK | (b->pos == 0 && b->end == b->chunk->buf->len ? SPLICE_F_GIFT : 0));
+	if (n > 0) b->chunk->spliced = x->piped + n;
+	return n;
+}
+
+/* bytes the reader took out of the pipe so far
+ */
+static unsigned long long sink_consumed(struct sink *x)
+{
+	int n;
+	if (x->fd < 0 || ioctl(x->fd, FIONREAD, &n)) return x->piped;
+	return x->piped - n;
+}
+
+/* same write semantics
+ */
+int sink_write(struct sink *x, struct buffer *b)
+{
+	int n;
+
+	/* since we are using non-blocking io, try to write directly
+	 */
+	assert(x->fd >= 0);
+	assert(x->sp->pid == 0 || x->sp->child_fdin == x->fd);
+
+#ifdef SIMULATE_PARTIAL_SINK_FEED
+	if (b->pos == 0) {
+		n = write(x->fd, b->chunk->buf->s, b->end / 2);
+	} else {
+		n = write(x->fd, b->chunk->buf->s + b->pos, b->end - b->pos);
+	}
+#else
+	if (x->vmsplice && b->chunk->pooled) {
+		n = sink_vmsplice(x, b);
+	} else {
+		n = write(x->fd, b->chunk->buf->s + b->pos, b->end - b->pos);
+	}
+#endif
+	PROBE3(sink_write, x->fd, n, x->lag);
+	if (n < 0) {
+		int save_errno = errno;
+		assert(n == -1);
+		if (errno == EAGAIN) {
+			fr_record(FR_SINK_EAGAIN, x->fd, 0);
+			return -1;
+		}
+		if (errno == EINTR) return -1;
+		fr_record(FR_SINK_ERROR, x->fd, save_errno);
+		if (errno == EPIPE) {
+			DEBUG("sink pid=%i got EPIPE", x->sp->pid);
+			if (x->sp->child_fderr >= 0) {
+				char buf[4096];
+				int n;
+				if ((n = read(x->sp->child_fderr, buf, sizeof(buf)-1)) > 0) {
+					buf[n] = 0;
+					DEBUG("sink pid=%i stderr=[%s]", x->sp->pid, buf);
+				}
+			}
+			errno = save_errno;
+			return -1;
+		}
+		DEBUG("write(), errno=%i", save_errno);
+		errno = save_errno;
+		perror("write()");
+		exit(1);
+	}
+	if (n) {
+		b->pos += n;
+		x->lag -= n;
+		x->written += n;
+		x->piped += n;
+		fr_record(FR_SINK_WRITE, x->fd, n);
+	} else {
+		fr_record(FR_SINK_EOF, x->fd, 0);
+		DEBUG_INFO("sink pid=%i got EOF", x->sp->pid);
+		assert(x->got_eof == 0);
+		x->got_eof = 1;
+	}
+	return n;
+}
+
+/* same write semantics (except for EOF, must use x->got_eof), EAGAIN
+ * and EINTR are ignored
+ */
+int sink_write_from_queue(struct sink *x, struct buffer_queue *q)
+{
+	struct buffer *b;
+	int total = 0;
+	while ((b = buffer_queue_dequeue(q))) {
+		int n;
+		n = sink_write(x, b);
+		if (n < 0) {
+			int save_errno = errno;
+			assert(n == -1);
+			if (errno == EAGAIN) {
+				DEBUG_INFO("sink is busy. how many buffers remaining? %i", buffer_queue_len(q));
 				break;
 			}
 			if (errno == EINTR) {
@@ -391,7 +1174,7 @@ int sink_write_from_queue(struct sink *x, struct buffer_queue *q)
 			}
 			/* errors beyond recovery
 			 */
-			q->dequeue = buffer_tail0(b, q->dequeue); /* reschedule */
+			buffer_queue_requeue(q, b); /* reschedule */
 			if (errno == EPIPE) {
 				DEBUG("sink got unrecoverable error (EPIPE - broken pipe)");
 				errno = save_errno;
@@ -403,12 +1186,13 @@ int sink_write_from_queue(struct sink *x, struct buffer_queue *q)
 			return -1;
 		} else if (n) {
 			total += n;
-			if (b->pos < b->buf->len) {
+			if (b->pos < b->end) {
 				DEBUG_INFO("sink consumed (so far) %i bytes of %i, %i buffers enqueued",
-				      b->pos, b->buf->len, buffer_queue_len(q));
+				      b->pos, b->end, buffer_queue_len(q));
 				break;
 			}
 			DEBUG_INFO("sink consumed all %i bytes, %i buffers enqueued", b->pos, buffer_queue_len(q));
+			sink_ack(x, b->chunk);
 			/* discard consumed buffer
 			 */
 			buffer_free(b);
@@ -418,7 +1202,8 @@ int sink_write_from_queue(struct sink *x, struct buffer_queue *q)
 			break;
 		}
 	}
-	if (b) q->dequeue = buffer_tail0(b, q->dequeue); /* reschedule */
+	if (b) buffer_queue_requeue(q, b); /* reschedule */
+	PROBE3(sink_write_from_queue, x->fd, total, buffer_queue_len(q));
 	return total;
 }
 
@@ -429,12 +1214,10 @@ int wait_til_ready(int fd, int msec, int ready_for_read)
 {
 	int eintr_count = 0;
 	fd_set fds[1], *prfds = NULL, *pwfds = NULL;
-	struct timeval start[1];
+	long long start = timer_now_msec();
 	struct timeval tv[1];
 	long dmsec;
 
-	get_current_timeval(start);
-
 	DEBUG_INFO("wait_til_ready(fd=%i, msec=%i, ready_for_read=%i) begin", fd, msec, ready_for_read);
 
 	FD_ZERO(fds);
@@ -448,15 +1231,12 @@ int wait_til_ready(int fd, int msec, int ready_for_read)
 		FD_SET(fd, fds);
 
 		if (msec) {
-			struct timeval current[1];
-			get_current_timeval(current);
-			if ((dmsec = DELTA_MSEC(current, start)) > msec) {
+			if ((dmsec = timer_now_msec() - start) > msec) {
 				DEBUG("wait_til_ready(): timeout (time elapsed)");
 				errno = EAGAIN;
 				return -1;
 			}
-			tv->tv_sec = 0;
-			tv->tv_usec = (msec - dmsec) * 1000;
+			timer_msec_to_timeval(tv, msec - dmsec);
 		} else {
 			dmsec = 0;
 			tv->tv_sec = 0;
@@ -539,99 +1319,1278 @@ int sink_flush_all_buffers(struct sink *x, struct buffer_queue *q)
 	return total;
 }
 
-static int enqueue_til_settle(struct buffer_queue *q, struct cat_tap *input, int id, int msec_to_settle, char *buf, int bufsz)
+/* threaded sinks, each sink gets a writer thread fed through a
+ * lock-free ring, so a slow sink never stalls the taps or the
+ * rotation, buffers come back to the main thread through a second
+ * ring once written, chunks and the checkpoint never leave it
+ */
+
+DEFINE_RING_SPSC(buffer_ring, struct buffer *);
+
+#define SINK_THREAD_RING 128 /* power of two */
+
+struct sink_thread {
+	pthread_t thread;
+	struct sink *sink;
+	int cpu; /* -1 if not pinned */
+	int efd; /* eventfd, wakes the thread up */
+	struct buffer_ring *todo; /* main -> thread */
+	struct buffer_ring *done; /* thread -> main */
+	int inflight; /* in todo, in the thread or in done (main only) */
+	long long written; /* by the thread */
+	long long written_seen; /* by the main thread */
+	int error; /* errno, set by the thread before it quits */
+	int got_eof;
+	int stop;
+};
+
+/* eventfd shared by all sink threads to wake the main thread up
+ */
+static int sink_thread_wakeup = -1;
+
+static int pin_thread(pthread_t thread, int cpu)
+{
+	cpu_set_t set[1];
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+	return pthread_setaffinity_np(thread, sizeof(set), set);
+}
+
+/* buffers not written yet
+ */
+static int sink_pending(struct sink *x)
 {
-	fd_set rfds[1];
-	struct timeval tv[1];
-	int r, bytes_read;
-	int bql_before = buffer_queue_len(q);
+	return buffer_queue_len(x->q) + (x->t ? x->t->inflight : 0);
+}
 
-	assert(input->fd >= 0);
+static void *sink_thread_main(void *arg)
+{
+	struct sink_thread *t = arg;
+	struct sink *x = t->sink;
+	struct buffer *b = NULL;
+	struct pollfd pfd[2];
+	eventfd_t v;
+	int r;
 
-	DEBUG_INFO("enqueue_til_settle: queue len=%i, input->fd=%i, msec_to_settle=%i", bql_before, input->fd, msec_to_settle);
+	if (t->cpu >= 0 && (r = pin_thread(pthread_self(), t->cpu))) {
+		DEBUG("failed to pin sink fd=%i to cpu %i, errno=%i", x->fd, t->cpu, r);
+	}
 
-	FD_ZERO(rfds);
+	pfd[0].fd = t->efd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = x->fd;
+	pfd[1].events = POLLOUT;
 
 	for (;;) {
-		FD_SET(input->fd, rfds);
+		int n;
 
-		tv->tv_sec = 0;
-		tv->tv_usec = msec_to_settle * 1000;
+		if (__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) break;
 
-		r = select(input->fd + 1, rfds, NULL, NULL, tv);
-		if (r < 0) {
-			int save_errno = errno;
-			assert(r == -1);
-			if (errno == EINTR) {
-				DEBUG_INFO("select() received an EINTR, retrying");
-				continue;
-			}
-			DEBUG("select(), errno=%i", save_errno);
-			errno = save_errno;
-			perror("select()");
-			exit(1);
-		} else if (r) {
-			int n;
-			n = cat_tap_read(input, buf, bufsz-1);
-			if (n < 0) {
-				int save_errno = errno;
-				assert(n == -1);
-				if (errno == EAGAIN) {
-					DEBUG_INFO("cat_tap_read(input, buf, bufsz-1) got EAGAIN");
-					continue;
-				}
-				if (errno == EINTR) {
-					DEBUG_INFO("cat_tap_read(input, buf, bufsz-1) got EINTR");
-					continue;
-				}
-				DEBUG("cat_tap_read(), errno=%i", save_errno);
-				errno = save_errno;
-				perror("cat_tap_read()");
-				exit(1);
-			}
-			if (n) {
-				buf[n] = 0;
-				q->enqueue = buffer_new(q->enqueue, id, buf, n);
-				DEBUG_INFO("enqueue_til_settle: enqueued %i bytes", n);
-				bytes_read += n;
+		if (b == NULL && buffer_ring_pop(t->todo, &b)) {
+			b = NULL;
+			if (poll(pfd, 1, -1) > 0) eventfd_read(t->efd, &v);
+			continue;
+		}
+
+		n = write(x->fd, b->chunk->buf->s + b->pos, b->end - b->pos);
+		if (n > 0) {
+			fr_record(FR_SINK_WRITE, x->fd, n);
+			b->pos += n;
+			__atomic_add_fetch(&t->written, n, __ATOMIC_RELEASE);
+			if (b->pos < b->end) continue;
+			assert(buffer_ring_push(t->done, b) == 0);
+			b = NULL;
+			eventfd_write(sink_thread_wakeup, 1);
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0 && errno == EAGAIN) {
+			fr_record(FR_SINK_EAGAIN, x->fd, 0);
+			if (poll(pfd, 2, -1) > 0 && pfd[0].revents & POLLIN) eventfd_read(t->efd, &v);
+		} else {
+			if (n == 0) {
+				fr_record(FR_SINK_EOF, x->fd, 0);
+				DEBUG_INFO("sink fd=%i got EOF", x->fd);
+				__atomic_store_n(&t->got_eof, 1, __ATOMIC_RELEASE);
 			} else {
-				DEBUG_INFO("enqueue_til_settle: input->fd got EOF, something went wrong");
-				assert(input->got_eof);
-				break;
-			}
-			if (buffer_queue_len(q) - bql_before >= 100) {
-				DEBUG("enqueue_til_settle: input tap is not settling, exiting with %i buffers enqueued and errno=EAGAIN to avoid resource exhaustion", buffer_queue_len(q));
-				errno = EAGAIN;
-				return -1;
+				fr_record(FR_SINK_ERROR, x->fd, errno);
+				DEBUG("sink fd=%i write(), errno=%i", x->fd, errno);
+				__atomic_store_n(&t->error, errno, __ATOMIC_RELEASE);
 			}
-		} else {
-			/* timeout
-			 */
-			DEBUG_INFO("enqueue_til_settle: settled (timeout happened), new queue size is %i", buffer_queue_len(q));
 			break;
 		}
 	}
 
-	return 0;
+	/* hand back the buffer in hand, partially written or not
+	 */
+	if (b) assert(buffer_ring_push(t->done, b) == 0);
+	eventfd_write(sink_thread_wakeup, 1);
+
+	return NULL;
 }
 
-static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0, const char *input_path, long count_to_rotate, int exit_on_timeout)
+/* 0 on success, -1 on error and errno is set appropriately
+ */
+static int sink_thread_start(struct sink *x, int cpu)
 {
-	fd_set rfds[1], *prfds, wfds[1], *pwfds;
-	struct timeval tv[1];
+	struct sink_thread *t;
+	sigset_t all, old;
 	int r;
-	struct cat_tap input0[1];
-	struct cat_tap input1[1];
-	struct buffer_queue *q;
-	char *buf;
-	int bufsz = 0x100000 /* 1048576 */;
-	int current_input = 0; /* 0=input0, 1=input1 */
-	struct cat_tap *inputs[2] = {input0, input1};
-	DEFINE_STR(hanging_path);
-	int producer_is_gone = 0;
 
-	buf = malloc(bufsz);
+	assert(x->t == NULL);
+	assert(x->fd >= 0);
+	assert(sink_thread_wakeup >= 0);
+
+	t = calloc(1, sizeof(struct sink_thread));
+	assert(t);
+	t->sink = x;
+	t->cpu = cpu;
+	t->todo = buffer_ring_new0(SINK_THREAD_RING);
+	t->done = buffer_ring_new0(SINK_THREAD_RING);
+	assert(t->todo && t->done);
+
+	if ((t->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		int save_errno = errno;
+		DEBUG("eventfd(), errno=%i", save_errno);
+		buffer_ring_free0(t->todo);
+		buffer_ring_free0(t->done);
+		free(t);
+		errno = save_errno;
+		return -1;
+	}
+
+	/* signals are for the main thread only
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	r = pthread_create(&t->thread, NULL, sink_thread_main, t);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (r) {
+		DEBUG("pthread_create(), errno=%i", r);
+		close(t->efd);
+		buffer_ring_free0(t->todo);
+		buffer_ring_free0(t->done);
+		free(t);
+		errno = r;
+		return -1;
+	}
+
+	x->t = t;
+	return 0;
+}
+
+/* move enqueued buffers to the thread
+ */
+static void sink_thread_feed(struct sink *x)
+{
+	struct sink_thread *t = x->t;
+	int n = 0;
+	while (t->inflight < SINK_THREAD_RING && buffer_queue_len(x->q)) {
+		assert(buffer_ring_push(t->todo, buffer_queue_dequeue(x->q)) == 0);
+		t->inflight++;
+		n++;
+	}
+	if (n) eventfd_write(t->efd, 1);
+}
+
+/* take written buffers back, same write semantics (except for EOF,
+ * must use x->got_eof)
+ */
+static int sink_thread_collect(struct sink *x)
+{
+	struct sink_thread *t = x->t;
+	struct buffer *b;
+	long long w = __atomic_load_n(&t->written, __ATOMIC_ACQUIRE);
+	int n = w - t->written_seen;
+	int error;
+
+	t->written_seen = w;
+	x->lag -= n;
+	x->written += n;
+
+	while (buffer_ring_pop(t->done, &b) == 0) {
+		t->inflight--;
+		if (b->pos < b->end) {
+			buffer_queue_requeue(x->q, b); /* thread is gone */
+			continue;
+		}
+		sink_ack(x, b->chunk);
+		buffer_free(b);
+	}
+
+	if (__atomic_load_n(&t->got_eof, __ATOMIC_ACQUIRE)) x->got_eof = 1;
+	if ((error = __atomic_load_n(&t->error, __ATOMIC_ACQUIRE))) {
+		errno = error;
+		return -1;
+	}
+	return n;
+}
+
+/* join the thread, whatever it did not write is back in x->q
+ */
+static void sink_thread_stop(struct sink *x)
+{
+	struct sink_thread *t = x->t;
+	struct buffer_queue *q;
+	struct buffer *b;
+
+	__atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+	eventfd_write(t->efd, 1);
+	assert(pthread_join(t->thread, NULL) == 0);
+
+	q = buffer_queue_new0();
+	while (buffer_ring_pop(t->todo, &b) == 0) {
+		t->inflight--;
+		buffer_queue_enqueue(q, b);
+	}
+	while ((b = buffer_queue_dequeue(x->q))) {
+		buffer_queue_enqueue(q, b);
+	}
+	buffer_queue_free(x->q);
+	x->q = q;
+
+	sink_thread_collect(x);
+	assert(t->inflight == 0);
+
+	close(t->efd);
+	buffer_ring_free0(t->todo);
+	buffer_ring_free0(t->done);
+	free(t);
+	x->t = NULL;
+}
+
+/* fan-out, the same stream to many sinks, sinks[0] is svlogd and is
+ * the only one allowed to slow down the taps (SINK_POLICY_BLOCK),
+ * others must keep up or lose data (SINK_POLICY_DROP)
+ */
+
+struct fanout {
+	struct sink *sinks[SINK_MAX];
+	int n;
+	int threaded; /* one writer thread per sink */
+	int cpus[SINK_MAX + 1]; /* main thread first, then sinks */
+	int ncpus;
+};
+
+void fanout_add(struct fanout *f, struct sink *x, int policy, long max_lag)
+{
+	assert(f->n < SINK_MAX);
+	x->q = buffer_queue_new0();
+	x->policy = policy;
+	x->max_lag = max_lag;
+	x->primary = f->n == 0;
+	f->sinks[f->n++] = x;
+}
+
+void fanout_free_queues(struct fanout *f)
+{
+	int i;
+	for (i = 0; i < f->n; i++) {
+		buffer_queue_free(f->sinks[i]->q);
+		f->sinks[i]->q = NULL;
+	}
+}
+
+/* a secondary sink that failed is not worth stopping for
+ */
+static void fanout_detach(struct fanout *f, struct sink *x)
+{
+	struct buffer *b;
+	assert(!sink_vital(x));
+	if (x->t) sink_thread_stop(x);
+	DEBUG("detaching sink fd=%i, %lli bytes lost", x->fd, x->lag);
+	/* pieces it had are done with, as far as the checkpoint goes
+	 */
+	for (b = x->split ? x->q->head : NULL; b; b = b->tail) {
+		sink_ack(x, b->chunk);
+	}
+	x->dropped += x->lag;
+	x->lag = 0;
+	buffer_queue_free(x->q);
+	x->q = buffer_queue_new0();
+	sink_close_async(x);
+}
+
+/* duplicate (tee(2)) what is waiting in the tap pipe into sinks that
+ * are pipes and have nothing enqueued (so order is kept), those bytes
+ * are skipped when the chunk read next is enqueued, only worth doing
+ * with more than one sink (otherwise it is just one more syscall)
+ */
+static void fanout_tee(struct fanout *f, int fd)
+{
+	int i;
+	if (f->n < 2) return;
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		int n;
+		if (x->fd < 0 || !x->is_pipe || x->got_eof || x->lag || x->pending_tee || x->split) continue;
+		if ((n = tee(fd, x->fd, INT_MAX, SPLICE_F_NONBLOCK)) > 0) {
+			x->pending_tee = n;
+			x->piped += n;
+		} else if (n < 0 && errno == EINVAL) {
+			x->is_pipe = 0; /* won't get any better */
+		}
+	}
+}
+
+static void fanout_enqueue(struct fanout *f, struct chunk *c)
+{
+	int i;
+	assert(c->refs == 0);
+	fr_record(FR_ENQUEUE, c->buf->len, c->offset);
+	if (nginx) {
+		nginx_feed(nginx, c->ino, c->buf->s, c->buf->len);
+	}
+	if (split) {
+		split_enqueue(split, c);
+	}
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		int skip = x->pending_tee;
+		if (x->split) continue;
+		if (skip > c->buf->len) skip = c->buf->len;
+		x->pending_tee -= skip;
+		x->teed += skip;
+		if (skip == c->buf->len) {
+			if (checkpoint && x->primary && c->ino) {
+				checkpoint_ack(checkpoint, c->ino, c->offset);
+			}
+			continue;
+		}
+		if (x->fd < 0 || x->got_eof ||
+		    (x->policy == SINK_POLICY_DROP && x->lag + c->buf->len - skip > x->max_lag)) {
+			x->dropped += c->buf->len - skip;
+			continue;
+		}
+		buffer_queue_enqueue(x->q, buffer_new(c, skip));
+		x->lag += c->buf->len - skip;
+	}
+	if (c->refs == 0) {
+		c->refs++;
+		chunk_release(c);
+	}
+}
+
+/* queue length that should hold the taps back
+ */
+static int fanout_blocking_len(struct fanout *f)
+{
+	int i, r = 0;
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		if (x->policy == SINK_POLICY_BLOCK) r = MAX2(r, sink_pending(x));
+	}
+	return r;
+}
+
+/* buffers the threads of blocking sinks still have to write
+ */
+static int fanout_threads_pending(struct fanout *f)
+{
+	int i, r = 0;
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		if (x->t && x->policy == SINK_POLICY_BLOCK) r += sink_pending(x);
+	}
+	return r;
+}
+
+/* "alloc.<subsystem>.{calls,bytes,live,steady}"
+ */
+static void alloc_stats()
+{
+	static long long *counters[ALLOC_NSUBSYS][4];
+	struct alloc_counts c[1];
+	int i;
+
+	for (i = 0; i < ALLOC_NSUBSYS; i++) {
+		alloc_get_counts(i, c);
+		if (counters[i][0] == NULL) {
+			if (c->calls == 0) continue; /* unused so far */
+			counters[i][0] = stats_counter("alloc.%s.calls", alloc_subsys_name(i));
+			counters[i][1] = stats_counter("alloc.%s.bytes", alloc_subsys_name(i));
+			counters[i][2] = stats_counter("alloc.%s.live", alloc_subsys_name(i));
+			counters[i][3] = stats_counter("alloc.%s.steady", alloc_subsys_name(i));
+		}
+		*counters[i][0] = c->calls;
+		*counters[i][1] = c->bytes;
+		*counters[i][2] = c->live;
+		*counters[i][3] = c->steady;
+	}
+}
+
+static void fanout_stats(struct fanout *f)
+{
+	int i;
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		*stats_counter("sink.%i.lag_bytes", i) = x->lag;
+		*stats_counter("sink.%i.written_bytes", i) = x->written;
+		*stats_counter("sink.%i.dropped_bytes", i) = x->dropped;
+		*stats_counter("sink.%i.teed_bytes", i) = x->teed;
+		*stats_counter("sink.%i.buffers", i) = sink_pending(x);
+	}
+	if (split) {
+		for (i = 0; i < split->ngroup; i++) {
+			*stats_counter("split.%i.lines", i) = split->lines[i];
+			*stats_counter("split.%i.written_bytes", i) = split->sinks[i]->written;
+		}
+		for (i = 0; i < split->nroutes; i++) {
+			*stats_counter("route.%i.lines", i) = split->lines[split->routes[i].sink];
+			*stats_counter("route.%i.written_bytes", i) = split->sinks[split->routes[i].sink]->written;
+			*stats_counter("route.%i.dropped_bytes", i) = split->sinks[split->routes[i].sink]->dropped;
+		}
+		for (i = 0; i < split->nfilters; i++) {
+			*stats_counter("filter.%i.kept_lines", i) = split->filters[i].kept;
+			*stats_counter("filter.%i.dropped_lines", i) = split->filters[i].dropped;
+			*stats_counter("filter.%i.dropped_bytes", i) = split->filters[i].dropped_bytes;
+		}
+	}
+	perfctr_stats(f->sinks[0]->written, *stats_counter("rotate.count"));
+	alloc_stats();
+}
+
+/* 0 on success, -1 on error and errno is set appropriately
+ */
+static int fanout_threads_start(struct fanout *f)
+{
+	int i, r;
+	if (f->ncpus && (r = pin_thread(pthread_self(), f->cpus[0]))) {
+		DEBUG("failed to pin main thread to cpu %i, errno=%i", f->cpus[0], r);
+	}
+	if (!f->threaded) return 0;
+	if ((sink_thread_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+		return -1;
+	}
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		int cpu = f->ncpus > 1 ? f->cpus[1 + i % (f->ncpus - 1)] : -1;
+		if (x->fd < 0) continue;
+		if (sink_thread_start(x, cpu)) return -1;
+		DEBUG_INFO("sink fd=%i has its own thread, cpu=%i", x->fd, cpu);
+	}
+	return 0;
+}
+
+static void fanout_threads_stop(struct fanout *f)
+{
+	int i;
+	for (i = 0; i < f->n; i++) {
+		if (f->sinks[i]->t) sink_thread_stop(f->sinks[i]);
+	}
+	if (sink_thread_wakeup >= 0) {
+		close(sink_thread_wakeup);
+		sink_thread_wakeup = -1;
+	}
+}
+
+static void fanout_threads_feed(struct fanout *f)
+{
+	int i;
+	for (i = 0; i < f->n; i++) {
+		if (f->sinks[i]->t) sink_thread_feed(f->sinks[i]);
+	}
+}
+
+/* same write semantics as sink_write_from_queue for the primary sink
+ * and the split group, secondary sinks that failed are detached
+ */
+static int fanout_threads_collect(struct fanout *f)
+{
+	eventfd_t v;
+	int i, total = 0;
+	eventfd_read(sink_thread_wakeup, &v);
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		int n;
+		if (x->t == NULL) continue;
+		n = sink_thread_collect(x);
+		if (n < 0 && sink_vital(x)) {
+			return -1;
+		}
+		if (x->got_eof && sink_vital(x) && !x->primary) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (n < 0 || x->got_eof) {
+			if (!x->primary) fanout_detach(f, x);
+			continue;
+		}
+		total += n;
+	}
+	return total;
+}
+
+/* io_uring batch, per main loop round the reads of every ready tap
+ * and the writes to every ready sink go in one syscall, each tap role
+ * reads into its own (registered) buffer, writes to the same sink are
+ * linked so they land in order
+ */
+
+#define IO_BATCH_STDIN 0
+#define IO_BATCH_HANGING 1
+#define IO_BATCH_CURRENT 2
+#define IO_BATCH_TAPS 3
+
+#define IO_BATCH_WRITES 16 /* per sink and round */
+#define IO_BATCH_WRITE_TAG 0x10000
+
+struct io_batch {
+	struct uring *u; /* NULL if select and read/write */
+	int fixed; /* buffers are registered */
+	char *buf[IO_BATCH_TAPS];
+	int fd[IO_BATCH_TAPS]; /* -1 if no read result */
+	int res[IO_BATCH_TAPS];
+	int nr;
+	struct buffer *wb[SINK_MAX][IO_BATCH_WRITES];
+	int wres[SINK_MAX][IO_BATCH_WRITES];
+	int wn[SINK_MAX];
+	int nw;
+	long long *submits; /* stats */
+	long long *ops;
+};
+
+/* 0 on success, -1 on error and errno is set appropriately, b is
+ * usable anyway (all taps read into buf with select and read/write)
+ */
+static int io_batch_init(struct io_batch *b, char *buf, int bufsz, int use_uring)
+{
+	struct iovec iov[IO_BATCH_TAPS];
+	int i;
+
+	memset(b, 0, sizeof(struct io_batch));
+	for (i = 0; i < IO_BATCH_TAPS; i++) {
+		b->fd[i] = -1;
+		b->buf[i] = buf;
+	}
+
+	if (!use_uring) return 0;
+	if ((b->u = uring_new(SINK_MAX * IO_BATCH_WRITES + IO_BATCH_TAPS)) == NULL) {
+		return -1;
+	}
+	b->submits = stats_counter("io_uring.submits");
+	b->ops = stats_counter("io_uring.ops");
+
+	/* one buffer per tap role, stdin's is the caller's
+	 */
+	b->buf[IO_BATCH_STDIN] = buf;
+	b->buf[IO_BATCH_HANGING] = malloc(bufsz);
+	b->buf[IO_BATCH_CURRENT] = malloc(bufsz);
+	assert(b->buf[IO_BATCH_HANGING] && b->buf[IO_BATCH_CURRENT]);
+
+	for (i = 0; i < IO_BATCH_TAPS; i++) {
+		iov[i].iov_base = b->buf[i];
+		iov[i].iov_len = bufsz;
+	}
+	if (uring_register_buffers(b->u, iov, IO_BATCH_TAPS) == 0) {
+		b->fixed = 1;
+	} else {
+		DEBUG("io_uring buffers not registered (errno=%i), reading without", errno);
+	}
+
+	return 0;
+}
+
+static void io_batch_free(struct io_batch *b)
+{
+	if (b->u) {
+		uring_free(b->u);
+		free(b->buf[IO_BATCH_HANGING]);
+		free(b->buf[IO_BATCH_CURRENT]);
+	}
+	memset(b, 0, sizeof(struct io_batch));
+}
+
+static void io_batch_read(struct io_batch *b, int slot, int fd, int bufsz)
+{
+	assert(b->fd[slot] == -1);
+	assert(uring_read(b->u, fd, b->buf[slot], bufsz, b->fixed ? slot : -1, slot) == 0);
+	b->fd[slot] = fd;
+	b->nr++;
+}
+
+/* enqueued buffers of a ready sink, taken off the queue until done
+ */
+static void io_batch_write(struct io_batch *b, int i, struct sink *x)
+{
+	struct buffer *w;
+	int j;
+	assert(b->wn[i] == 0);
+	while (b->wn[i] < IO_BATCH_WRITES && (w = buffer_queue_dequeue(x->q))) {
+		b->wb[i][b->wn[i]++] = w;
+	}
+	for (j = 0; j < b->wn[i]; j++) {
+		w = b->wb[i][j];
+		assert(uring_write(b->u, x->fd, w->chunk->buf->s + w->pos, w->end - w->pos,
+				   j < b->wn[i] - 1 /* link */, IO_BATCH_WRITE_TAG | i << 8 | j) == 0);
+	}
+	b->nw += b->wn[i];
+}
+
+/* one syscall, return 0 on success, -1 on error and errno is set
+ * appropriately, a read that would block is as if never asked
+ */
+static int io_batch_submit(struct io_batch *b)
+{
+	unsigned long long data;
+	int res;
+	int n = b->nr + b->nw;
+	if (n == 0) return 0;
+	if (uring_submit_and_wait(b->u, n) < 0) {
+		return -1;
+	}
+	*b->submits += 1;
+	*b->ops += n;
+	while (n && uring_complete(b->u, &data, &res) == 0) {
+		if (data & IO_BATCH_WRITE_TAG) {
+			b->wres[(data >> 8) & 0xff][data & 0xff] = res;
+		} else if (res == -EAGAIN || res == -EINTR) {
+			b->fd[data] = -1;
+		} else {
+			b->res[data] = res;
+		}
+		n--;
+	}
+	assert(n == 0);
+	b->nr = 0;
+	b->nw = 0;
+	return 0;
+}
+
+/* a read result is there (io_uring) or the tap is ready (select)
+ */
+static int io_batch_ready(struct io_batch *b, int slot, int fd, fd_set *rfds)
+{
+	if (fd == -1) return 0;
+	return b->u ? b->fd[slot] == fd : FD_ISSET(fd, rfds);
+}
+
+/* read semantics
+ */
+static int io_batch_take(struct io_batch *b, int slot)
+{
+	int res = b->res[slot];
+	assert(b->fd[slot] != -1);
+	b->fd[slot] = -1;
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+/* a read of tap x that io_uring completed in this round is off the
+ * pipe already, it goes to the sinks before x is closed, returns the
+ * bytes enqueued
+ */
+static int io_batch_take_last(struct io_batch *b, int slot, struct cat_tap *x, int id, struct fanout *f)
+{
+	struct chunk *c;
+	int n;
+	if (b->u == NULL || !io_batch_ready(b, slot, x->fd, NULL)) return 0;
+	if ((n = cat_tap_read_result(x, io_batch_take(b, slot))) <= 0) return 0;
+	b->buf[slot][n] = 0;
+	c = chunk_new(id, b->buf[slot], n);
+	cat_tap_mark(x, c);
+	fanout_enqueue(f, c);
+	return n;
+}
+
+/* forget reads of closed taps
+ */
+static void io_batch_drop_reads(struct io_batch *b)
+{
+	int i;
+	for (i = 0; i < IO_BATCH_TAPS; i++) {
+		b->fd[i] = -1;
+	}
+}
+
+/* same write semantics as sink_write_from_queue, whatever was not
+ * written goes back to the head of the queue
+ */
+static int sink_write_batch_result(struct sink *x, struct io_batch *b, int i)
+{
+	int j, total = 0, error = 0;
+
+	for (j = 0; j < b->wn[i]; j++) {
+		struct buffer *w = b->wb[i][j];
+		int n = b->wres[i][j];
+		if (n < 0) {
+			if (n == -EAGAIN) fr_record(FR_SINK_EAGAIN, x->fd, 0);
+			if (n != -EAGAIN && n != -EINTR && n != -ECANCELED) error = -n;
+			if (error) fr_record(FR_SINK_ERROR, x->fd, error);
+			break;
+		}
+		if (n == 0) {
+			fr_record(FR_SINK_EOF, x->fd, 0);
+			DEBUG_INFO("sink pid=%i got EOF", x->sp->pid);
+			x->got_eof = 1;
+			break;
+		}
+		fr_record(FR_SINK_WRITE, x->fd, n);
+		w->pos += n;
+		x->lag -= n;
+		x->written += n;
+		total += n;
+		if (w->pos < w->end) break; /* short, rest was canceled */
+		sink_ack(x, w->chunk);
+		buffer_free(w);
+	}
+
+	while (b->wn[i] > j) {
+		buffer_queue_requeue(x->q, b->wb[i][--b->wn[i]]);
+	}
+	b->wn[i] = 0;
+
+	if (error) {
+		DEBUG("sink fd=%i write(), errno=%i", x->fd, error);
+		errno = error;
+		return -1;
+	}
+	return total;
+}
+
+/* same write semantics as sink_write_from_queue for the primary sink
+ * and the split group, secondary sinks that failed are detached
+ */
+static int fanout_write_batch_result(struct fanout *f, struct io_batch *b)
+{
+	int i, n, total = 0;
+	for (i = f->n - 1; i >= 0; i--) {
+		struct sink *x = f->sinks[i];
+		if (b->wn[i] == 0) continue;
+		if ((n = sink_write_batch_result(x, b, i)) < 0 && sink_vital(x)) {
+			return -1;
+		}
+		if (x->got_eof && sink_vital(x) && !x->primary) {
+			errno = EPIPE;
+			return -1;
+		}
+		if (n < 0 || (x->got_eof && !x->primary)) {
+			fanout_detach(f, x);
+			continue;
+		}
+		total += n;
+	}
+	return total;
+}
+
+/* -X, at rotation the hanging file about to be replaced is moved
+ * aside as <log>.<inode> and given to "sh -c command" as $1, which
+ * owns it from then on, up to one per cpu run at once, NULL if
+ * disabled
+ */
+
+static struct executor *post_rotate = NULL;
+static char *post_rotate_command = NULL;
+
+struct post_rotate_job {
+	struct subprocess sp[1];
+	char *argv[6];
+	struct str path[1];
+};
+
+static void post_rotate_output(struct subprocess *sp, void *data, int sz)
+{
+	if (write(STDERR_FILENO, data, sz)) {
+		/* nothing to do */
+	}
+}
+
+static struct subprocess_callbacks post_rotate_callbacks[1] = {{0, 0, 0, post_rotate_output, post_rotate_output, NULL, NULL, NULL}};
+
+static void post_rotate_done(struct subprocess *sp, void *arg)
+{
+	struct post_rotate_job *j = arg;
+	if (sp->pid == 0 || !WIFEXITED(sp->exit_status) || WEXITSTATUS(sp->exit_status)) {
+		DEBUG("post-rotate command failed for [%s], exit status %i", j->path->s, sp->exit_status);
+		*stats_counter("post_rotate.failed") += 1;
+	} else {
+		DEBUG_INFO("post-rotate command done for [%s]", j->path->s);
+		*stats_counter("post_rotate.done") += 1;
+	}
+	str_free(j->path);
+	free(j);
+}
+
+/* 0 on success (or no hanging file), -1 on error and errno is set
+ * appropriately
+ */
+static int post_rotate_submit(const char *hanging_path, const char *log_path)
+{
+	struct post_rotate_job *j;
+	struct stat st[1];
+
+	if (stat(hanging_path, st)) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	j = calloc(1, sizeof(struct post_rotate_job));
+	assert(j);
+	str_copyf(j->path, "%s.%llu", log_path, (unsigned long long)st->st_ino);
+	if (rename(hanging_path, j->path->s)) {
+		int save_errno = errno;
+		DEBUG("rename(hanging_path=[%s], [%s]), errno=%i", hanging_path, j->path->s, save_errno);
+		str_free(j->path);
+		free(j);
+		errno = save_errno;
+		return -1;
+	}
+
+	j->argv[0] = "/bin/sh";
+	j->argv[1] = "-c";
+	j->argv[2] = post_rotate_command;
+	j->argv[3] = "aimant-post-rotate"; /* $0 */
+	j->argv[4] = j->path->s;
+	j->argv[5] = NULL;
+	j->sp->argv = j->argv;
+	j->sp->pidfd = -1;
+	assert(executor_submit(post_rotate, j->sp, post_rotate_callbacks, post_rotate_done, j) == 0);
+	*stats_counter("post_rotate.submitted") += 1;
+
+	/* start it now, not on the next wake up
+	 */
+	executor_run(post_rotate, 0);
+	return 0;
+}
+
+/* a hanging file svlogd already has is dead weight, with -R what was
+ * acked is dropped from the page cache and punched out of the disk,
+ * and the file goes away once drained and quiet (a restart only needs
+ * what was not acked)
+ */
+
+#define RECLAIM_MSEC 1000
+#define RECLAIM_QUIET_MSEC 5000 /* the producer had time to reopen */
+
+struct reclaim {
+	int fd; /* hanging file, -1 if none */
+	dev_t dev;
+	ino_t ino;
+	off_t released; /* dropped up to here */
+	off_t size; /* last seen */
+	off_t acked; /* last seen */
+	long long changed; /* size or acked, timer_now_msec() */
+	int no_punch; /* filesystem can't */
+	long long *punched; /* stats */
+	long long *unlinked;
+};
+
+void reclaim_init(struct reclaim *r)
+{
+	memset(r, 0, sizeof(struct reclaim));
+	r->fd = -1;
+	r->punched = stats_counter("hanging.punched_bytes");
+	r->unlinked = stats_counter("hanging.unlinked");
+}
+
+static void hanging_reclaim(struct reclaim *r, const char *path, struct checkpoint_slot *slot)
+{
+	struct stat st[1];
+	long long now;
+	off_t end;
+
+	if (slot->ino == 0) return;
+
+	now = timer_now_msec();
+
+	if (r->ino != slot->ino || r->dev != slot->dev) {
+		if (r->fd >= 0) close(r->fd);
+		r->dev = slot->dev;
+		r->ino = slot->ino;
+		r->released = 0;
+		r->size = -1;
+		r->acked = -1;
+		r->changed = now;
+		if ((r->fd = open(path, O_WRONLY | O_CLOEXEC)) >= 0 && (fstat(r->fd, st) || st->st_ino != slot->ino || st->st_dev != slot->dev)) {
+			close(r->fd);
+			r->fd = -1;
+		}
+	}
+
+	if (r->fd < 0) return;
+
+	assert(fstat(r->fd, st) == 0);
+
+	if (st->st_size != r->size || slot->acked != r->acked) {
+		r->size = st->st_size;
+		r->acked = slot->acked;
+		r->changed = now;
+	}
+
+	end = slot->acked - slot->acked % st->st_blksize;
+	if (end > r->released) {
+		posix_fadvise(r->fd, r->released, end - r->released, POSIX_FADV_DONTNEED);
+		if (r->no_punch) {
+			/* page cache only */
+		} else if (fallocate(r->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, r->released, end - r->released)) {
+			DEBUG("fallocate([%s], FALLOC_FL_PUNCH_HOLE), errno=%i, not punching anymore", path, errno);
+			r->no_punch = 1;
+		} else {
+			*r->punched += end - r->released;
+		}
+		r->released = end;
+	}
+
+	if (slot->acked >= st->st_size && now - r->changed >= RECLAIM_QUIET_MSEC) {
+		struct stat cur[1];
+		/* path may be a newer hanging file by now
+		 */
+		if (stat(path, cur) == 0 && cur->st_ino == slot->ino && cur->st_dev == slot->dev && unlink(path) == 0) {
+			DEBUG_INFO("[%s] drained, unlinked", path);
+			*r->unlinked += 1;
+		}
+		close(r->fd);
+		r->fd = -1;
+	}
+}
+
+/* what doit does on its own, as timers, they are armed again only
+ * after some activity (or an idle timeout), so an idle aimant sleeps
+ */
+struct doit_timers {
+	struct timer idle[1]; /* no fd got ready for a while */
+	struct timer checkpoint[1];
+	struct timer stats[1];
+	struct timer reclaim[1];
+	int timed_out;
+	struct fanout *f;
+	const char *checkpoint_path;
+	const char *stats_path;
+	struct reclaim *r;
+	const char *hanging_path;
+};
+
+static void doit_idle(struct timer *t, void *arg)
+{
+	struct doit_timers *x = arg;
+	x->timed_out = 1;
+}
+
+static void doit_checkpoint(struct timer *t, void *arg)
+{
+	struct doit_timers *x = arg;
+	if (checkpoint_save_lazy(checkpoint, x->checkpoint_path, 0)) {
+		perror(x->checkpoint_path);
+	}
+}
+
+static void doit_stats(struct timer *t, void *arg)
+{
+	struct doit_timers *x = arg;
+	fanout_stats(x->f);
+	if (stats_dump(x->stats_path)) {
+		perror(x->stats_path);
+	}
+}
+
+static void doit_reclaim(struct timer *t, void *arg)
+{
+	struct doit_timers *x = arg;
+	hanging_reclaim(x->r, x->hanging_path, checkpoint->hanging);
+}
+
+static void doit_timers_arm(struct doit_timers *x, int idle_msec)
+{
+	timer_arm(x->idle, idle_msec);
+	if (x->checkpoint_path && !timer_armed(x->checkpoint)) {
+		timer_arm(x->checkpoint, CHECKPOINT_SAVE_MSEC);
+	}
+	if (x->stats_path && !timer_armed(x->stats)) {
+		timer_arm(x->stats, STATS_DUMP_MSEC);
+	}
+	if (x->r && !timer_armed(x->reclaim)) {
+		timer_arm(x->reclaim, RECLAIM_MSEC);
+	}
+}
+
+static void doit_timers_cancel(struct doit_timers *x)
+{
+	timer_cancel(x->idle);
+	timer_cancel(x->checkpoint);
+	timer_cancel(x->stats);
+	timer_cancel(x->reclaim);
+}
+
+static int enqueue_til_settle(struct fanout *f, struct cat_tap *input, int id, int msec_to_settle, char *buf, int bufsz)
+{
+	fd_set rfds[1];
+	struct timeval tv[1];
+	int r, bytes_read;
+	int enqueued = 0;
+
+	assert(input->fd >= 0);
+
+	DEBUG_INFO("enqueue_til_settle: queue len=%i, input->fd=%i, msec_to_settle=%i", fanout_blocking_len(f), input->fd, msec_to_settle);
+
+	FD_ZERO(rfds);
+
+	for (;;) {
+		FD_SET(input->fd, rfds);
+
+		timer_msec_to_timeval(tv, msec_to_settle);
+
+		r = select(input->fd + 1, rfds, NULL, NULL, tv);
+		if (r < 0) {
+			int save_errno = errno;
+			assert(r == -1);
+			if (errno == EINTR) {
+				DEBUG_INFO("select() received an EINTR, retrying");
+				continue;
+			}
+			DEBUG("select(), errno=%i", save_errno);
+			errno = save_errno;
+			perror("select()");
+			exit(1);
+		} else if (r) {
+			int n;
+			fanout_tee(f, input->fd);
+			n = cat_tap_read(input, buf, bufsz-1);
+			if (n < 0) {
+				int save_errno = errno;
+				assert(n == -1);
+				if (errno == EAGAIN) {
+					DEBUG_INFO("cat_tap_read(input, buf, bufsz-1) got EAGAIN");
+					continue;
+				}
+				if (errno == EINTR) {
+					DEBUG_INFO("cat_tap_read(input, buf, bufsz-1) got EINTR");
+					continue;
+				}
+				DEBUG("cat_tap_read(), errno=%i", save_errno);
+				errno = save_errno;
+				perror("cat_tap_read()");
+				exit(1);
+			}
+			if (n) {
+				buf[n] = 0;
+				struct chunk *c = chunk_new(id, buf, n);
+				cat_tap_mark(input, c);
+				fanout_enqueue(f, c);
+				DEBUG_INFO("enqueue_til_settle: enqueued %i bytes", n);
+				bytes_read += n;
+			} else {
+				DEBUG_INFO("enqueue_til_settle: input->fd got EOF, something went wrong");
+				assert(input->got_eof);
+				break;
+			}
+			if (++enqueued >= 100) {
+				DEBUG("enqueue_til_settle: input tap is not settling, exiting with %i buffers enqueued and errno=EAGAIN to avoid resource exhaustion", fanout_blocking_len(f));
+				errno = EAGAIN;
+				return -1;
+			}
+		} else {
+			/* timeout
+			 */
+			DEBUG_INFO("enqueue_til_settle: settled (timeout happened), new queue size is %i", fanout_blocking_len(f));
+			break;
+		}
+	}
+
+	return 0;
+}
+
+/* the sinks that must not lose anything, see sink_vital()
+ */
+static int catch_up_flush(struct fanout *f)
+{
+	int i;
+	for (i = 0; i < f->n; i++) {
+		struct sink *x = f->sinks[i];
+		if (!sink_vital(x)) continue;
+		if (sink_flush_all_buffers(x, x->q) < 0 || x->got_eof) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* read path from offset up to its current end straight into the
+ * sink, large reads with sequential readahead, this is the catch-up
+ * after a restart, returns the offset reached or -1 on error
+ */
+static off_t catch_up(struct fanout *f, const char *path, int id, off_t offset, char *buf, int bufsz)
+{
+	int fd;
+	struct stat st[1];
+	off_t start = offset;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		int save_errno = errno;
+		assert(fd == -1);
+		DEBUG("open(path=[%s], O_RDONLY), errno=%i", path, save_errno);
+		errno = save_errno;
+		perror(path);
+		return -1;
+	}
+	assert(fstat(fd, st) == 0);
+
+	if (offset > st->st_size) {
+		DEBUG("catch_up: [%s] is shorter (%lli) than checkpoint (%lli), starting over",
+		      path, (long long)st->st_size, (long long)offset);
+		offset = start = 0;
+	}
+
+	posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+
+	if (lseek(fd, offset, SEEK_SET) < 0) {
+		int save_errno = errno;
+		DEBUG("lseek(fd=%i, offset=%lli, SEEK_SET), errno=%i", fd, (long long)offset, save_errno);
+		assert(close(fd) == 0);
+		errno = save_errno;
+		return -1;
+	}
+
+	for (;;) {
+		int n = read(fd, buf, bufsz - 1);
+		if (n < 0) {
+			int save_errno = errno;
+			assert(n == -1);
+			if (errno == EINTR) continue;
+			DEBUG("read(fd=%i [%s]), errno=%i", fd, path, save_errno);
+			assert(close(fd) == 0);
+			errno = save_errno;
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+		offset += n;
+		{
+			struct chunk *c = chunk_new(id, buf, n);
+			c->ino = st->st_ino;
+			c->offset = offset;
+			fanout_enqueue(f, c);
+		}
+		if (fanout_blocking_len(f) >= 16) {
+			if (catch_up_flush(f)) {
+				assert(close(fd) == 0);
+				return -1;
+			}
+		}
+	}
+
+	posix_fadvise(fd, start, offset - start, POSIX_FADV_DONTNEED);
+	assert(close(fd) == 0);
+
+	if (catch_up_flush(f)) {
+		return -1;
+	}
+
+	DEBUG("catch_up: [%s] from %lli to %lli", path, (long long)start, (long long)offset);
+
+	return offset;
+}
+
+/* open taps where the checkpoint says we stopped, a .hanging file
+ * left behind by a crash mid-rotation is drained first, returns 1 if
+ * the producer must be told to reopen its log, 0 if not, -1 on error
+ */
+static int resume(struct fanout *f, struct cat_tap *current, struct cat_tap *hanging,
+		  const char *input_path, const char *hanging_path, char *buf, int bufsz)
+{
+	struct stat st[1];
+	struct checkpoint_slot *slot;
+	struct checkpoint_slot new_current[1];
+	struct checkpoint_slot new_hanging[1];
+	off_t offset;
+	int r = 0;
+
+	memset(new_current, 0, sizeof(new_current));
+	memset(new_hanging, 0, sizeof(new_hanging));
+
+	/* a hanging file we do not know about was fully consumed
+	 * before (or is none of our business)
+	 */
+	if (stat(hanging_path, st) == 0 && (slot = checkpoint_slot_by_ino(checkpoint, st->st_dev, st->st_ino))) {
+		*new_hanging = *slot;
+		new_hanging->dev = st->st_dev;
+		new_hanging->offset = slot->acked;
+	}
+
+	if (stat(input_path, st)) {
+		int fd;
+		if (errno != ENOENT) {
+			perror(input_path);
+			return -1;
+		}
+		/* crashed between rename and create
+		 */
+		if ((fd = open(input_path, O_WRONLY | O_CREAT, 0644)) < 0) {
+			perror(input_path);
+			return -1;
+		}
+		assert(fstat(fd, st) == 0);
+		assert(close(fd) == 0);
+		r = 1;
+	}
+	if ((slot = checkpoint_slot_by_ino(checkpoint, st->st_dev, st->st_ino))) {
+		*new_current = *slot;
+		new_current->dev = st->st_dev;
+		new_current->offset = slot->acked;
+	} else {
+		/* created after the checkpoint, all of it is new
+		 */
+		new_current->dev = st->st_dev;
+		new_current->ino = st->st_ino;
+	}
+
+	*checkpoint->current = *new_current;
+	*checkpoint->hanging = *new_hanging;
+	checkpoint->dirty = 1;
+
+	if (new_hanging->ino) {
+		if ((offset = catch_up(f, hanging_path, BUFFER_ID_TAP_HANGING_NORMAL, new_hanging->acked, buf, bufsz)) < 0) {
+			return -1;
+		}
+		if (cat_tap_open(hanging, hanging_path, offset)) {
+			return -1;
+		}
+		/* the producer may still be writing there
+		 */
+		r = 1;
+	}
+
+	if ((offset = catch_up(f, input_path, BUFFER_ID_TAP_CURRENT, new_current->acked, buf, bufsz)) < 0) {
+		return -1;
+	}
+	if (cat_tap_open(current, input_path, offset)) {
+		return -1;
+	}
+
+	return r;
+}
+
+static int doit(int pid_to_send_signal, struct fanout *f, struct fd_tap *fd0, const char *input_path, long count_to_rotate, int exit_on_timeout,
+		const char *checkpoint_path, const char *stats_path, int use_uring, struct reclaim *reclaim)
+{
+	struct sink *svlogd = f->sinks[0];
+	fd_set rfds[1], *prfds, wfds[1], *pwfds;
+	int r;
+	struct cat_tap input0[1];
+	struct cat_tap input1[1];
+	struct buffer_queue *q = svlogd->q;
+	char *buf;
+	int bufsz = 0x100000 /* 1048576 */;
+	int current_input = 0; /* 0=input0, 1=input1 */
+	struct cat_tap *inputs[2] = {input0, input1};
+	struct str_arena *arena = str_arena_new(PATH_MAX); /* strings of this scope */
+	DEFINE_STR_ARENA(hanging_path, arena);
+	int producer_is_gone = 0;
+	struct io_batch batch[1];
+	struct doit_timers timers[1];
+	int tfd = timer_fd();
+	long long *rotations = stats_counter("rotate.count");
+	int loops = 0; /* steady state (alloc_steady) after warm-up */
+	int active = 1; /* an fd got ready, or the idle timer fired */
+
+	buf = malloc(bufsz);
 	assert(buf);
+	assert(tfd >= 0);
+
+	if (io_batch_init(batch, buf, bufsz, use_uring)) {
+		DEBUG("io_uring is not available (errno=%i), falling back to select", errno);
+	}
 
 	memset(input0, 0, sizeof(input0));
 	memset(input1, 0, sizeof(input1));
@@ -644,27 +2603,96 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 
 	assert(svlogd->sp->pid > 0);
 
-	assert(cat_tap_open(input0, input_path, 1 /* seek end */) == 0);
-
 	str_copyz(hanging_path, input_path);
 	str_catz(hanging_path, ".hanging");
 
-	q = buffer_queue_new0();
+	if (checkpoint_path || reclaim) {
+		/* -R needs to know what svlogd has as well, it is
+		 * only saved with -k though
+		 */
+		static struct checkpoint checkpoint0[1];
+		checkpoint = checkpoint0;
+	}
 
-	FD_ZERO(rfds);
-	FD_ZERO(wfds);
+	if (checkpoint_path && checkpoint_load(checkpoint, checkpoint_path) == 0) {
+		if ((r = resume(f, input0, input1, input_path, hanging_path->s, buf, bufsz)) < 0) {
+			DEBUG("failed to resume from checkpoint [%s]", checkpoint_path);
+			exit(1);
+		}
+		if (r && kill(pid_to_send_signal, SIGUSR1)) {
+			producer_is_gone = 1;
+		}
+	} else if (checkpoint_path && errno != ENOENT) {
+		perror(checkpoint_path);
+		exit(1);
+	} else {
+		/* first run, start where the log ends
+		 */
+		assert(cat_tap_open(input0, input_path, CAT_TAP_SEEK_END) == 0);
+		if (checkpoint) {
+			checkpoint->current->dev = input0->dev;
+			checkpoint->current->ino = input0->ino;
+			checkpoint->current->offset = input0->offset;
+			checkpoint->current->acked = input0->offset;
+			checkpoint->dirty = 1;
+		}
+	}
+
+	if (checkpoint_path) {
+		assert(checkpoint_save(checkpoint, checkpoint_path) == 0);
+	}
+
+	if (fanout_threads_start(f)) {
+		perror("fanout_threads_start()");
+		exit(1);
+	}
+
+	memset(timers, 0, sizeof(timers));
+	timer_init(timers->idle, doit_idle, timers);
+	timer_init(timers->checkpoint, doit_checkpoint, timers);
+	timer_init(timers->stats, doit_stats, timers);
+	timer_init(timers->reclaim, doit_reclaim, timers);
+	timers->f = f;
+	timers->checkpoint_path = checkpoint_path;
+	timers->stats_path = stats_path;
+	timers->r = reclaim;
+	timers->hanging_path = hanging_path->s;
 
 	for (;;) {
 		int max_fds = -1;
 		int selfpipe = subprocess_get_selfpipe_read_fd();
 		struct cat_tap *input_current = inputs[current_input];
 		struct cat_tap *input_hanging = inputs[(current_input + 1) % 2];
-		int bql = buffer_queue_len(q);
+		int bql = fanout_blocking_len(f);
+		int i;
 		int bytes_read = 0;
 		int bytes_written = 0;
 
 		assert(selfpipe >= 0);
 
+		/* select leaves ready fds set, and they may be closed by now
+		 */
+		FD_ZERO(rfds);
+		FD_ZERO(wfds);
+
+		/* steady state after warm-up, see alloc_steady()
+		 */
+		if (loops < ALLOC_WARMUP_LOOPS) {
+			loops++;
+		} else {
+			alloc_steady(1);
+		}
+
+		if (page_pool && page_pool_busy(page_pool)) {
+			page_pool_reclaim(page_pool, sink_consumed(svlogd));
+		}
+
+		if (f->threaded) {
+			fanout_threads_feed(f);
+			FD_SET(sink_thread_wakeup, rfds);
+			max_fds = MAX2(sink_thread_wakeup, max_fds);
+		}
+
 		if (bql < 100) {
 			if (fd0->fd != -1) {
 				FD_SET(fd0->fd, rfds);
@@ -686,43 +2714,73 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 
 		FD_SET(selfpipe, rfds);
 		max_fds = MAX2(selfpipe, max_fds);
+		FD_SET(tfd, rfds);
+		max_fds = MAX2(tfd, max_fds);
 		prfds = rfds;
 
-		if (bql) {
-			if (svlogd->fd != -1) {
-				FD_SET(svlogd->fd, wfds);
-				max_fds = MAX2(svlogd->fd, max_fds);
+		if (post_rotate) {
+			max_fds = executor_fd_set(post_rotate, rfds, wfds, max_fds);
+		}
+
+		pwfds = NULL;
+		for (i = 0; i < f->n; i++) {
+			struct sink *x = f->sinks[i];
+			if (x->fd != -1 && !x->t && buffer_queue_len(x->q)) {
+				FD_SET(x->fd, wfds);
+				max_fds = MAX2(x->fd, max_fds);
+				pwfds = wfds;
 			}
-			pwfds = wfds;
-		} else {
-			pwfds = NULL;
 		}
 
-		if (fd0->got_eof) {
-			/* our stdin is the way to sign a clean
-			 * exit
-			 */
-			tv->tv_sec = 3;
-			tv->tv_usec = 0;
-		} else if (producer_is_gone) {
-			/* our producer is gone, we can't sign log
-			 * rotation anymore (the producer process is
-			 * not necessarily the other end of our stdin,
-			 * indeed, this is the reason for the creation
-			 * of this program, to allow such thing)
-			 */
-			tv->tv_sec = 3;
-			tv->tv_usec = 0;
-		} else {
-			tv->tv_sec = 5;
-			tv->tv_usec = 0;
+		if (active) {
+			int idle_msec;
+			if (fd0->got_eof) {
+				/* our stdin is the way to sign a clean
+				 * exit
+				 */
+				idle_msec = 3000;
+			} else if (producer_is_gone) {
+				/* our producer is gone, we can't sign log
+				 * rotation anymore (the producer process is
+				 * not necessarily the other end of our stdin,
+				 * indeed, this is the reason for the creation
+				 * of this program, to allow such thing)
+				 */
+				idle_msec = 3000;
+			} else {
+				idle_msec = 5000;
+			}
+			doit_timers_arm(timers, idle_msec);
+			active = 0;
 		}
 
-		DEBUG_INFO("select(max_fds=%i) timeout is %li seconds and %li useconds (%li milliseconds)", max_fds, (long)tv->tv_sec, (long)tv->tv_usec, (long)tv->tv_usec/1000);
+		DEBUG_INFO("select(max_fds=%i), next timer in %i milliseconds", max_fds, timer_next_msec());
 
 		assert(max_fds >= 0);
 
-		r = select(max_fds+1, prfds, pwfds, NULL, tv);
+		/* no timeout, every deadline is on tfd
+		 */
+		r = select(max_fds+1, prfds, pwfds, NULL, NULL);
+
+		if (r > 0 && FD_ISSET(tfd, rfds)) {
+			FD_CLR(tfd, rfds);
+			r--;
+			timers->timed_out = 0;
+			/* housekeeping, once a second at most, is
+			 * allowed to allocate
+			 */
+			i = alloc_steady(0);
+			timer_run();
+			alloc_steady(i);
+			if (r == 0 && !timers->timed_out) {
+				continue;
+			}
+		}
+
+		if (r) {
+			active = 1;
+		}
+
 		if (r < 0) {
 			int save_errno = errno;
 			assert(r == -1);
@@ -737,12 +2795,20 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 		} else if (r) {
 			int n;
 
-			if (selfpipe != -1 && FD_ISSET(selfpipe, rfds)) {
+			/* its round polls the child tracker too, svlogd may
+			 * be found gone there
+			 */
+			if (post_rotate && executor_len(post_rotate)) {
+				executor_run(post_rotate, 0);
+			}
+
+			if ((selfpipe != -1 && FD_ISSET(selfpipe, rfds)) || svlogd->sp->is_gone) {
 				DEBUG_INFO("selpipe is read");
 				assert(subprocess_read_selfpipe() == 0);
 				if (svlogd->sp->is_gone) {
 					char buf[4096];
 					int n;
+					fr_record(FR_CHILD_EXIT, svlogd->sp->pid, svlogd->sp->exit_status);
 					DEBUG_INFO("svlogd has gone unexpectedly");
 					assert(svlogd->sp->child_fderr >= 0);
 					if ((n = read(svlogd->sp->child_fderr, buf, sizeof(buf)-1)) > 0) {
@@ -753,9 +2819,58 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 				}
 			}
 
-			if (prfds) {
+			if (f->threaded && FD_ISSET(sink_thread_wakeup, rfds)) {
+				if ((n = fanout_threads_collect(f)) < 0) {
+					perror("sink thread");
+					break;
+				}
+				bytes_written += n;
+				if (svlogd->got_eof) {
+					DEBUG_INFO("svlogd got EOF, something went wrong");
+					break;
+				}
+			}
+
+			if (batch->u) {
 				if (fd0->fd != -1 && FD_ISSET(fd0->fd, rfds)) {
-					n = fd_tap_read(fd0, buf, bufsz-1);
+					io_batch_read(batch, IO_BATCH_STDIN, fd0->fd, bufsz-1);
+				}
+				if (input_hanging->fd != -1 && FD_ISSET(input_hanging->fd, rfds)) {
+					fanout_tee(f, input_hanging->fd);
+					io_batch_read(batch, IO_BATCH_HANGING, input_hanging->fd, bufsz-1);
+				}
+				if (input_current->fd != -1 && FD_ISSET(input_current->fd, rfds)) {
+					fanout_tee(f, input_current->fd);
+					io_batch_read(batch, IO_BATCH_CURRENT, input_current->fd, bufsz-1);
+				}
+				for (i = 0; pwfds && i < f->n; i++) {
+					struct sink *x = f->sinks[i];
+					if (x->fd != -1 && FD_ISSET(x->fd, pwfds) && buffer_queue_len(x->q)) {
+						io_batch_write(batch, i, x);
+					}
+				}
+				if (io_batch_submit(batch)) {
+					perror("io_uring_enter()");
+					exit(1);
+				}
+				if ((n = fanout_write_batch_result(f, batch)) < 0) {
+					perror("sink_write_batch_result()");
+					break;
+				}
+				bytes_written += n;
+				if (svlogd->got_eof) {
+					DEBUG_INFO("svlogd got EOF, something went wrong");
+					break;
+				}
+			}
+
+			if (prfds) {
+				if (io_batch_ready(batch, IO_BATCH_STDIN, fd0->fd, rfds)) {
+					if (batch->u) {
+						n = fd_tap_read_result(fd0, io_batch_take(batch, IO_BATCH_STDIN));
+					} else {
+						n = fd_tap_read(fd0, buf, bufsz-1);
+					}
 					if (n < 0) {
 						int save_errno = errno;
 						assert(n == -1);
@@ -774,7 +2889,7 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					}
 					if (n) {
 						buf[n] = 0;
-						q->enqueue = buffer_new(q->enqueue, BUFFER_ID_TAP_STDIN, buf, n);
+						fanout_enqueue(f, chunk_new(BUFFER_ID_TAP_STDIN, buf, n));
 						DEBUG_INFO("enqueued %i bytes from stdin", n);
 						bytes_read += n;
 					} else {
@@ -785,8 +2900,11 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 						assert(fd0->fd == -1);
 
 						/* close taps, we are
-						 * finishing
+						 * finishing, what io_uring
+						 * read from them goes first
 						 */
+						bytes_read += io_batch_take_last(batch, IO_BATCH_HANGING, input_hanging, BUFFER_ID_TAP_HANGING_NORMAL, f);
+						bytes_read += io_batch_take_last(batch, IO_BATCH_CURRENT, input_current, BUFFER_ID_TAP_CURRENT, f);
 						if (input_hanging->fd >= 0) {
 							DEBUG_INFO("closing input_hanging tap, pid=%i", input_hanging->sp->pid);
 							FD_CLR(input_hanging->fd, rfds);
@@ -800,11 +2918,18 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 
 						assert(input_hanging->fd == -1);
 						assert(input_current->fd == -1);
+						io_batch_drop_reads(batch);
 					}
 				}
 
-				if (input_hanging->fd != -1 && FD_ISSET(input_hanging->fd, rfds)) {
-					n = cat_tap_read(input_hanging, buf, bufsz-1);
+				if (io_batch_ready(batch, IO_BATCH_HANGING, input_hanging->fd, rfds)) {
+					char *rbuf = batch->buf[IO_BATCH_HANGING];
+					if (batch->u) {
+						n = cat_tap_read_result(input_hanging, io_batch_take(batch, IO_BATCH_HANGING));
+					} else {
+						fanout_tee(f, input_hanging->fd);
+						n = cat_tap_read(input_hanging, rbuf, bufsz-1);
+					}
 					if (n < 0) {
 						int save_errno = errno;
 						assert(n == -1);
@@ -822,8 +2947,10 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 						exit(1);
 					}
 					if (n) {
-						buf[n] = 0;
-						q->enqueue = buffer_new(q->enqueue, BUFFER_ID_TAP_HANGING_NORMAL, buf, n);
+						rbuf[n] = 0;
+						struct chunk *c = chunk_new(BUFFER_ID_TAP_HANGING_NORMAL, rbuf, n);
+						cat_tap_mark(input_hanging, c);
+						fanout_enqueue(f, c);
 						DEBUG_INFO("enqueued %i bytes from hanging", n);
 						bytes_read += n;
 					} else {
@@ -833,8 +2960,14 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					}
 				}
 
-				if (input_current->fd != -1 && FD_ISSET(input_current->fd, rfds)) {
-					n = cat_tap_read(input_current, buf, bufsz-1);
+				if (io_batch_ready(batch, IO_BATCH_CURRENT, input_current->fd, rfds)) {
+					char *rbuf = batch->buf[IO_BATCH_CURRENT];
+					if (batch->u) {
+						n = cat_tap_read_result(input_current, io_batch_take(batch, IO_BATCH_CURRENT));
+					} else {
+						fanout_tee(f, input_current->fd);
+						n = cat_tap_read(input_current, rbuf, bufsz-1);
+					}
 					if (n < 0) {
 						int save_errno = errno;
 						assert(n == -1);
@@ -852,8 +2985,10 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 						exit(1);
 					}
 					if (n) {
-						buf[n] = 0;
-						q->enqueue = buffer_new(q->enqueue, BUFFER_ID_TAP_CURRENT, buf, n);
+						rbuf[n] = 0;
+						struct chunk *c = chunk_new(BUFFER_ID_TAP_CURRENT, rbuf, n);
+						cat_tap_mark(input_current, c);
+						fanout_enqueue(f, c);
 						DEBUG_INFO("enqueued %i bytes from current", n);
 						bytes_read += n;
 					} else {
@@ -864,12 +2999,27 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 				}
 
 				if (input_current->bytes_read >= count_to_rotate) {
+					ino_t done_ino = 0; /* the former hanging file */
+
+					/* so is rotation, and steady state
+					 * begins once it is done
+					 */
+					alloc_steady(0);
+					if (loops < ALLOC_WARMUP_LOOPS) loops = ALLOC_WARMUP_LOOPS;
 
 					DEBUG_INFO("read %i bytes from [%s], hanging it (limit is %li)", input_current->bytes_read, input_current->path->s, count_to_rotate);
 
 					/* rename current to hanging path
 					 */
 
+					*rotations += 1;
+					fr_record(FR_ROTATE_RENAME, current_input, input_current->bytes_read);
+					PROBE2(rotate_rename, current_input, input_current->bytes_read);
+
+					if (post_rotate && post_rotate_submit(hanging_path->s, input_path)) {
+						perror(hanging_path->s);
+					}
+
 					if ((r = rename(input_current->path->s, hanging_path->s))) {
 						int save_errno = errno;
 						assert(r == -1);
@@ -884,6 +3034,7 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 
 					{
 						int fd;
+						struct stat st[1];
 						if ((fd = open(input_path, O_WRONLY | O_CREAT, 0644)) < 0) {
 							int save_errno = errno;
 							assert(fd == -1);
@@ -892,8 +3043,18 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 							perror(input_path);
 							break;
 						}
+						assert(fstat(fd, st) == 0);
 						assert(close(fd) == 0);
 						fd = -1;
+
+						fr_record(FR_ROTATE_CHECKPOINT, 0, st->st_ino);
+						PROBE1(rotate_checkpoint, st->st_ino);
+						if (checkpoint) {
+							checkpoint_rotate(checkpoint, st->st_dev, st->st_ino);
+							if (checkpoint_path && checkpoint_save(checkpoint, checkpoint_path)) {
+								perror(checkpoint_path);
+							}
+						}
 					}
 
 					DEBUG_INFO("renamed [%s] to [%s] and created former", input_current->path->s, hanging_path->s);
@@ -911,7 +3072,8 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 
 					if (input_hanging->fd >= 0) {
 						DEBUG_INFO("[%s] is done", input_hanging->path->s);
-						cat_tap_close(input_hanging);
+						done_ino = input_hanging->ino;
+						cat_tap_close_async(input_hanging);
 					} else {
 						DEBUG_INFO("first hanging");
 					}
@@ -921,7 +3083,7 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					 * next round)
 					 */
 
-					assert(cat_tap_open(input_hanging, input_path, 0 /* seek end */) == 0);
+					assert(cat_tap_open(input_hanging, input_path, 0 /* from start */) == 0);
 
 					/* send SIGUSR1 to producer
 					 * process, so it can reopen
@@ -929,8 +3091,12 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					 */
 
 					if (kill(pid_to_send_signal, SIGUSR1) == 0) {
+						fr_record(FR_ROTATE_SIGNAL, pid_to_send_signal, 0);
+						PROBE2(rotate_signal, pid_to_send_signal, 0);
 						DEBUG_INFO("sent SIGUSR1 to pid %i", pid_to_send_signal);
 					} else {
+						fr_record(FR_ROTATE_SIGNAL, pid_to_send_signal, errno);
+						PROBE2(rotate_signal, pid_to_send_signal, errno);
 						DEBUG_INFO("kill(pid_to_send_signal=%i, SIGUSR1=%i) failed", pid_to_send_signal, SIGUSR1);
 						producer_is_gone = 1;
 					}
@@ -942,9 +3108,14 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					 * also give producer process
 					 * some time to reopen it's
 					 * log file and hanging input
-					 * tap to settle
+					 * tap to settle, sink threads
+					 * just get more work and never
+					 * hold the rotation
 					 */
-					if ((n = sink_flush_all_buffers(svlogd, q)) < 0) {
+					if (svlogd->t) {
+						fanout_threads_feed(f);
+						n = 0;
+					} else if ((n = sink_flush_all_buffers(svlogd, q)) < 0) {
 						int save_errno = errno;
 						assert(n == -1);
 						DEBUG("sink_flush_all_buffers(svlogd=[pid=%i], q), errno=%i", svlogd->sp->pid, save_errno);
@@ -965,6 +3136,8 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					input_current = inputs[current_input];
 					input_hanging = inputs[(current_input + 1) % 2];
 
+					fr_record(FR_ROTATE_SWAP, current_input, 0);
+					PROBE2(rotate_swap, current_input, buffer_queue_len(q));
 					DEBUG_INFO("current_input = %i", current_input);
 
 					/* this is just to drain
@@ -972,7 +3145,10 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					 * maintain order
 					 */
 
-					if ((r = enqueue_til_settle(q, input_hanging, BUFFER_ID_TAP_HANGING_SETTLE, 100 /* msec to settle */, buf, bufsz)) < 0) {
+					r = enqueue_til_settle(f, input_hanging, BUFFER_ID_TAP_HANGING_SETTLE, 100 /* msec to settle */, buf, bufsz);
+					fr_record(FR_ROTATE_SETTLE, r, 0);
+					PROBE2(rotate_settle, r, buffer_queue_len(q));
+					if (r < 0) {
 						assert(r == -1);
 						assert(errno == EAGAIN);
 						DEBUG_INFO("hanging input tap failed to settle");
@@ -982,10 +3158,33 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 						DEBUG_INFO("input_hanging->fd got EOF, something went wrong");
 						break;
 					}
+
+					/* a line the former hanging file left
+					 * unfinished won't be
+					 */
+					if (done_ino) {
+						flush_partial_lines(done_ino, 0);
+					}
 				}
 			}
 
-			if (pwfds) {
+			if (pwfds && !batch->u) {
+				for (i = 1; i < f->n; i++) {
+					struct sink *x = f->sinks[i];
+					if (x->fd != -1 && FD_ISSET(x->fd, pwfds)) {
+						n = sink_write_from_queue(x, x->q);
+						if (n < 0 || x->got_eof) {
+							if (sink_vital(x)) break;
+							fanout_detach(f, x);
+						} else {
+							bytes_written += n;
+						}
+					}
+				}
+				if (i < f->n) {
+					DEBUG("sink fd=%i failed, errno=%i", f->sinks[i]->fd, errno);
+					break;
+				}
 				if (svlogd->fd != -1 && FD_ISSET(svlogd->fd, pwfds)) {
 					DEBUG_INFO("svlogd is ready, %i buffers enqueued", buffer_queue_len(q));
 					n = sink_write_from_queue(svlogd, q);
@@ -1007,22 +3206,28 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 			}
 
 			if (fd0->got_eof) {
-				if (bytes_read || bytes_written) {
+				if (bytes_read || bytes_written || fanout_threads_pending(f)) {
 					DEBUG_INFO("fd0 is closed, but we may have pending data");
+				} else if (flush_partial_lines(0, 1 /* all */)) {
+					DEBUG_INFO("fd0 is closed, partial lines flushed");
 				} else {
 					DEBUG_INFO("fd0 is closed and we have no pending data");
 					break;
 				}
 			} else if (producer_is_gone) {
-				if (bytes_read || bytes_written) {
+				if (bytes_read || bytes_written || fanout_threads_pending(f)) {
 					DEBUG_INFO("producer is gone, but we may have pending data");
+				} else if (flush_partial_lines(0, 1 /* all */)) {
+					DEBUG_INFO("producer is gone, partial lines flushed");
 				} else {
 					DEBUG_INFO("producer is gone, and we have no pending data");
 					break;
 				}
 			}
 		} else { /* matches:	} else if (r) { */
-			if (fd0->got_eof) {
+			if ((fd0->got_eof || producer_is_gone) && flush_partial_lines(0, 1 /* all */)) {
+				DEBUG_INFO("exiting, partial lines flushed first");
+			} else if (fd0->got_eof) {
 				DEBUG_INFO("fd0 is closed and got timeout, sink failed to drain remaining data, exiting loop, %i buffers were left", buffer_queue_len(q));
 				break;
 			} else if (producer_is_gone) {
@@ -1036,12 +3241,24 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 					DEBUG_INFO("timeout");
 				}
 			}
+			active = 1;
 		}
 	}
 
 	/* cleanup
 	 */
 
+	alloc_steady(0);
+
+	doit_timers_cancel(timers);
+
+	fanout_threads_stop(f);
+
+	if (post_rotate && executor_len(post_rotate)) {
+		DEBUG_INFO("waiting for %i post-rotate commands", executor_len(post_rotate));
+		executor_wait(post_rotate);
+	}
+
 	if (input0->fd >= 0) {
 		DEBUG_INFO("closing input0 tap, pid=%i", input0->sp->pid);
 		cat_tap_close(input0);
@@ -1057,13 +3274,35 @@ static int doit(int pid_to_send_signal, struct sink *svlogd, struct fd_tap *fd0,
 	if (input0->got_eof) subprocess_exit_debug(input0->sp);
 	if (input1->got_eof) subprocess_exit_debug(input1->sp);
 
-	buffer_queue_free(q);
+	if (checkpoint) {
+		if (checkpoint_path && checkpoint_save(checkpoint, checkpoint_path)) {
+			perror(checkpoint_path);
+		}
+		checkpoint = NULL;
+	}
+
+	if (reclaim && reclaim->fd >= 0) {
+		close(reclaim->fd);
+		reclaim->fd = -1;
+	}
+
+	if (stats_path) {
+		fanout_stats(f);
+		if (stats_dump(stats_path)) {
+			perror(stats_path);
+		}
+	}
+
+	fanout_free_queues(f);
 	q = NULL;
 
+	io_batch_free(batch);
+
 	free(buf);
 	buf = NULL;
 
 	str_free(hanging_path);
+	str_arena_free(arena);
 
 	return 0;
 }
@@ -1082,6 +3321,27 @@ static struct option options_long[] = {
 	{.val='c', .name="count-to-rotate", .has_arg=1},
 	{.val='e', .name="exit-on-timeout"},
 	{.val='o', .name="output-dir", .has_arg=1},
+	{.val='k', .name="checkpoint-file", .has_arg=1},
+	{.val='t', .name="tee", .has_arg=1},
+	{.val='m', .name="tee-max-lag", .has_arg=1},
+	{.val='S', .name="stats-file", .has_arg=1},
+	{.val='T', .name="threaded"},
+	{.val='C', .name="cpus", .has_arg=1},
+	{.val='U', .name="io-uring"},
+	{.val='V', .name="vmsplice"},
+	{.val='R', .name="reclaim-hanging"},
+	{.val='v', .name="verbose"},
+	{.val='F', .name="flight-file", .has_arg=1},
+	{.val='P', .name="perf-counters"},
+	{.val='A', .name="assert-no-alloc"},
+	{.val='w', .name="shard", .has_arg=1},
+	{.val='O', .name="split-dir", .has_arg=1},
+	{.val='K', .name="split-field", .has_arg=1},
+	{.val='r', .name="route", .has_arg=1},
+	{.val='D', .name="route-lossy", .has_arg=1},
+	{.val='x', .name="filter", .has_arg=1},
+	{.val='N', .name="nginx-format", .has_arg=1},
+	{.val='X', .name="post-rotate", .has_arg=1},
 	{.val='h', .name="help"},
 	{.name=NULL}
 };
@@ -1093,11 +3353,38 @@ struct args {
 	long count_to_rotate;
 	int exit_on_timeout; /* useful for test */
 	char output_dir[256];
+	char checkpoint_file[256];
+	char tee_path[SINK_MAX - 1][256];
+	int tee_count;
+	long tee_max_lag;
+	char stats_file[256];
+	int threaded;
+	int cpus[SINK_MAX + 1];
+	int ncpus;
+	int io_uring;
+	int vmsplice;
+	int reclaim;
+	char flight_file[256];
+	int perf_counters;
+	char shard_spec[SHARD_MAX - 1][512];
+	int shard_count;
+	char split_dir[SINK_MAX - 1][256];
+	int split_count;
+	int split_field;
+	char route_spec[SINK_MAX - 1][512];
+	int route_lossy[SINK_MAX - 1];
+	int route_count;
+	char filter_spec[FILTER_MAX][256];
+	int filter_count;
+	char nginx_format[1024];
+	char post_rotate[1024];
 } args[1] = {
 	{
 		.svlogd_path = "svlogd",
 		.count_to_rotate = 0x1000000 /* 16777216 / 16M */,
-		.output_dir = "."
+		.output_dir = ".",
+		.tee_max_lag = 0x1000000 /* 16M */,
+		.flight_file = "aimant.flight"
 	}
 };
 
@@ -1125,6 +3412,115 @@ static void help(const char *argv0, struct getopt_x *state)
 		case 's': pos += snprintf(buf + pos, SOZ(bufsz,pos), "svlogd path, default is \"%s\"\n", args->svlogd_path); break;
 		case 'c': pos += snprintf(buf + pos, SOZ(bufsz,pos), "count to rotate (bytes), default is %li\n", args->count_to_rotate); break;
 		case 'o': pos += snprintf(buf + pos, SOZ(bufsz,pos), "svlogd output directory, default is \".\"\n"); break;
+		case 'k':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "file to keep read offsets, resume from it on restart\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "instead of starting at the end of log file\n");
+			break;
+		case 't':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "also feed a unix socket, fifo or file, may be\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "repeated up to %i times, never slows svlogd down\n", SINK_MAX - 1);
+			break;
+		case 'm':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "bytes a tee may lag before dropping, default is %li\n", args->tee_max_lag);
+			break;
+		case 'S': pos += snprintf(buf + pos, SOZ(bufsz,pos), "file to dump counters to, every second\n"); break;
+		case 'T': pos += snprintf(buf + pos, SOZ(bufsz,pos), "write to each sink from its own thread\n"); break;
+		case 'U': pos += snprintf(buf + pos, SOZ(bufsz,pos), "batch reads and writes with io_uring, if available\n"); break;
+		case 'V':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "hand pages to svlogd with vmsplice instead of\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "copying them, not with -T or -U\n");
+			break;
+		case 'R':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "punch what svlogd has out of the hanging file,\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "and unlink it once drained\n");
+			break;
+		case 'v': pos += snprintf(buf + pos, SOZ(bufsz,pos), "trace what is going on (DEBUG_INFO) as well\n"); break;
+		case 'F':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "where recent events are dumped on SIGUSR2 or\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "crash, default is \"%s\" (see flightdump)\n", args->flight_file);
+			break;
+		case 'P':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "count cycles, instructions, cache misses, context\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "switches and page faults per MB and per rotation,\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "children included, reported with -S\n");
+			break;
+		case 'A':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "report allocations in the main loop once warmed\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "up (rotation and timers aside), twice to abort\n");
+			break;
+		case 'C':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "comma separated cpus to pin threads to, main\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "thread first, then sink threads round-robin\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "(with -w, the cpus to spread workers over)\n");
+			break;
+		case 'w':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "\"log_file:output_dir\", another log file of the\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "same producer, may be repeated up to %i times,\n", SHARD_MAX - 1);
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "per-file worker processes (one each, a file\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "never changes workers) with cpu rebalancing by\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "byte rate\n");
+			break;
+		case 'X':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "at rotation, move the former hanging file to\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "<log>.<inode> and run \"sh -c command\" with it as\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "$1 (gzip \"$1\"), one per cpu at once, not with -R\n");
+			break;
+		case 'O':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "one more svlogd output directory, lines are split\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "between -o and every -O, may be repeated\n");
+			break;
+		case 'K':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "with -O, split by the hash of this blank separated\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "field (1 is the client address in nginx combined),\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "default is 0, round-robin\n");
+			break;
+		case 'r':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "\"dir:~text\", \"dir:N=text\" or \"dir:N^text\", lines\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "having text, or whose field N is or starts with\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "text (\"errors:9^5\" for 5xx in nginx combined),\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "go to svlogd on dir instead, first match wins\n");
+			break;
+		case 'D':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "same as -r, but lines past -m lag are dropped\n");
+			break;
+		case 'x':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "\"~text\", \"N=text\" or \"N^text\" as in -r, drop the\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "lines matching, with \"M/\" before it keep one in M\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "by hash of the line (\"100/~.png \"), first match\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "wins, up to %i\n", FILTER_MAX);
+			break;
+		case 'N':
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "parse lines as nginx log_format (or \"combined\")\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "and count status, method, host, bytes sent and\n");
+			pos += getopt_x_option_format(buf + pos, SOZ(bufsz,pos), state, NULL);
+			pos += snprintf(buf + pos, SOZ(bufsz,pos), "request time buckets into stats (nginx.*)\n");
+			break;
 		case 'e':
 		case 'h':
 			pos += snprintf(buf + pos, SOZ(bufsz,pos), "\n");
@@ -1141,6 +3537,22 @@ static void help(const char *argv0, struct getopt_x *state)
 	fputs(buf, stderr);
 }
 
+/* "0,2,3" to {0, 2, 3}, 0 on success, -1 on error
+ */
+static int parse_cpus(const char *s, int *cpus, int max, int *n)
+{
+	*n = 0;
+	for (;;) {
+		char *end;
+		long v = strtol(s, &end, 10);
+		if (end == s || v < 0 || v >= CPU_SETSIZE || *n == max) return -1;
+		cpus[(*n)++] = v;
+		if (*end == 0) return 0;
+		if (*end != ',') return -1;
+		s = end + 1;
+	}
+}
+
 static int process_args(struct getopt_x *state, int argc, char **argv)
 {
 	int c;
@@ -1157,6 +3569,97 @@ static int process_args(struct getopt_x *state, int argc, char **argv)
 		case 'c': args->count_to_rotate = atol(optarg); break;
 		case 'e': args->exit_on_timeout = 1; break;
 		case 'o': strncpy_sizeof(args->output_dir, optarg); break;
+		case 'k': strncpy_sizeof(args->checkpoint_file, optarg); break;
+		case 't':
+			if (args->tee_count == SINK_MAX - 1) {
+				DEBUG("too many -t flags, maximum is %i", SINK_MAX - 1);
+				return -1;
+			}
+			strncpy_sizeof(args->tee_path[args->tee_count++], optarg);
+			break;
+		case 'm': args->tee_max_lag = atol(optarg); break;
+		case 'S': strncpy_sizeof(args->stats_file, optarg); break;
+		case 'T': args->threaded = 1; break;
+		case 'U': args->io_uring = 1; break;
+		case 'V': args->vmsplice = 1; break;
+		case 'R': args->reclaim = 1; break;
+		case 'v': debug0_level = DEBUG_LEVEL_INFO; break;
+		case 'F': strncpy_sizeof(args->flight_file, optarg); break;
+		case 'P': args->perf_counters = 1; break;
+		case 'A': alloc_steady_check++; break;
+		case 'w':
+			if (args->shard_count == SHARD_MAX - 1) {
+				DEBUG("too many -w flags, maximum is %i", SHARD_MAX - 1);
+				return -1;
+			}
+			if (strchr(optarg, ':') == NULL) {
+				DEBUG("invalid value for -w flag, expected \"log_file:output_dir\": %s", optarg);
+				return -1;
+			}
+			strncpy_sizeof(args->shard_spec[args->shard_count++], optarg);
+			break;
+		case 'O':
+			if (args->split_count == SINK_MAX - 1) {
+				DEBUG("too many -O flags, maximum is %i", SINK_MAX - 1);
+				return -1;
+			}
+			strncpy_sizeof(args->split_dir[args->split_count++], optarg);
+			break;
+		case 'K': args->split_field = atoi(optarg); break;
+		case 'r':
+		case 'D':
+			{
+				struct route r[1];
+				if (args->route_count == SINK_MAX - 1) {
+					DEBUG("too many -r and -D flags, maximum is %i", SINK_MAX - 1);
+					return -1;
+				}
+				if (route_parse(r, optarg)) {
+					DEBUG("invalid value for -%c flag: %s", c, optarg);
+					return -1;
+				}
+				args->route_lossy[args->route_count] = c == 'D';
+				strncpy_sizeof(args->route_spec[args->route_count++], optarg);
+			}
+			break;
+		case 'x':
+			{
+				struct filter x[1];
+				if (args->filter_count == FILTER_MAX) {
+					DEBUG("too many -x flags, maximum is %i", FILTER_MAX);
+					return -1;
+				}
+				if (strlen(optarg) >= sizeof(args->filter_spec[0]) || filter_parse(x, optarg)) {
+					DEBUG("invalid value for -x flag: %s", optarg);
+					return -1;
+				}
+				strncpy_sizeof(args->filter_spec[args->filter_count++], optarg);
+			}
+			break;
+		case 'N':
+			{
+				struct nginx *x;
+				if (strlen(optarg) >= sizeof(args->nginx_format) || (x = nginx_new(optarg)) == NULL) {
+					DEBUG("invalid value for -N flag: %s", optarg);
+					return -1;
+				}
+				nginx_free(x);
+				strncpy_sizeof(args->nginx_format, optarg);
+			}
+			break;
+		case 'X':
+			if (strlen(optarg) >= sizeof(args->post_rotate)) {
+				DEBUG("invalid value for -X flag: %s", optarg);
+				return -1;
+			}
+			strncpy_sizeof(args->post_rotate, optarg);
+			break;
+		case 'C':
+			if (parse_cpus(optarg, args->cpus, SINK_MAX + 1, &args->ncpus)) {
+				DEBUG("invalid value for -C flag: %s", optarg);
+				return -1;
+			}
+			break;
 		case 'h': help(argv[0], state); exit(0);
 		case -1: break;
 		default:
@@ -1164,23 +3667,168 @@ static int process_args(struct getopt_x *state, int argc, char **argv)
 			return -1;
 		}
 	} while (c != -1);
+	if (args->tee_max_lag < 1) {
+		DEBUG("invalid value for -m flag: %li", args->tee_max_lag);
+		return -1;
+	}
 	if (args->count_to_rotate < 1) {
 		DEBUG("invalid value for -c flag: %li", args->count_to_rotate);
 		return -1;
 	}
+	if (args->shard_count && args->tee_count) {
+		DEBUG("-t is not supported with -w");
+		return -1;
+	}
+	if (args->shard_count && (args->split_count || args->route_count)) {
+		DEBUG("-O, -r and -D are not supported with -w");
+		return -1;
+	}
+	if (args->split_count + args->route_count + args->tee_count > SINK_MAX - 1) {
+		DEBUG("too many -O, -r, -D and -t flags, maximum is %i", SINK_MAX - 1);
+		return -1;
+	}
+	if (args->split_field < 0) {
+		DEBUG("invalid value for -K flag: %i", args->split_field);
+		return -1;
+	}
+	if (args->reclaim && *args->post_rotate) {
+		DEBUG("-R is not supported with -X, the hanging file goes to the command");
+		return -1;
+	}
 	return state->got_error;
 }
 
 static int read_pid(const char *pid_file, int *pid);
 
+static int tail0_main(char *filename, const char *offset)
+{
+	/* do not outlive aimant, even if it is killed
+	 */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if (getppid() == 1) return 1;
+	return tail0(filename, strtoll(offset, NULL, 10)) == 0 ? 0 : 1;
+}
+
+/* sharded mode, see shard.h, shard 0 is -l and -o, the others come
+ * from -w, every flag that applies to one log file is passed on
+ */
+
+#define SHARD_EXE "/proc/self/exe"
+#define SHARD_ARGV_MAX (36 + 2 * FILTER_MAX)
+
+static struct shard shards[SHARD_MAX];
+
+static struct shard_args {
+	char log_file[256];
+	char output_dir[256];
+	char checkpoint_file[256 + 8];
+	char flight_file[256 + 8];
+	char count_to_rotate[32];
+	char *argv[SHARD_ARGV_MAX];
+} shard_args[SHARD_MAX];
+
+static int shard_main()
+{
+	int i, j;
+
+	for (i = 0; i < args->shard_count + 1; i++) {
+		struct shard *x = shards + i;
+		struct shard_args *a = shard_args + i;
+		int n = 0;
+
+		if (i == 0) {
+			strncpy_sizeof(a->log_file, args->log_file);
+			strncpy_sizeof(a->output_dir, args->output_dir);
+		} else {
+			char *spec = args->shard_spec[i - 1];
+			char *colon = strrchr(spec, ':');
+			*colon = 0;
+			strncpy_sizeof(a->log_file, spec);
+			strncpy_sizeof(a->output_dir, colon + 1);
+			*colon = ':';
+		}
+		snprintf(a->count_to_rotate, sizeof(a->count_to_rotate), "%li", args->count_to_rotate);
+		if (*args->stats_file) {
+			snprintf(x->stats_path, sizeof(x->stats_path), "%s.%i", args->stats_file, i);
+		} else {
+			snprintf(x->stats_path, sizeof(x->stats_path), "%s/aimant.stats", a->output_dir);
+		}
+
+		a->argv[n++] = SHARD_EXE;
+		a->argv[n++] = "-p";
+		a->argv[n++] = args->pid_file;
+		a->argv[n++] = "-l";
+		a->argv[n++] = a->log_file;
+		a->argv[n++] = "-o";
+		a->argv[n++] = a->output_dir;
+		a->argv[n++] = "-s";
+		a->argv[n++] = args->svlogd_path;
+		a->argv[n++] = "-c";
+		a->argv[n++] = a->count_to_rotate;
+		a->argv[n++] = "-S";
+		a->argv[n++] = x->stats_path;
+		if (*args->checkpoint_file) {
+			snprintf(a->checkpoint_file, sizeof(a->checkpoint_file), "%s.%i", args->checkpoint_file, i);
+			a->argv[n++] = "-k";
+			a->argv[n++] = a->checkpoint_file;
+		}
+		snprintf(a->flight_file, sizeof(a->flight_file), "%s.%i", args->flight_file, i);
+		a->argv[n++] = "-F";
+		a->argv[n++] = a->flight_file;
+		if (args->exit_on_timeout) a->argv[n++] = "-e";
+		if (args->threaded) a->argv[n++] = "-T";
+		if (args->io_uring) a->argv[n++] = "-U";
+		if (args->vmsplice) a->argv[n++] = "-V";
+		if (args->reclaim) a->argv[n++] = "-R";
+		if (args->perf_counters) a->argv[n++] = "-P";
+		if (debug0_level >= DEBUG_LEVEL_INFO) a->argv[n++] = "-v";
+		for (j = 0; j < alloc_steady_check && j < 2; j++) {
+			a->argv[n++] = "-A";
+		}
+		for (j = 0; j < args->filter_count; j++) {
+			a->argv[n++] = "-x";
+			a->argv[n++] = args->filter_spec[j];
+		}
+		if (*args->nginx_format) {
+			a->argv[n++] = "-N";
+			a->argv[n++] = args->nginx_format;
+		}
+		if (*args->post_rotate) {
+			a->argv[n++] = "-X";
+			a->argv[n++] = args->post_rotate;
+		}
+		a->argv[n] = NULL;
+		assert(n < SHARD_ARGV_MAX);
+
+		x->argv = a->argv;
+	}
+
+	return shard_run(shards, args->shard_count + 1, args->cpus, args->ncpus,
+			 *args->stats_file ? args->stats_file : NULL);
+}
+
 int main(int argc, char **argv)
 {
 	char **sink_argv;
 	struct sink svlogd[1];
+	struct sink tees[SINK_MAX - 1];
+	struct sink splits[SINK_MAX - 1];
+	char *split_argv[SINK_MAX - 1][4];
+	struct sink routes[SINK_MAX - 1];
+	char *route_argv[SINK_MAX - 1][4];
+	struct fanout f[1];
+	int i;
 	struct fd_tap fd0[1];
+	struct reclaim reclaim[1];
 	struct getopt_x state[1];
 	int pid_to_send_signal = -1;
 
+	if (argc == 4 && strcmp(argv[1], CAT_TAP_ARG) == 0) {
+		/* we are a cat tap, see cat_tap_open()
+		 */
+		return tail0_main(argv[2], argv[3]);
+	}
+
 	if (process_args(state, argc, argv)) {
 		help(argv[0], state);
 		exit(1);
@@ -1191,6 +3839,24 @@ int main(int argc, char **argv)
 		exit(0);
 	}
 
+	if (debug0_async_start()) {
+		perror("debug0_async_start()");
+	}
+
+	if (args->shard_count) {
+		return shard_main() == 0 ? 0 : 1;
+	}
+
+	if (fr_init(args->flight_file)) {
+		perror(args->flight_file);
+	}
+
+	/* before any child is spawned, so they inherit the counters
+	 */
+	if (args->perf_counters && perfctr_open()) {
+		perror("perf_event_open()");
+	}
+
 	DEBUG_INFO("args->pid_file=[%s]", args->pid_file);
 	DEBUG_INFO("args->log_file=[%s]", args->log_file);
 	DEBUG_INFO("args->svlogd_path=[%s]", args->svlogd_path);
@@ -1213,21 +3879,170 @@ int main(int argc, char **argv)
 	sink_argv[2] = args->output_dir;
 	sink_argv[3] = NULL;
 
-	assert(sink_open(svlogd, 1 /* search path? */, sink_argv) == 0);
+	if (sink_open(svlogd, 1 /* search path? */, sink_argv)) {
+		perror(args->svlogd_path);
+		exit(1);
+	}
+
+	memset(f, 0, sizeof(f));
+	fanout_add(f, svlogd, SINK_POLICY_BLOCK, 0);
+
+	if (*args->post_rotate) {
+		long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		post_rotate_command = args->post_rotate;
+		if ((post_rotate = executor_new(ncpu > 0 ? ncpu : 1)) == NULL) {
+			perror("executor_new()");
+			exit(1);
+		}
+	}
+
+	if (*args->nginx_format) {
+		nginx = nginx_new(args->nginx_format);
+		assert(nginx); /* checked in process_args() */
+	}
+
+	/* svlogd instances the lines are split between, right after
+	 * the primary
+	 */
+
+	if (args->split_count || args->route_count || args->filter_count) {
+		split = split_new(args->split_field);
+		svlogd->split = 1;
+		split->sinks[split->n++] = svlogd;
+		for (i = 0; i < args->filter_count; i++) {
+			int e = filter_parse(split->filters + split->nfilters++, args->filter_spec[i]);
+			assert(e == 0); /* checked in process_args() */
+		}
+	}
+
+	for (i = 0; i < args->split_count; i++) {
+		split_argv[i][0] = args->svlogd_path;
+		split_argv[i][1] = "-ttt";
+		split_argv[i][2] = args->split_dir[i];
+		split_argv[i][3] = NULL;
+		memset(splits + i, 0, sizeof(struct sink));
+		if (sink_open(splits + i, 1 /* search path? */, split_argv[i])) {
+			perror(args->svlogd_path);
+			exit(1);
+		}
+		fanout_add(f, splits + i, SINK_POLICY_BLOCK, 0);
+		splits[i].split = 1;
+		split->sinks[split->n++] = splits + i;
+	}
+
+	if (split) {
+		split->ngroup = split->n;
+		split->ranges = split->n == 1 && args->route_count == 0;
+	}
+
+	/* then the routes, a svlogd each, the spec is dir first
+	 */
+
+	for (i = 0; i < args->route_count; i++) {
+		struct route *r = split->routes + split->nroutes++;
+		int e = route_parse(r, args->route_spec[i]);
+		assert(e == 0); /* checked in process_args() */
+		*strchr(args->route_spec[i], ':') = 0;
+		route_argv[i][0] = args->svlogd_path;
+		route_argv[i][1] = "-ttt";
+		route_argv[i][2] = args->route_spec[i];
+		route_argv[i][3] = NULL;
+		memset(routes + i, 0, sizeof(struct sink));
+		if (sink_open(routes + i, 1 /* search path? */, route_argv[i])) {
+			perror(args->svlogd_path);
+			exit(1);
+		}
+		if (args->route_lossy[i]) {
+			fanout_add(f, routes + i, SINK_POLICY_DROP, args->tee_max_lag);
+		} else {
+			fanout_add(f, routes + i, SINK_POLICY_BLOCK, 0);
+		}
+		routes[i].split = 1;
+		r->sink = split->n;
+		split->sinks[split->n++] = routes + i;
+	}
+
+	for (i = 0; i < args->tee_count; i++) {
+		if (sink_open_path(tees + i, args->tee_path[i])) {
+			perror(args->tee_path[i]);
+			exit(1);
+		}
+		fanout_add(f, tees + i, SINK_POLICY_DROP, args->tee_max_lag);
+	}
+
+	f->threaded = args->threaded;
+	memcpy(f->cpus, args->cpus, sizeof(f->cpus));
+	f->ncpus = args->ncpus;
+
+	if (args->vmsplice && (args->threaded || args->io_uring)) {
+		DEBUG("-V is ignored with -T or -U, those write from elsewhere");
+	} else if (args->vmsplice) {
+		/* room for a full tap read, so a chunk goes in one go
+		 */
+		if (fcntl(svlogd->fd, F_SETPIPE_SZ, SINK_PIPE_SIZE) < 0) {
+			DEBUG("fcntl(F_SETPIPE_SZ, %i), errno=%i", SINK_PIPE_SIZE, errno);
+		}
+		page_pool = page_pool_new();
+		svlogd->vmsplice = 1;
+	}
 
 	/* register stdin as tap
 	 */
 
 	assert(fd_tap_open(fd0, STDIN_FILENO) == 0);
 
+	reclaim_init(reclaim);
+
 	/* unleash
 	 */
 
-	assert(doit(pid_to_send_signal, svlogd, fd0, args->log_file, args->count_to_rotate, args->exit_on_timeout) == 0);
+	assert(doit(pid_to_send_signal, f, fd0, args->log_file, args->count_to_rotate, args->exit_on_timeout,
+		    *args->checkpoint_file ? args->checkpoint_file : NULL,
+		    *args->stats_file ? args->stats_file : NULL, args->io_uring,
+		    args->reclaim ? reclaim : NULL) == 0);
+
+	for (i = 0; i < args->tee_count; i++) {
+		sink_close(tees + i);
+	}
+
+	for (i = 0; i < args->split_count; i++) {
+		DEBUG_INFO("closing split sink, pid=%i", splits[i].sp->pid);
+		sink_close(splits + i);
+	}
+
+	for (i = 0; i < args->route_count; i++) {
+		DEBUG_INFO("closing route sink, pid=%i", routes[i].sp->pid);
+		sink_close(routes + i);
+	}
 
 	DEBUG_INFO("closing svlogd sink, pid=%i", svlogd->sp->pid);
 	sink_close(svlogd);
 
+	subprocess_terminate_flush();
+
+	perfctr_close();
+
+	if (split) {
+		split_free(split);
+		split = NULL;
+	}
+	if (nginx) {
+		nginx_free(nginx);
+		nginx = NULL;
+	}
+	if (post_rotate) {
+		executor_free(post_rotate);
+		post_rotate = NULL;
+	}
+
+	chunk_pool_free();
+	buffer_pool_trim();
+
+	if (page_pool) {
+		page_pool_free(page_pool);
+		page_pool = NULL;
+	}
+
 	/* cleanup
 	 */
 
@@ -1308,11 +4123,17 @@ static int write_exact(int fd, void *buf, int len)
 	return len;
 }
 
+/* what was passed on is of no use in the page cache anymore
+ */
+#define TAIL_DONTNEED 0x100000 /* 1M */
+
 static int tail0loop(int fdin, int fdout)
 {
 	char buf[0x100000]; /* 1M */
 	int bufsz = sizeof(buf);
 	int eof_count = 0;
+	off_t pos = lseek(fdin, 0, SEEK_CUR);
+	off_t dropped = pos < 0 ? 0 : pos - pos % TAIL_DONTNEED;
 
 	for (;;) {
 		int n;
@@ -1334,6 +4155,12 @@ static int tail0loop(int fdin, int fdout)
 				return -1;
 			}
 			eof_count = 0;
+			pos += n;
+			if (pos - dropped >= TAIL_DONTNEED) {
+				off_t end = pos - pos % TAIL_DONTNEED;
+				posix_fadvise(fdin, dropped, end - dropped, POSIX_FADV_DONTNEED);
+				dropped = end;
+			}
 		} else {
 			/* got EOF
 			 */
@@ -1351,7 +4178,7 @@ static int tail0loop(int fdin, int fdout)
 	return 0;
 }
 
-static int tail0(char *filename, int seek_end)
+static int tail0(char *filename, off_t offset)
 {
 	int fd;
 
@@ -1364,11 +4191,11 @@ static int tail0(char *filename, int seek_end)
 		return -1;
 	}
 
-	if (seek_end && lseek(fd, 0, SEEK_END) < 0) {
+	if (offset && lseek(fd, offset, SEEK_SET) < 0) {
 		int save_errno = errno;
 		errno = save_errno;
-		DEBUG("lseek(fd=%i, 0, SEEK_END), errno=%i", fd, save_errno);
-		perror("lseek(fd, 0, SEEK_END)");
+		DEBUG("lseek(fd=%i, offset=%lli, SEEK_SET), errno=%i", fd, (long long)offset, save_errno);
+		perror("lseek(fd, offset, SEEK_SET)");
 
 		assert(close(fd) == 0);
 		fd = -1;
@@ -1382,13 +4209,3 @@ static int tail0(char *filename, int seek_end)
 
 	return 0;
 }
-
-static int tail_fn0(char *filename)
-{
-	return tail0(filename, 1 /* seek end */);
-}
-
-static int tail_f(char *filename)
-{
-	return tail0(filename, 0 /* seek end */);
-}
@@ -1,10 +1,29 @@
 #ifndef nndkh2b7jr7nt4v1qe /* aimant-h */
 #define nndkh2b7jr7nt4v1qe /* aimant-h */
 
+#define SINK_MAX 8
+
+#define SINK_POLICY_BLOCK 0 /* suspend taps while lagging */
+#define SINK_POLICY_DROP 1 /* drop chunks past max_lag */
+
 struct sink {
-	int fd; /* shortcut to sp->child_fdin */
-	struct subprocess sp[1];
+	int fd; /* shortcut to sp->child_fdin, or a socket/fifo/file */
+	struct subprocess sp[1]; /* pid is 0 if not a subprocess */
 	int got_eof;
+	struct buffer_queue *q; /* own cursors into shared chunks */
+	int policy;
+	long max_lag;
+	long long lag; /* bytes enqueued and not written yet */
+	long long written;
+	long long dropped;
+	long long teed; /* bytes duplicated with tee(2), never enqueued */
+	int is_pipe;
+	int primary; /* acks the checkpoint */
+	int split; /* one of the split group (-O), gets its own lines */
+	int pending_tee; /* teed from the tap being read, skip on enqueue */
+	struct sink_thread *t; /* NULL if written by the main loop */
+	int vmsplice; /* pooled chunks go with vmsplice(2) */
+	unsigned long long piped; /* bytes ever put in the pipe */
 };
 
 struct fd_tap {
@@ -28,6 +47,9 @@ struct cat_tap { /* "tail -fn0" really */
 	int fd; /* shortcut to sp->child_fdout */
 	struct str path[1];
 	struct subprocess sp[1];
+	dev_t dev; /* of path at open time */
+	ino_t ino;
+	off_t offset; /* file offset of next byte to be read */
 	int bytes_read;
 	//struct timeval time_read[1];
 	int got_eof;
@@ -0,0 +1,135 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * allocation accounting, see alloc.h
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "debug0.h"
+
+#include "alloc.h"
+
+struct alloc_account {
+	long long calls;
+	long long bytes;
+	long long frees;
+	long long steady;
+};
+
+static struct alloc_account accounts[ALLOC_NSUBSYS];
+
+static const char *names[ALLOC_NSUBSYS] = {
+	[ALLOC_OTHER] = "other",
+	[ALLOC_STR] = "str",
+	[ALLOC_ITEM] = "item",
+	[ALLOC_DICT] = "dict",
+	[ALLOC_CHUNK] = "chunk",
+	[ALLOC_HASH] = "hash",
+};
+
+static struct alloc_backend backend[1] = {{malloc, calloc, realloc, free}};
+
+int alloc_steady_check = 0;
+static __thread int steady = 0;
+
+void alloc_set_backend(const struct alloc_backend *b)
+{
+	*backend = *b;
+}
+
+static void steady_violation(int subsys, size_t n, void *caller)
+{
+	struct alloc_account *a = accounts + subsys;
+	if (__atomic_add_fetch(&a->steady, 1, __ATOMIC_RELAXED) == 1 || alloc_steady_check > 1) {
+		DEBUG("%s allocation of %zu bytes in steady state, called from %p", names[subsys], n, caller);
+	}
+	if (alloc_steady_check > 1) {
+		debug0_flush();
+		abort();
+	}
+}
+
+static inline void account(int subsys, size_t n, void *caller)
+{
+	struct alloc_account *a = accounts + subsys;
+	assert(subsys >= 0 && subsys < ALLOC_NSUBSYS);
+	__atomic_add_fetch(&a->calls, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&a->bytes, n, __ATOMIC_RELAXED);
+	if (steady && alloc_steady_check) steady_violation(subsys, n, caller);
+}
+
+void *alloc_malloc(int subsys, size_t n)
+{
+	account(subsys, n, __builtin_return_address(0));
+	return backend->malloc(n);
+}
+
+void *alloc_calloc(int subsys, size_t nmemb, size_t n)
+{
+	account(subsys, nmemb * n, __builtin_return_address(0));
+	return backend->calloc(nmemb, n);
+}
+
+void *alloc_realloc(int subsys, void *p, size_t n)
+{
+	account(subsys, n, __builtin_return_address(0));
+	if (p) __atomic_add_fetch(&accounts[subsys].frees, 1, __ATOMIC_RELAXED);
+	return backend->realloc(p, n);
+}
+
+void alloc_free(int subsys, void *p)
+{
+	if (p == NULL) return;
+	__atomic_add_fetch(&accounts[subsys].frees, 1, __ATOMIC_RELAXED);
+	backend->free(p);
+}
+
+int alloc_steady(int on)
+{
+	int r = steady;
+	steady = on;
+	return r;
+}
+
+void alloc_get_counts(int subsys, struct alloc_counts *x)
+{
+	struct alloc_account *a = accounts + subsys;
+	assert(subsys >= 0 && subsys < ALLOC_NSUBSYS);
+	x->calls = __atomic_load_n(&a->calls, __ATOMIC_RELAXED);
+	x->bytes = __atomic_load_n(&a->bytes, __ATOMIC_RELAXED);
+	x->live = x->calls - __atomic_load_n(&a->frees, __ATOMIC_RELAXED);
+	x->steady = __atomic_load_n(&a->steady, __ATOMIC_RELAXED);
+}
+
+const char *alloc_subsys_name(int subsys)
+{
+	assert(subsys >= 0 && subsys < ALLOC_NSUBSYS);
+	return names[subsys];
+}
@@ -0,0 +1,66 @@
+#ifndef nh5tq0c8mrj2wyx7eb /* alloc-h */
+#define nh5tq0c8mrj2wyx7eb /* alloc-h */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" { /* assume C declarations for C++ */
+#endif
+
+/* allocations of str.c, item.h and dict.h (and whoever else asks) go
+ * through here, counted per subsystem, the backend is the libc one
+ * unless another is plugged in before the first allocation
+ */
+
+enum alloc_subsys {
+	ALLOC_OTHER = 0,
+	ALLOC_STR,
+	ALLOC_ITEM,
+	ALLOC_DICT,
+	ALLOC_CHUNK,
+	ALLOC_HASH,
+	ALLOC_NSUBSYS
+};
+
+struct alloc_backend {
+	void *(*malloc)(size_t n);
+	void *(*calloc)(size_t nmemb, size_t n);
+	void *(*realloc)(void *p, size_t n);
+	void (*free)(void *p);
+};
+
+void alloc_set_backend(const struct alloc_backend *b);
+
+/* same semantics as their libc counterparts
+ */
+void *alloc_malloc(int subsys, size_t n);
+void *alloc_calloc(int subsys, size_t nmemb, size_t n);
+void *alloc_realloc(int subsys, void *p, size_t n);
+void alloc_free(int subsys, void *p);
+
+/* steady state, per thread: once entered (after warm-up), allocating
+ * is flagged according to alloc_steady_check, 0 ignores it, 1 counts
+ * it and reports the first one of each subsystem, 2 aborts
+ *
+ * returns the previous state, so regions that are allowed to
+ * allocate can be bracketed
+ */
+extern int alloc_steady_check;
+int alloc_steady(int on);
+
+struct alloc_counts {
+	long long calls; /* including reallocs */
+	long long bytes; /* requested so far */
+	long long live; /* calls that were not freed yet */
+	long long steady; /* calls in steady state */
+};
+
+void alloc_get_counts(int subsys, struct alloc_counts *x);
+
+const char *alloc_subsys_name(int subsys);
+
+#ifdef __cplusplus
+}; /* end of function prototypes */
+#endif
+
+#endif /* !nh5tq0c8mrj2wyx7eb alloc-h */
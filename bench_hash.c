@@ -0,0 +1,186 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * microbenchmark, hash.h against dict.h
+ *
+ * usage example:
+ *
+
+./bench_hash
+./bench_hash 10000000
+
+ *
+ * each case inserts n keys, looks them all up, looks up n absent keys
+ * and deletes them all, keys are scrambled so neither container sees
+ * them in order, reports nanoseconds per operation
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "hash.h"
+#include "dict.h"
+
+#define long_eq(a, b) ((a) == (b))
+
+DEFINE_HASH(long_hash, long, long, hash_u64, long_eq);
+
+DEFINE_DICT(long_dict, long_dict_item,
+	    long k;
+	    long v;
+	);
+
+int long_dict_item_cmp(struct long_dict_item *a, struct long_dict_item *b)
+{
+	return (a->k > b->k) - (a->k < b->k);
+}
+
+static double now()
+{
+	struct timespec ts[1];
+	assert(clock_gettime(CLOCK_MONOTONIC, ts) == 0);
+	return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+static void report(const char *name, double t0, long n, long sum)
+{
+	printf("%-16s %8.2f ns/op (checksum %li)\n", name, (now() - t0) / n, sum);
+}
+
+/* a bijection, so keys are distinct, odd keys are present and even
+ * ones are the misses
+ */
+static long key(long i)
+{
+	return (long)(((unsigned long)i * 0x9e3779b97f4a7c15UL) | 1);
+}
+
+static long miss(long i)
+{
+	return key(i) & ~1L;
+}
+
+static void bench_hash(long n)
+{
+	struct long_hash *h;
+	long i, sum, *v;
+	double t0;
+	int created;
+
+	assert((h = long_hash_new0()));
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		assert((v = long_hash_put(h, key(i), &created)) && created);
+		*v = i;
+		sum += i;
+	}
+	report("hash_insert", t0, n, sum);
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		assert((v = long_hash_get(h, key(i))));
+		sum += *v;
+	}
+	report("hash_hit", t0, n, sum);
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		sum += long_hash_get(h, miss(i)) == NULL;
+	}
+	report("hash_miss", t0, n, sum);
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		sum += long_hash_del(h, key(i)) == 0;
+	}
+	report("hash_delete", t0, n, sum);
+
+	assert(long_hash_len(h) == 0);
+	long_hash_free0(h);
+}
+
+static void bench_dict(long n)
+{
+	struct long_dict *d;
+	struct long_dict_item *x, k[1];
+	long i, sum;
+	double t0;
+
+	assert((d = long_dict_new0()));
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		assert((x = long_dict_item_new0()));
+		x->k = key(i);
+		x->v = i;
+		long_dict_insert(d, x);
+		sum += i;
+	}
+	report("dict_insert", t0, n, sum);
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		k->k = key(i);
+		assert((x = long_dict_search(d, k)));
+		sum += x->v;
+	}
+	report("dict_hit", t0, n, sum);
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		k->k = miss(i);
+		sum += long_dict_search(d, k) == NULL;
+	}
+	report("dict_miss", t0, n, sum);
+
+	t0 = now();
+	for (i = 0, sum = 0; i < n; i++) {
+		k->k = key(i);
+		if ((x = long_dict_search(d, k))) {
+			long_dict_remove(d, x);
+			long_dict_item_free0(x);
+			sum++;
+		}
+	}
+	report("dict_delete", t0, n, sum);
+
+	long_dict_free0(d);
+	long_dict_item_pool_trim();
+}
+
+int main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+	bench_hash(n);
+	bench_dict(n);
+
+	return 0;
+}
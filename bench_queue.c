@@ -0,0 +1,217 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * microbenchmark, item.h queue against fifo and ring
+ *
+ * usage example:
+ *
+
+./bench_queue
+./bench_queue 10000000
+
+ *
+ * each case does rounds of "enqueue a burst, dequeue it all" (the
+ * pattern of the aimant main loop) and reports nanoseconds per item,
+ * the mpsc and spsc cases use one producer and one consumer thread
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "item.h"
+
+#define BURST 64
+
+DEFINE_ITEM(node,
+	    long v;
+  );
+
+DEFINE_QUEUE(node_queue, node);
+DEFINE_FIFO(node_fifo, node);
+DEFINE_FIFO_MPSC(node_fifo_mpsc, node);
+DEFINE_RING(long_ring, long);
+DEFINE_RING_SPSC(long_ring_spsc, long);
+
+static double now()
+{
+	struct timespec ts[1];
+	assert(clock_gettime(CLOCK_MONOTONIC, ts) == 0);
+	return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+static void report(const char *name, double t0, long n, long sum)
+{
+	printf("%-16s %8.2f ns/item (checksum %li)\n", name, (now() - t0) / n, sum);
+}
+
+/* nodes are allocated once, as a pool would do, so the containers
+ * are measured and not malloc
+ */
+static struct node *pool;
+
+static void bench_queue(long n)
+{
+	struct node_queue *q = node_queue_new0();
+	long i, j, sum = 0;
+	double t0 = now();
+	for (i = 0; i < n; i += BURST) {
+		struct node *x;
+		for (j = 0; j < BURST; j++) {
+			x = node_tail0(pool + j, q->enqueue);
+			x->v = i + j;
+			q->enqueue = x;
+		}
+		sum += node_queue_len(q);
+		while ((x = node_queue_dequeue(q))) sum += x->v;
+	}
+	report("queue", t0, n, sum);
+	alloc_free(ALLOC_ITEM, q);
+}
+
+static void bench_fifo(long n)
+{
+	struct node_fifo *q = node_fifo_new0();
+	long i, j, sum = 0;
+	double t0 = now();
+	for (i = 0; i < n; i += BURST) {
+		struct node *x;
+		for (j = 0; j < BURST; j++) {
+			pool[j].v = i + j;
+			node_fifo_enqueue(q, pool + j);
+		}
+		sum += node_fifo_len(q);
+		while ((x = node_fifo_dequeue(q))) sum += x->v;
+	}
+	report("fifo", t0, n, sum);
+	alloc_free(ALLOC_ITEM, q);
+}
+
+static void bench_ring(long n)
+{
+	struct long_ring *q = long_ring_new0(BURST);
+	long i, j, v, sum = 0;
+	double t0 = now();
+	for (i = 0; i < n; i += BURST) {
+		for (j = 0; j < BURST; j++) {
+			assert(long_ring_push(q, i + j) == 0);
+		}
+		sum += long_ring_len(q);
+		while (long_ring_pop(q, &v) == 0) sum += v;
+	}
+	report("ring", t0, n, sum);
+	long_ring_free0(q);
+}
+
+struct spsc_arg {
+	long n;
+	struct node_fifo_mpsc *fifo; /* with a single producer */
+	struct long_ring_spsc *ring;
+};
+
+static void *fifo_mpsc_producer(void *p)
+{
+	struct spsc_arg *a = p;
+	long i;
+	for (i = 0; i < a->n; i++) {
+		pool[i].v = i;
+		node_fifo_mpsc_enqueue(a->fifo, pool + i);
+	}
+	return NULL;
+}
+
+static void bench_fifo_mpsc(long n)
+{
+	struct spsc_arg a[1] = {{n, node_fifo_mpsc_new0(), NULL}};
+	pthread_t t;
+	long i = 0, sum = 0;
+	double t0 = now();
+	assert(pthread_create(&t, NULL, fifo_mpsc_producer, a) == 0);
+	while (i < n) {
+		struct node *x;
+		if ((x = node_fifo_mpsc_dequeue(a->fifo))) {
+			sum += x->v;
+			i++;
+		} else {
+			sched_yield();
+		}
+	}
+	assert(pthread_join(t, NULL) == 0);
+	report("fifo_mpsc", t0, n, sum);
+	alloc_free(ALLOC_ITEM, a->fifo);
+}
+
+static void *ring_spsc_producer(void *p)
+{
+	struct spsc_arg *a = p;
+	long i;
+	for (i = 0; i < a->n; i++) {
+		while (long_ring_spsc_push(a->ring, i)) sched_yield();
+	}
+	return NULL;
+}
+
+static void bench_ring_spsc(long n)
+{
+	struct spsc_arg a[1] = {{n, NULL, long_ring_spsc_new0(1024)}};
+	pthread_t t;
+	long i = 0, v, sum = 0;
+	double t0 = now();
+	assert(pthread_create(&t, NULL, ring_spsc_producer, a) == 0);
+	while (i < n) {
+		if (long_ring_spsc_pop(a->ring, &v) == 0) {
+			sum += v;
+			i++;
+		} else {
+			sched_yield(); /* spinning is pointless on one cpu */
+		}
+	}
+	assert(pthread_join(t, NULL) == 0);
+	report("ring_spsc", t0, n, sum);
+	long_ring_spsc_free0(a->ring);
+}
+
+int main(int argc, char **argv)
+{
+	long n = argc > 1 ? atol(argv[1]) : 1000000;
+
+	n = (n + BURST - 1) / BURST * BURST;
+	assert((pool = calloc(n, sizeof(struct node))));
+
+	bench_queue(n);
+	bench_fifo(n);
+	bench_ring(n);
+	bench_fifo_mpsc(n);
+	bench_ring_spsc(n);
+
+	free(pool);
+
+	return 0;
+}
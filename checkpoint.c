@@ -0,0 +1,263 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * offsets checkpoint, allow restarting without losing what the
+ * producer wrote meanwhile
+ *
+ * file format (text, one slot per line):
+ *
+ *   current <inode> <offset> <acked>
+ *   hanging <inode> <offset> <acked>
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "debug0.h"
+#include "str.h"
+#include "subprocess.h"
+#include "timer.h"
+
+#include "checkpoint.h"
+
+static int write_exact(int fd, void *buf, int len)
+{
+	int i, wrote = 0;
+	do {
+		if ((i = write(fd, buf + wrote, len - wrote)) <= 0) return i;
+		wrote += i;
+	} while (wrote < len);
+	return len;
+}
+
+static int parse_slot(const char *line, const char *name, struct checkpoint_slot *slot)
+{
+	char tag[16];
+	unsigned long long ino, dev = 0;
+	long long offset, acked;
+	int n;
+
+	/* the device came last and later, without it a slot still loads
+	 */
+	if ((n = sscanf(line, "%15s %llu %lld %lld %llu", tag, &ino, &offset, &acked, &dev)) != 4 && n != 5) return -1;
+	if (strcmp(tag, name)) return -1;
+	if (offset < 0 || acked < 0 || acked > offset) return -1;
+
+	slot->dev = dev;
+	slot->ino = ino;
+	slot->offset = offset;
+	slot->acked = acked;
+
+	return 0;
+}
+
+int checkpoint_load(struct checkpoint *x, const char *path)
+{
+	int fd, n;
+	char buf[256];
+	char *nl;
+
+	memset(x, 0, sizeof(struct checkpoint));
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	if ((n = read(fd, buf, sizeof(buf) - 1)) < 0) {
+		int save_errno = errno;
+		assert(n == -1);
+		close(fd);
+		errno = save_errno;
+		return -1;
+	}
+	assert(close(fd) == 0);
+	buf[n] = 0;
+
+	if ((nl = strchr(buf, '\n')) == NULL ||
+	    parse_slot(buf, "current", x->current) ||
+	    parse_slot(nl + 1, "hanging", x->hanging)) {
+		DEBUG("checkpoint_load(path=[%s]): malformed checkpoint", path);
+		memset(x, 0, sizeof(struct checkpoint));
+		errno = EINVAL;
+		return -1;
+	}
+
+	x->saved = timer_now_msec();
+
+	DEBUG_INFO("checkpoint_load(path=[%s]): current=%llu/%lld, hanging=%llu/%lld", path,
+		   (unsigned long long)x->current->ino, (long long)x->current->acked,
+		   (unsigned long long)x->hanging->ino, (long long)x->hanging->acked);
+
+	return 0;
+}
+
+static struct str_arena *scratch = NULL; /* checkpoint_save() strings, reset every time */
+
+int checkpoint_save(struct checkpoint *x, const char *path)
+{
+	const char *slash;
+	int fd, r;
+	DEFINE_STR(tmp_path);
+	DEFINE_STR(data);
+
+	if (scratch == NULL) {
+		scratch = str_arena_new(PATH_MAX);
+	}
+	str_arena_reset(scratch);
+	tmp_path->arena = scratch;
+	data->arena = scratch;
+
+	str_copyf(data, "current %llu %lld %lld %llu\nhanging %llu %lld %lld %llu\n",
+		  (unsigned long long)x->current->ino, (long long)x->current->offset, (long long)x->current->acked,
+		  (unsigned long long)x->current->dev,
+		  (unsigned long long)x->hanging->ino, (long long)x->hanging->offset, (long long)x->hanging->acked,
+		  (unsigned long long)x->hanging->dev);
+
+	str_copyz(tmp_path, path);
+	str_catz(tmp_path, ".tmp");
+
+	if ((fd = open(tmp_path->s, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		int save_errno = errno;
+		DEBUG("open(tmp_path=[%s]), errno=%i", tmp_path->s, save_errno);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+
+	/* data must hit the disk before the rename, otherwise a crash
+	 * may leave an empty checkpoint behind
+	 */
+	if (write_exact(fd, data->s, data->len) != data->len || fsync(fd)) {
+		int save_errno = errno;
+		DEBUG("writing checkpoint [%s], errno=%i", tmp_path->s, save_errno);
+		close(fd);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+	assert(close(fd) == 0);
+
+	if ((r = rename(tmp_path->s, path))) {
+		int save_errno = errno;
+		assert(r == -1);
+		DEBUG("rename(tmp_path=[%s], path=[%s]), errno=%i", tmp_path->s, path, save_errno);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+
+	/* nor is the rename there after a crash until the directory
+	 * is synced too (some filesystems can't, EINVAL)
+	 */
+	if ((slash = strrchr(path, '/'))) {
+		str_copyn(tmp_path, path, slash == path ? 1 : slash - path);
+	} else {
+		str_copyz(tmp_path, ".");
+	}
+	if ((fd = open(tmp_path->s, O_RDONLY | O_DIRECTORY)) < 0 || (fsync(fd) && errno != EINVAL)) {
+		int save_errno = errno;
+		DEBUG("syncing checkpoint directory [%s], errno=%i", tmp_path->s, save_errno);
+		if (fd >= 0) close(fd);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+	assert(close(fd) == 0);
+
+	str_free(tmp_path);
+	str_free(data);
+
+	x->dirty = 0;
+	x->saved = timer_now_msec();
+
+	return 0;
+}
+
+int checkpoint_save_lazy(struct checkpoint *x, const char *path, int msec)
+{
+	if (!x->dirty) return 0;
+
+	/* monotonic, a clock step must not hold saves back
+	 */
+	if (timer_now_msec() - x->saved < msec) return 0;
+
+	return checkpoint_save(x, path);
+}
+
+static int slot_is(struct checkpoint_slot *slot, dev_t dev, ino_t ino)
+{
+	return slot->ino == ino && (slot->dev == 0 || slot->dev == dev);
+}
+
+struct checkpoint_slot *checkpoint_slot_by_ino(struct checkpoint *x, dev_t dev, ino_t ino)
+{
+	if (ino == 0) return NULL;
+	if (slot_is(x->current, dev, ino)) return x->current;
+	if (slot_is(x->hanging, dev, ino)) return x->hanging;
+	return NULL;
+}
+
+void checkpoint_rotate(struct checkpoint *x, dev_t dev, ino_t new_current)
+{
+	*x->hanging = *x->current;
+	x->current->dev = dev;
+	x->current->ino = new_current;
+	x->current->offset = 0;
+	x->current->acked = 0;
+	x->dirty = 1;
+}
+
+void checkpoint_ack(struct checkpoint *x, ino_t ino, off_t offset)
+{
+	struct checkpoint_slot *slot;
+	if (ino == 0) return;
+	if (x->current->ino == ino) {
+		slot = x->current;
+	} else if (x->hanging->ino == ino) {
+		slot = x->hanging;
+	} else {
+		/* a file we are not following anymore
+		 */
+		return;
+	}
+	if (offset > slot->acked) {
+		slot->acked = offset;
+		if (offset > slot->offset) slot->offset = offset;
+		x->dirty = 1;
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef nn9ap9i1o8dr1lskzk /* checkpoint-h */
+#define nn9ap9i1o8dr1lskzk /* checkpoint-h */
+
+#include <sys/types.h>
+
+/* a slot follows one file by inode, since the same file is first the
+ * current log and then, after rename, the hanging one
+ */
+struct checkpoint_slot {
+	dev_t dev; /* 0 if not known, saved by an older aimant */
+	ino_t ino; /* 0 means unused */
+	off_t offset; /* read by the tap so far */
+	off_t acked; /* fully written to the sink, resume point */
+};
+
+struct checkpoint {
+	struct checkpoint_slot current[1];
+	struct checkpoint_slot hanging[1];
+	int dirty;
+	long long saved; /* timer_now_msec() */
+};
+
+/* 0 on success, -1 on error and errno is set appropriately (ENOENT
+ * when there is no checkpoint yet)
+ */
+int checkpoint_load(struct checkpoint *x, const char *path);
+
+/* write to path.tmp, fsync, rename over path and fsync its directory,
+ * 0 on success, -1 on error and errno is set appropriately
+ */
+int checkpoint_save(struct checkpoint *x, const char *path);
+
+/* save only if dirty and msec elapsed since last save
+ */
+int checkpoint_save_lazy(struct checkpoint *x, const char *path, int msec);
+
+/* an inode number is only unique on its device, a slot of unknown
+ * device matches on the inode alone
+ */
+struct checkpoint_slot *checkpoint_slot_by_ino(struct checkpoint *x, dev_t dev, ino_t ino);
+
+/* "current" got renamed to "hanging" and a new file took its place
+ */
+void checkpoint_rotate(struct checkpoint *x, dev_t dev, ino_t new_current);
+
+/* ino is a file being followed, both slots are in the log directory
+ * and so on one device (rename does not cross filesystems), the inode
+ * alone picks the slot
+ */
+void checkpoint_ack(struct checkpoint *x, ino_t ino, off_t offset);
+
+#endif /* !nn9ap9i1o8dr1lskzk checkpoint-h */
@@ -22,35 +22,72 @@ OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
 ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/*
+ * DEBUG() and DEBUG_INFO() output
+ *
+ * every thread formats its lines into its own ring (one producer, the
+ * thread, one consumer, the writer), so there is no lock and no
+ * syscall in the caller, a background writer drains all rings with a
+ * single writev(), it is woken (eventfd) only when it said it was
+ * going to sleep, so a burst of lines costs one wakeup
+ *
+ * the "YYYY-MM-DDTHH:MM:SS" part of the timestamp is formatted once
+ * per second per thread, the rest (fraction, line number) with a
+ * backfill integer formatter, only the message itself goes through
+ * vsnprintf
+ *
+ * until debug0_async_start() (and in forked children) lines are
+ * written right away, as they always were
+ *
+ * a full ring drops lines (the writer reports how many), a logging
+ * thread never blocks
+ *
+ */
+
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/stat.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include <stdarg.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 
 #include "debug0.h"
 
-//#define USE_CLOCK_GETTIME
+#define RING_SIZE 0x40000 /* 256K per thread, power of 2 */
+#define LINE_MAX0 0x1000 /* longer lines are truncated */
 
-static void get_current_timeval(struct timeval *tv)
-{
-#ifdef USE_CLOCK_GETTIME
-	struct timespec ts[1];
-	assert(clock_gettime(CLOCK_REALTIME, ts) == 0);
-	tv->tv_sec = ts->tv_sec;
-	tv->tv_usec = ts->tv_nsec / 1000;
-#else
-	assert(gettimeofday(tv, NULL) == 0);
-#endif
-}
+int debug0_level = DEBUG_LEVEL_DEBUG;
+
+struct ring {
+	char buf[RING_SIZE];
+	unsigned long head; /* producer, bytes ever written */
+	char _pad0[64 - sizeof(unsigned long)];
+	unsigned long tail; /* consumer, bytes ever drained */
+	char _pad1[64 - sizeof(unsigned long)];
+	unsigned long dropped; /* lines, producer side */
+	unsigned long dropped_seen; /* consumer side */
+	int owned; /* a live thread is using it */
+	struct ring *next; /* rings list, never shrinks */
+};
+
+static struct ring *rings = NULL;
+static int async = 0;
+static int writer_efd = -1;
+static int writer_waiting = 0;
+static pthread_t writer;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER; /* writer vs debug0_flush */
+static pthread_key_t ring_key;
+
+static __thread struct ring *my_ring = NULL;
+static __thread time_t ts_sec = -1;
+static __thread char ts_buf[24]; /* "YYYY-MM-DDTHH:MM:SS." */
+static __thread int ts_len;
 
 static int write_exact(int fd, void *buf, int len)
 {
@@ -64,47 +101,322 @@ static int write_exact(int fd, void *buf, int len)
 	return len;
 }
 
-/* sub or zero */
-#define SOZ(a,b) ((a) > (b) ? (a) - (b) : 0)
+/* a short write is finished here rather than cutting a line
+ */
+static void writev_exact(int fd, struct iovec *iov, int n)
+{
+	while (n) {
+		ssize_t w = writev(fd, iov, n);
+		if (w < 0) {
+			if (errno == EINTR) continue;
+			return;
+		}
+		while (n && w >= iov->iov_len) {
+			w -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n) {
+			iov->iov_base += w;
+			iov->iov_len -= w;
+		}
+	}
+}
+
+#define DEC_DIGIT(v) ("0123456789"[v])
 
-void debug0(char *file, int line, char *format, ...)
+/* writes v right aligned in width digits (zero padded) ending at s,
+ * returns where it starts (same idea as subprocess.c backfill)
+ */
+static char *backfill_dec(char *s, unsigned int v, int width)
+{
+	do {
+		*--s = DEC_DIGIT(v % 10);
+		v /= 10;
+		width--;
+	} while (v);
+	while (width-- > 0) {
+		*--s = '0';
+	}
+	return s;
+}
+
+/* "YYYY-MM-DDTHH:MM:SS.uuuuu: file:line: ", same format (1/100 of
+ * millisecond, as svlogd -ttt) as before, returns its length
+ */
+static int format_prefix(char *buf, const char *file, int line)
+{
+	struct timespec ts[1];
+	char num[16];
+	char *p;
+	int n, l;
+
+	assert(clock_gettime(CLOCK_REALTIME, ts) == 0);
+
+	if (ts->tv_sec != ts_sec) {
+		struct tm tm[1];
+		ts_sec = ts->tv_sec;
+		assert(localtime_r(&ts_sec, tm) == tm);
+		ts_len = snprintf(ts_buf, sizeof(ts_buf), "%u-%.2u-%.2uT%.2u:%.2u:%.2u.",
+				  tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+				  tm->tm_hour, tm->tm_min, tm->tm_sec);
+	}
+
+	memcpy(buf, ts_buf, ts_len);
+	n = ts_len;
+
+	p = backfill_dec(num + sizeof(num), ts->tv_nsec / 10000, 5);
+	memcpy(buf + n, p, num + sizeof(num) - p);
+	n += num + sizeof(num) - p;
+
+	buf[n++] = ':';
+	buf[n++] = ' ';
+	l = strlen(file);
+	memcpy(buf + n, file, l);
+	n += l;
+	buf[n++] = ':';
+
+	p = backfill_dec(num + sizeof(num), line, 1);
+	memcpy(buf + n, p, num + sizeof(num) - p);
+	n += num + sizeof(num) - p;
+
+	buf[n++] = ':';
+	buf[n++] = ' ';
+
+	return n;
+}
+
+static void ring_release(void *p)
+{
+	struct ring *r = p;
+	__atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* a ring left by a thread gone, or a new one
+ */
+static struct ring *ring_get()
+{
+	struct ring *r;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		int zero = 0;
+		if (__atomic_compare_exchange_n(&r->owned, &zero, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	if (r == NULL) {
+		if ((r = calloc(1, sizeof(struct ring))) == NULL) {
+			return NULL;
+		}
+		r->owned = 1;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+
+	pthread_setspecific(ring_key, r);
+	return r;
+}
+
+static void ring_put(struct ring *r, const char *line, int len)
 {
-	/* TODO: put timezone or use UTC
+	unsigned long head = r->head;
+	unsigned long tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	unsigned long pos = head & (RING_SIZE - 1);
+	int first;
+
+	if (RING_SIZE - (head - tail) < len) {
+		__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	first = RING_SIZE - pos < len ? RING_SIZE - pos : len;
+	memcpy(r->buf + pos, line, first);
+	memcpy(r->buf, line + first, len - first);
+	__atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+
+	/* the head store before the writer_waiting load, pairs with the
+	 * fence in writer_main: either we see the writer waiting or its
+	 * last drain sees our head
 	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&writer_waiting, __ATOMIC_ACQUIRE) &&
+	    __atomic_exchange_n(&writer_waiting, 0, __ATOMIC_ACQ_REL)) {
+		unsigned long long one = 1;
+		if (write(writer_efd, &one, sizeof(one))) {
+			/* nothing to do */
+		}
+	}
+}
 
-	time_t t;
-	struct tm tm[1];
-	struct timeval tv[1];
-	va_list valist1;
-	char buf[0x7fff];
-	int n;
-	long usec;
+#define DRAIN_RINGS 32 /* at a time, the rest wait for the next drain */
 
-	va_start(valist1, format);
+/* returns bytes drained, caller holds drain_lock
+ */
+static long drain()
+{
+	struct iovec iov[3 * DRAIN_RINGS]; /* dropped notice and two segments each */
+	unsigned long upto[DRAIN_RINGS];
+	struct ring *rs[DRAIN_RINGS];
+	char dropped_msg[DRAIN_RINGS][64];
+	struct ring *r;
+	int n = 0, nr = 0, nd = 0, i;
+	long total = 0;
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r && nr < DRAIN_RINGS && nd < DRAIN_RINGS; r = r->next) {
+		unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		unsigned long tail = r->tail;
+		unsigned long dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+		unsigned long pos = tail & (RING_SIZE - 1);
+		unsigned long len = head - tail;
+
+		if (dropped != r->dropped_seen) {
+			iov[n].iov_base = dropped_msg[nd];
+			iov[n].iov_len = snprintf(dropped_msg[nd], sizeof(dropped_msg[nd]), "debug0: %lu lines dropped\n", dropped - r->dropped_seen);
+			n++;
+			nd++;
+			r->dropped_seen = dropped;
+		}
+		if (len == 0) {
+			continue;
+		}
+		if (pos + len > RING_SIZE) {
+			iov[n].iov_base = r->buf + pos;
+			iov[n].iov_len = RING_SIZE - pos;
+			n++;
+			iov[n].iov_base = r->buf;
+			iov[n].iov_len = len - (RING_SIZE - pos);
+			n++;
+		} else {
+			iov[n].iov_base = r->buf + pos;
+			iov[n].iov_len = len;
+			n++;
+		}
+		rs[nr] = r;
+		upto[nr++] = head;
+		total += len;
+	}
+
+	if (n) {
+		writev_exact(STDERR_FILENO, iov, n);
+	}
+
+	for (i = 0; i < nr; i++) {
+		__atomic_store_n(&rs[i]->tail, upto[i], __ATOMIC_RELEASE);
+	}
+
+	return total;
+}
+
+static void *writer_main(void *arg)
+{
+	for (;;) {
+		unsigned long long v;
+		long drained;
+
+		pthread_mutex_lock(&drain_lock);
+		drained = drain();
+		pthread_mutex_unlock(&drain_lock);
+
+		if (drained) {
+			continue;
+		}
 
-	get_current_timeval(tv);
+		/* going to sleep, a producer seeing writer_waiting wakes
+		 * us, drain again before sleeping so nothing is left
+		 * behind a missed flag
+		 */
+		__atomic_store_n(&writer_waiting, 1, __ATOMIC_RELEASE);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST); /* before the heads are read */
+		pthread_mutex_lock(&drain_lock);
+		drained = drain();
+		pthread_mutex_unlock(&drain_lock);
+		if (drained) {
+			__atomic_store_n(&writer_waiting, 0, __ATOMIC_RELEASE);
+			continue;
+		}
+		if (read(writer_efd, &v, sizeof(v)) < 0 && errno != EINTR) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void atfork_child()
+{
+	/* no writer in here
+	 */
+	async = 0;
+	my_ring = NULL;
+}
+
+void debug0_flush()
+{
+	if (!async) {
+		return;
+	}
+	pthread_mutex_lock(&drain_lock);
+	while (drain())
+		;
+	pthread_mutex_unlock(&drain_lock);
+}
+
+int debug0_async_start()
+{
+	sigset_t all[1], old[1];
+	int r;
+
+	if (async) {
+		return 0;
+	}
 
-	t = tv->tv_sec;
-	usec = tv->tv_usec;
+	if ((writer_efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+		return -1;
+	}
 
-	assert(localtime_r(&t, tm) == tm);
+	assert(pthread_key_create(&ring_key, ring_release) == 0);
+	assert(pthread_atfork(NULL, NULL, atfork_child) == 0);
 
-	/* the time resolution (1/100 of millisecond) below is the
-	 * same used by svlogd with -ttt option
+	/* signals stay with the main thread
 	 */
+	sigfillset(all);
+	pthread_sigmask(SIG_SETMASK, all, old);
+	r = pthread_create(&writer, NULL, writer_main, NULL);
+	pthread_sigmask(SIG_SETMASK, old, NULL);
+	if (r) {
+		close(writer_efd);
+		writer_efd = -1;
+		errno = r;
+		return -1;
+	}
+	pthread_detach(writer);
 
-	n = 0;
-	n = snprintf(buf+n, SOZ(sizeof(buf),n),
-		     "%u-%.2u-%.2uT%.2u:%.2u:%.2u.%.5u: %s:%i: ",
-		     tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-		     tm->tm_hour, tm->tm_min, tm->tm_sec,
-		     (unsigned int)(usec/10),
-		     file, line
-		);
-	n += vsnprintf(buf+n, SOZ(sizeof(buf),n), format, valist1);
-	n += snprintf(buf+n, SOZ(sizeof(buf),n), "\n");
+	atexit(debug0_flush);
+	async = 1;
 
-	write_exact(STDERR_FILENO, buf, n);
+	return 0;
+}
 
+void debug0(char *file, int line, char *format, ...)
+{
+	char buf[LINE_MAX0];
+	va_list valist1;
+	int n, m;
+
+	n = format_prefix(buf, file, line);
+
+	va_start(valist1, format);
+	m = vsnprintf(buf + n, sizeof(buf) - n - 1, format, valist1);
 	va_end(valist1);
+
+	if (m < 0) m = 0;
+	n += m < sizeof(buf) - n - 1 ? m : sizeof(buf) - n - 2;
+	buf[n++] = '\n';
+
+	if (async && (my_ring || (my_ring = ring_get()))) {
+		ring_put(my_ring, buf, n);
+	} else {
+		write_exact(STDERR_FILENO, buf, n);
+	}
 }
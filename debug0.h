@@ -2,9 +2,9 @@
 #ifndef NO_DEBUG
 
 #if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
-# define DEBUG(...) do {debug0(__FILE__, __LINE__, __VA_ARGS__);} while (0)
+# define DEBUG(...) do {if (debug0_level >= DEBUG_LEVEL_DEBUG) debug0(__FILE__, __LINE__, __VA_ARGS__);} while (0)
 #elif defined (__GNUC__)
-# define DEBUG(format...) do {debug0(__FILE__, __LINE__, format);} while (0)
+# define DEBUG(format...) do {if (debug0_level >= DEBUG_LEVEL_DEBUG) debug0(__FILE__, __LINE__, format);} while (0)
 #endif
 
 #define DEBUG_DECL(decl) decl
@@ -21,4 +21,43 @@
 
 #endif
 
+/* verbose tracing, compiled in and off at runtime, it costs a load
+ * and a branch while off (define NO_DEBUG_INFO before including to
+ * compile it out)
+ */
+
+#if !defined(NO_DEBUG) && !defined(NO_DEBUG_INFO)
+
+#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+# define DEBUG_INFO(...) do {if (debug0_level >= DEBUG_LEVEL_INFO) debug0(__FILE__, __LINE__, __VA_ARGS__);} while (0)
+#elif defined (__GNUC__)
+# define DEBUG_INFO(format...) do {if (debug0_level >= DEBUG_LEVEL_INFO) debug0(__FILE__, __LINE__, format);} while (0)
+#endif
+
+#else
+
+#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
+# define DEBUG_INFO(...)	    //
+#elif defined (__GNUC__)
+# define DEBUG_INFO(format...)   //
+#endif
+
+#endif
+
+#define DEBUG_LEVEL_NONE 0
+#define DEBUG_LEVEL_DEBUG 1 /* DEBUG(), the default */
+#define DEBUG_LEVEL_INFO 2 /* DEBUG_INFO() as well */
+
+extern int debug0_level;
+
 void debug0(char *file, int line, char *format, ...) __attribute__ ((format (printf, 3, 4)));
+
+/* from now on lines are queued and written by a background thread
+ * (flushed at exit), 0 on success, -1 on error and errno is set
+ * appropriately
+ */
+int debug0_async_start();
+
+/* write what is queued, from any thread
+ */
+void debug0_flush();
@@ -4,9 +4,18 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include "alloc.h"
 #define RB_COMPACT // embed color bits in right-child pointers.
 #include "rb.h"
 
+/* freed items go to a per thread freelist (at most DICT_POOL_MAX),
+ * like item.h nodes
+ */
+#ifndef DICT_POOL_MAX
+#define DICT_POOL_MAX 4096
+#endif
+
 /* Root structure. */
 #define	rb_tree2(dict, a_type)			\
 	struct dict {				\
@@ -22,17 +31,40 @@
 	int item##_cmp(struct item *a, struct item *b);			\
 	rb_tree2(dict, struct item);					\
 	rb_gen(, dict##_, struct dict, struct item, _meta, item##_cmp);	\
+	static __thread struct item *_##item##_pool = NULL;		\
+	static __thread int _##item##_pool_len = 0;			\
 	struct item *item##_new0() {					\
 		struct item *r;						\
-		r = (struct item *)calloc(1, sizeof(struct item));	\
+		if ((r = _##item##_pool)) {				\
+			_##item##_pool = *(struct item **)r;		\
+			_##item##_pool_len--;				\
+			memset(r, 0, sizeof(struct item));		\
+		} else {						\
+			r = (struct item *)alloc_calloc(ALLOC_DICT, 1, sizeof(struct item)); \
+		}							\
 		return r;						\
 	}								\
 	void item##_free0(struct item *x) {				\
-		if (x) free(x);						\
+		if (x == NULL) return;					\
+		if (_##item##_pool_len < DICT_POOL_MAX) {		\
+			*(struct item **)x = _##item##_pool; /* over _meta */ \
+			_##item##_pool = x;				\
+			_##item##_pool_len++;				\
+		} else {						\
+			alloc_free(ALLOC_DICT, x);			\
+		}							\
+	}								\
+	void item##_pool_trim() {					\
+		while (_##item##_pool) {				\
+			struct item *t = *(struct item **)_##item##_pool; \
+			alloc_free(ALLOC_DICT, _##item##_pool);		\
+			_##item##_pool = t;				\
+		}							\
+		_##item##_pool_len = 0;					\
 	}								\
 	struct dict *dict##_new0() {					\
 		struct dict *r;						\
-		r = (struct dict *)calloc(1, sizeof(struct dict));	\
+		r = (struct dict *)alloc_calloc(ALLOC_DICT, 1, sizeof(struct dict)); \
 		dict##_new(r);						\
 		return r;						\
 	}								\
@@ -44,7 +76,7 @@
 				dict##_remove(x, c);			\
 				item##_free0(c);			\
 			}						\
-			free(x);					\
+			alloc_free(ALLOC_DICT, x);			\
 		}							\
 	}
 
@@ -0,0 +1,400 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * bounded parallel execution of children, see executor.h
+ *
+ * every round rebuilds one pollfd array with the stdout, stderr (and
+ * stdin, if there is something to produce) of all running children
+ * plus the child tracker fd, so a child gone is noticed at once, its
+ * pipes are drained and it is reaped before the next queued one starts
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "debug0.h"
+#include "item.h"
+#include "executor.h"
+#include "timer.h"
+
+#define EXECUTOR_BUFSZ 0x10000
+#define EXECUTOR_DEFAULT_TIMEOUT 5000 /* same as subprocess_run */
+#define EXECUTOR_KILL_MSEC 5000 /* SIGKILL again until it is gone */
+
+DEFINE_ITEM(job,
+	    struct subprocess *sp;
+	    struct subprocess_callbacks *cb;
+	    void (*done)(struct subprocess *sp, void *arg);
+	    void *arg;
+	    long long consumed; /* last output, or start (timer_now_msec) */
+	    long long produced; /* last time stdin was writable */
+	    long long killed; /* zero if not killed */
+  );
+
+DEFINE_FIFO(job_queue, job);
+
+struct executor {
+	int max_running;
+	struct job_queue *pending;
+	struct job **running;
+	int nrunning;
+	struct pollfd *pfds; /* 3 per running child, plus the tracker */
+	char *buf; /* borrowed by the consume callbacks */
+};
+
+struct executor *executor_new(int max_running)
+{
+	struct executor *x;
+
+	assert(max_running > 0);
+
+	if (!(x = calloc(1, sizeof(struct executor)))) {
+		return NULL;
+	}
+	x->max_running = max_running;
+	x->pending = job_queue_new0();
+	x->running = calloc(max_running, sizeof(struct job *));
+	x->pfds = calloc(max_running * 3 + 1, sizeof(struct pollfd));
+	x->buf = malloc(EXECUTOR_BUFSZ);
+	if (!x->pending || !x->running || !x->pfds || !x->buf) {
+		executor_free(x);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	return x;
+}
+
+void executor_free(struct executor *x)
+{
+	int i;
+
+	if (!x) {
+		return;
+	}
+
+	for (i = 0; i < x->nrunning; i++) {
+		struct subprocess *sp = x->running[i]->sp;
+		if (!sp->is_gone) {
+			kill(sp->pid, SIGKILL);
+		}
+		assert(subprocess_terminate(sp) == 0);
+		job_free0(x->running[i]);
+	}
+
+	job_queue_free0(x->pending);
+	free(x->running);
+	free(x->pfds);
+	free(x->buf);
+	free(x);
+}
+
+int executor_len(struct executor *x)
+{
+	return x->nrunning + job_queue_len(x->pending);
+}
+
+int executor_submit(struct executor *x, struct subprocess *sp, struct subprocess_callbacks *cb,
+		    void (*done)(struct subprocess *sp, void *arg), void *arg)
+{
+	struct job *j;
+
+	assert(sp->argv && sp->argv[0]);
+	assert(cb);
+
+	if (!(j = job_new0(NULL))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	j->sp = sp;
+	j->cb = cb;
+	j->done = done;
+	j->arg = arg;
+	job_queue_enqueue(x->pending, j);
+
+	return 0;
+}
+
+static void job_done(struct executor *x, int i)
+{
+	struct job *j = x->running[i];
+
+	x->running[i] = x->running[--x->nrunning];
+	x->running[x->nrunning] = NULL;
+
+	if (j->done) {
+		j->done(j->sp, j->arg);
+	}
+	job_free0(j);
+}
+
+static void executor_start(struct executor *x)
+{
+	while (x->nrunning < x->max_running && job_queue_len(x->pending)) {
+		struct job *j = job_queue_dequeue(x->pending);
+		if (subprocess_spawn(j->sp)) {
+			DEBUG("executor: spawn(%s), errno=%i", j->sp->argv[0], errno);
+			j->sp->pid = 0;
+			x->running[x->nrunning++] = j;
+			job_done(x, x->nrunning - 1);
+			continue;
+		}
+		DEBUG_INFO("executor: started pid %i, %i running", j->sp->pid, x->nrunning + 1);
+		j->consumed = j->produced = timer_now_msec();
+		x->running[x->nrunning++] = j;
+	}
+}
+
+/* returns the bytes consumed, 0 on EOF (fd gets closed), -1 if there
+ * is nothing to read now
+ */
+static int job_consume(struct executor *x, struct job *j, int fd,
+		       void (*consume)(struct subprocess *sp, void *data, int sz))
+{
+	int n;
+
+	do {
+		n = read(fd, x->buf, EXECUTOR_BUFSZ - 1);
+	} while (n == -1 && errno == EINTR);
+
+	if (n < 0) {
+		if (errno == EAGAIN) {
+			return -1;
+		}
+		DEBUG("executor: read(pid=%i), errno=%i", j->sp->pid, errno);
+		n = 0; /* as EOF */
+	}
+
+	if (n == 0) {
+		if (fd == j->sp->child_fdout) {
+			subprocess_close_child_fdout(j->sp);
+		} else {
+			subprocess_close_child_fderr(j->sp);
+		}
+		return 0;
+	}
+
+	x->buf[n] = 0; /* as subprocess_run does */
+	j->consumed = timer_now_msec();
+	if (consume) {
+		consume(j->sp, x->buf, n);
+	}
+
+	return n;
+}
+
+static void job_kill(struct job *j, int rc, long long now)
+{
+	int sig = rc == SIGTERM || rc == SIGKILL ? rc : SIGTERM;
+	DEBUG_INFO("executor: send signal %i to pid %i", sig, j->sp->pid);
+	kill(j->sp->pid, sig);
+	j->killed = now;
+}
+
+/* consume and produce timeouts, returns msec to the next one (or
+ * msec itself)
+ */
+static int job_timeouts(struct job *j, long long now, int msec)
+{
+	struct subprocess *sp = j->sp;
+	struct subprocess_callbacks *cb = j->cb;
+	int ctimeout = cb->ctimeout ? cb->ctimeout : EXECUTOR_DEFAULT_TIMEOUT;
+	int ptimeout = cb->ptimeout ? cb->ptimeout : EXECUTOR_DEFAULT_TIMEOUT;
+	long d;
+
+	if (sp->is_gone) {
+		return msec;
+	}
+
+	if (j->killed) {
+		/* it got a signal, it must go
+		 */
+		if ((d = EXECUTOR_KILL_MSEC - (now - j->killed)) <= 0) {
+			job_kill(j, SIGKILL, now);
+			d = EXECUTOR_KILL_MSEC;
+		}
+		return msec < 0 || d < msec ? d : msec;
+	}
+
+	if (cb->consume_timeout) {
+		if ((d = ctimeout - (now - j->consumed)) <= 0) {
+			int rc;
+			j->consumed = now;
+			if ((rc = cb->consume_timeout(sp, sp->child_fdin, 0))) {
+				job_kill(j, rc, now);
+				return job_timeouts(j, now, msec);
+			}
+			d = ctimeout;
+		}
+		if (msec < 0 || d < msec) msec = d;
+	}
+
+	if (cb->produce_timeout && cb->produce_stdin && sp->child_fdin != -1) {
+		if ((d = ptimeout - (now - j->produced)) <= 0) {
+			int rc;
+			j->produced = now;
+			if ((rc = cb->produce_timeout(sp))) {
+				job_kill(j, rc, now);
+				return job_timeouts(j, now, msec);
+			}
+			d = ptimeout;
+		}
+		if (msec < 0 || d < msec) msec = d;
+	}
+
+	return msec;
+}
+
+int executor_run(struct executor *x, int msec)
+{
+	long long now;
+	int i, n, r;
+
+	executor_start(x);
+
+	if (x->nrunning == 0) {
+		return executor_len(x);
+	}
+
+	now = timer_now_msec();
+	for (i = 0; i < x->nrunning; i++) {
+		msec = job_timeouts(x->running[i], now, msec);
+	}
+
+	/* 3 slots per child, so the child is i / 3, unused slots get
+	 * fd -1 (ignored by poll)
+	 */
+	for (i = 0; i < x->nrunning; i++) {
+		struct job *j = x->running[i];
+		struct pollfd *p = x->pfds + i * 3;
+		p[0].fd = j->sp->child_fdout;
+		p[0].events = POLLIN;
+		p[1].fd = j->sp->child_fderr;
+		p[1].events = POLLIN;
+		p[2].fd = j->cb->produce_stdin ? j->sp->child_fdin : -1;
+		p[2].events = POLLOUT;
+	}
+	n = x->nrunning * 3;
+	x->pfds[n].fd = subprocess_get_selfpipe_read_fd();
+	x->pfds[n].events = POLLIN;
+
+	if ((r = poll(x->pfds, n + 1, msec)) < 0) {
+		if (errno != EINTR) {
+			perror("poll()");
+			exit(1);
+		}
+		return executor_len(x);
+	}
+
+	if (r && x->pfds[n].revents) {
+		assert(subprocess_read_selfpipe() == 0);
+	}
+
+	for (i = 0; r && i < n; i++) {
+		struct job *j = x->running[i / 3];
+		struct pollfd *p = x->pfds + i;
+
+		if (p->fd == -1 || p->revents == 0) {
+			continue;
+		}
+
+		switch (i % 3) {
+		case 0:
+			job_consume(x, j, p->fd, j->cb->consume_stdout);
+			break;
+		case 1:
+			job_consume(x, j, p->fd, j->cb->consume_stderr);
+			break;
+		case 2:
+			if (p->revents & (POLLERR | POLLHUP)) {
+				/* nobody reads it anymore
+				 */
+				subprocess_close_child_fdin(j->sp);
+				break;
+			}
+			j->produced = timer_now_msec();
+			j->cb->produce_stdin(j->sp, p->fd);
+			break;
+		}
+	}
+
+	/* the ones gone, what is left in the pipes is theirs, pipes
+	 * held by grandchildren are not waited for
+	 */
+
+	for (i = x->nrunning - 1; i >= 0; i--) {
+		struct job *j = x->running[i];
+		if (!j->sp->is_gone) {
+			continue;
+		}
+		while (j->sp->child_fdout != -1 && job_consume(x, j, j->sp->child_fdout, j->cb->consume_stdout) > 0)
+			;
+		while (j->sp->child_fderr != -1 && job_consume(x, j, j->sp->child_fderr, j->cb->consume_stderr) > 0)
+			;
+		assert(subprocess_terminate(j->sp) == 0);
+		DEBUG_INFO("executor: pid %i done, exit status %i", j->sp->pid, j->sp->exit_status);
+		job_done(x, i);
+	}
+
+	executor_start(x);
+
+	return executor_len(x);
+}
+
+int executor_fd_set(struct executor *x, fd_set *rfds, fd_set *wfds, int max_fd)
+{
+	int i;
+
+	for (i = 0; i < x->nrunning; i++) {
+		struct job *j = x->running[i];
+		if (j->sp->child_fdout != -1) {
+			FD_SET(j->sp->child_fdout, rfds);
+			if (j->sp->child_fdout > max_fd) max_fd = j->sp->child_fdout;
+		}
+		if (j->sp->child_fderr != -1) {
+			FD_SET(j->sp->child_fderr, rfds);
+			if (j->sp->child_fderr > max_fd) max_fd = j->sp->child_fderr;
+		}
+		if (j->cb->produce_stdin && j->sp->child_fdin != -1) {
+			FD_SET(j->sp->child_fdin, wfds);
+			if (j->sp->child_fdin > max_fd) max_fd = j->sp->child_fdin;
+		}
+	}
+
+	return max_fd;
+}
+
+void executor_wait(struct executor *x)
+{
+	while (executor_run(x, -1))
+		;
+}
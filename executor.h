@@ -0,0 +1,55 @@
+#ifndef nq3hx8w5d0tk7vbc2e /* executor-h */
+#define nq3hx8w5d0tk7vbc2e /* executor-h */
+
+#include <sys/select.h>
+
+#include "subprocess.h"
+
+/* runs up to max_running children at once, the others wait in a
+ * queue, all of them are supervised from a single poll set
+ *
+ * the consume callbacks get a buffer that is borrowed, it is shared
+ * by all children and only valid during the call (no copies, copy it
+ * if you need it later), produce_stdin is called when the child stdin
+ * is writable, close it (subprocess_close_child_fdin) when done
+ *
+ * consume_timeout/produce_timeout work as in subprocess_run, but the
+ * fdin_ready argument is always 0, produce_immediately is ignored
+ */
+
+struct executor;
+
+struct executor *executor_new(int max_running);
+
+/* children still running are killed and reaped
+ */
+void executor_free(struct executor *x);
+
+/* sp->argv must be set (sp and cb must live until done is called),
+ * done gets the exit status filled (sp->pid is 0 if it could not be
+ * spawned), 0 on success, -1 on error and errno is set appropriately
+ */
+int executor_submit(struct executor *x, struct subprocess *sp, struct subprocess_callbacks *cb,
+		    void (*done)(struct subprocess *sp, void *arg), void *arg);
+
+/* one round, waits at most msec (-1 forever), returns children running
+ * plus queued
+ */
+int executor_run(struct executor *x, int msec);
+
+/* for a caller with its own select loop: adds the fds the next round
+ * waits on (pipes of the running children, not the child tracker) and
+ * returns the new max_fd, call executor_run(x, 0) once select returns,
+ * nothing is started before that
+ */
+int executor_fd_set(struct executor *x, fd_set *rfds, fd_set *wfds, int max_fd);
+
+/* until every child is done
+ */
+void executor_wait(struct executor *x);
+
+/* children running plus queued
+ */
+int executor_len(struct executor *x);
+
+#endif /* !nq3hx8w5d0tk7vbc2e executor-h */
@@ -0,0 +1,124 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * decode a flight recorder dump (see recorder.h), oldest event first
+ *
+ * usage example:
+ *
+
+kill -USR2 "`pgrep -x aimant`"
+./flightdump aimant.flight | tail -50
+
+ *
+ * columns are wall clock time, microseconds since the previous event,
+ * event type and its fields
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include "recorder.h"
+
+static struct fr_event ring[FR_SIZE];
+
+int main(int argc, char **argv)
+{
+	struct fr_header h[1];
+	FILE *fp;
+	unsigned long long i, first, n;
+	double ns_per_tick = 1;
+	long long prev_ns = 0;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s dump-file\n", argv[0]);
+		return 1;
+	}
+
+	if ((fp = fopen(argv[1], "rb")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (fread(h, sizeof(h), 1, fp) != 1 || memcmp(h->magic, FR_MAGIC, sizeof(h->magic))) {
+		fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+		return 1;
+	}
+	if (h->size != FR_SIZE || h->event_size != sizeof(struct fr_event)) {
+		fprintf(stderr, "%s: ring of %u events of %u bytes, expected %u of %u\n", argv[1],
+			h->size, h->event_size, FR_SIZE, (unsigned)sizeof(struct fr_event));
+		return 1;
+	}
+	if (fread(ring, sizeof(ring), 1, fp) != 1) {
+		fprintf(stderr, "%s: truncated\n", argv[1]);
+		return 1;
+	}
+	fclose(fp);
+
+	if (h->tsc && h->ts1 > h->ts0 && h->ns1 > h->ns0) {
+		ns_per_tick = (double)(h->ns1 - h->ns0) / (h->ts1 - h->ts0);
+	}
+
+	printf("# pid %i, signal %i, %llu events recorded, %s timestamps (%.4f ns each)\n",
+	       h->pid, h->signo, h->pos, h->tsc ? "tsc" : "monotonic", ns_per_tick);
+
+	n = h->pos < FR_SIZE ? h->pos : FR_SIZE;
+	first = h->pos - n;
+
+	for (i = first; i < h->pos; i++) {
+		struct fr_event *e = ring + (i & (FR_SIZE - 1));
+		const char *name = fr_type_name(e->type), *a, *b;
+		long long ns, wall;
+		time_t sec;
+		struct tm tm[1];
+		char when[32];
+
+		/* events before the dump, relative to it, so ticks counted
+		 * before fr_init() come out right as well
+		 */
+		ns = (long long)h->ns1 - (long long)(((double)(long long)(h->ts1 - e->ts)) * ns_per_tick);
+		wall = h->realtime_ns1 - ((long long)h->ns1 - ns);
+		sec = wall / 1000000000LL;
+		localtime_r(&sec, tm);
+		strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", tm);
+
+		printf("%s.%06lli %+10.3f ", when, (wall % 1000000000LL) / 1000, i == first ? 0.0 : (ns - prev_ns) / 1000.0);
+		prev_ns = ns;
+
+		if (name == NULL) {
+			printf("type=%u a=%i b=%lli\n", e->type, e->a, e->b);
+			continue;
+		}
+		printf("%s", name);
+		if ((a = fr_type_a(e->type))) printf(" %s=%i", a, e->a);
+		if ((b = fr_type_b(e->type))) printf(" %s=%lli", b, e->b);
+		printf("\n");
+	}
+
+	return 0;
+}
@@ -0,0 +1,229 @@
+#ifndef nb6xw2kq9tr0mvh4ju /* hash-h */
+#define nb6xw2kq9tr0mvh4ju /* hash-h */
+
+#include <string.h>
+
+#include "alloc.h"
+
+#ifdef __cplusplus
+extern "C" { /* assume C declarations for C++ */
+#endif
+
+/* hash map, open addressing with Robin Hood probing, keys and values
+ * live inline in the slot array (one cache line usually holds the
+ * whole probe), alongside DEFINE_DICT when order is not needed
+ *
+ * growing is incremental: the old table is kept and every put/del
+ * moves HASH_MIGRATE_STEP of its slots, so no single operation pays
+ * for rehashing everything, lookups check both tables meanwhile
+ *
+ * hash_fn(key) returns unsigned int, eq_fn(a, b) is true for equal
+ * keys, value pointers are valid until the next put or del
+ */
+
+#define HASH_MOVED 0x80000000u /* old table only: migrated or deleted */
+#define HASH_MIN_SIZE 16
+#define HASH_MIGRATE_STEP 16
+
+static inline unsigned int hash_u64(unsigned long long x)
+{
+	/* reference: splitmix64 finalizer
+	 */
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (unsigned int)x;
+}
+
+static inline unsigned int hash_bytes(const void *p, int n)
+{
+	/* reference: FNV-1a
+	 */
+	const unsigned char *s = (const unsigned char *)p;
+	unsigned int h = 2166136261u;
+	while (n--) {
+		h ^= *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+#define DEFINE_HASH_HEADER(name, key_type, value_type)			\
+	struct name##_slot {						\
+		unsigned int dist; /* 0 if empty, probe distance + 1 */ \
+		unsigned int hash;					\
+		key_type key;						\
+		value_type value;					\
+	};								\
+	struct name##_table {						\
+		struct name##_slot *slots;				\
+		unsigned int mask;					\
+		int len;						\
+	};								\
+	struct name {							\
+		struct name##_table cur[1];				\
+		struct name##_table old[1]; /* migrating, or no slots */ \
+		unsigned int migrated; /* old slots done */		\
+	};								\
+	struct name *name##_new0();					\
+	void name##_free0(struct name *x);				\
+	int name##_len(struct name *x);					\
+	value_type *name##_get(struct name *x, key_type key);		\
+	value_type *name##_put(struct name *x, key_type key, int *created); \
+	int name##_del(struct name *x, key_type key);			\
+	struct name##_slot *name##_iter(struct name *x, unsigned int *i)
+
+#define DEFINE_HASH_IMPLEMENTATION(name, key_type, value_type, hash_fn, eq_fn) \
+	static struct name##_slot *_##name##_find(struct name##_table *t, key_type key, unsigned int h) { \
+		unsigned int i, d;					\
+		if (t->slots == NULL) return NULL;			\
+		for (i = h & t->mask, d = 1;; i = (i + 1) & t->mask, d++) { \
+			struct name##_slot *s = t->slots + i;		\
+			unsigned int sd = s->dist & ~HASH_MOVED;	\
+			if (sd == 0 || sd < d) return NULL;		\
+			if (!(s->dist & HASH_MOVED) && s->hash == h && eq_fn(s->key, key)) return s; \
+		}							\
+	}								\
+	static struct name##_slot *_##name##_insert(struct name##_table *t, struct name##_slot *in) { \
+		struct name##_slot e = *in, tmp, *r = NULL;		\
+		unsigned int i;						\
+		e.dist = 1;						\
+		for (i = e.hash & t->mask;; i = (i + 1) & t->mask) {	\
+			struct name##_slot *s = t->slots + i;		\
+			if (s->dist == 0) {				\
+				*s = e;					\
+				t->len++;				\
+				return r ? r : s;			\
+			}						\
+			if (s->dist < e.dist) {				\
+				tmp = *s;				\
+				*s = e;					\
+				e = tmp;				\
+				if (r == NULL) r = s;			\
+			}						\
+			e.dist++;					\
+		}							\
+	}								\
+	static void _##name##_erase(struct name##_table *t, struct name##_slot *s) { \
+		unsigned int i = s - t->slots, j;			\
+		for (;;) {						\
+			j = (i + 1) & t->mask;				\
+			if (t->slots[j].dist <= 1) break;		\
+			t->slots[i] = t->slots[j];			\
+			t->slots[i].dist--;				\
+			i = j;						\
+		}							\
+		t->slots[i].dist = 0;					\
+		t->len--;						\
+	}								\
+	static void _##name##_migrate(struct name *x, unsigned int steps) { \
+		while (x->old->slots && steps--) {			\
+			struct name##_slot *s = x->old->slots + x->migrated; \
+			if (s->dist && !(s->dist & HASH_MOVED)) {	\
+				_##name##_insert(x->cur, s);		\
+				s->dist |= HASH_MOVED;			\
+				x->old->len--;				\
+			}						\
+			if (++x->migrated > x->old->mask) {		\
+				alloc_free(ALLOC_HASH, x->old->slots);	\
+				memset(x->old, 0, sizeof(x->old));	\
+				x->migrated = 0;			\
+			}						\
+		}							\
+	}								\
+	static void _##name##_grow(struct name *x) {			\
+		unsigned int size = x->cur->slots ? (x->cur->mask + 1) * 2 : HASH_MIN_SIZE; \
+		_##name##_migrate(x, ~0u); /* settle a previous one */	\
+		if (x->cur->len) {					\
+			*x->old = *x->cur;				\
+			x->migrated = 0;				\
+		} else if (x->cur->slots) {				\
+			alloc_free(ALLOC_HASH, x->cur->slots);		\
+		}							\
+		x->cur->slots = (struct name##_slot *)alloc_calloc(ALLOC_HASH, size, sizeof(struct name##_slot)); \
+		x->cur->mask = size - 1;				\
+		x->cur->len = 0;					\
+	}								\
+	struct name *name##_new0() {					\
+		return (struct name *)alloc_calloc(ALLOC_HASH, 1, sizeof(struct name)); \
+	}								\
+	void name##_free0(struct name *x) {				\
+		if (x) {						\
+			alloc_free(ALLOC_HASH, x->cur->slots);		\
+			alloc_free(ALLOC_HASH, x->old->slots);		\
+			alloc_free(ALLOC_HASH, x);			\
+		}							\
+	}								\
+	int name##_len(struct name *x) {				\
+		return x ? x->cur->len + x->old->len : 0;		\
+	}								\
+	value_type *name##_get(struct name *x, key_type key) {	\
+		unsigned int h = hash_fn(key);				\
+		struct name##_slot *s;					\
+		if ((s = _##name##_find(x->cur, key, h))) return &s->value; \
+		if ((s = _##name##_find(x->old, key, h))) return &s->value; \
+		return NULL;						\
+	}								\
+	value_type *name##_put(struct name *x, key_type key, int *created) { \
+		unsigned int h = hash_fn(key);				\
+		struct name##_slot e, *s;				\
+		_##name##_migrate(x, HASH_MIGRATE_STEP);		\
+		if ((s = _##name##_find(x->cur, key, h))) {		\
+			if (created) *created = 0;			\
+			return &s->value;				\
+		}							\
+		if (x->cur->slots == NULL || (x->cur->len + 1) * 5 > (x->cur->mask + 1) * 4) { \
+			_##name##_grow(x);				\
+		}							\
+		memset(&e, 0, sizeof(e));				\
+		e.hash = h;						\
+		e.key = key;						\
+		if ((s = _##name##_find(x->old, key, h))) {		\
+			e.value = s->value;				\
+			s->dist |= HASH_MOVED;				\
+			x->old->len--;					\
+			if (created) *created = 0;			\
+		} else if (created) {					\
+			*created = 1;					\
+		}							\
+		return &_##name##_insert(x->cur, &e)->value;		\
+	}								\
+	int name##_del(struct name *x, key_type key) {		\
+		unsigned int h = hash_fn(key);				\
+		struct name##_slot *s;					\
+		_##name##_migrate(x, HASH_MIGRATE_STEP);		\
+		if ((s = _##name##_find(x->cur, key, h))) {		\
+			_##name##_erase(x->cur, s);			\
+			return 0;					\
+		}							\
+		if ((s = _##name##_find(x->old, key, h))) {		\
+			s->dist |= HASH_MOVED;				\
+			x->old->len--;					\
+			return 0;					\
+		}							\
+		return -1;						\
+	}								\
+	struct name##_slot *name##_iter(struct name *x, unsigned int *i) { \
+		_##name##_migrate(x, ~0u);				\
+		if (x->cur->slots == NULL) return NULL;			\
+		while (*i <= x->cur->mask) {				\
+			struct name##_slot *s = x->cur->slots + (*i)++;	\
+			if (s->dist) return s;				\
+		}							\
+		return NULL;						\
+	}
+
+/* iterate with "unsigned int i = 0; while ((s = name##_iter(x, &i)))",
+ * no put or del meanwhile
+ */
+#define DEFINE_HASH(name, key_type, value_type, hash_fn, eq_fn)	\
+	DEFINE_HASH_HEADER(name, key_type, value_type);		\
+	DEFINE_HASH_IMPLEMENTATION(name, key_type, value_type, hash_fn, eq_fn)
+
+#ifdef __cplusplus
+}; /* end of function prototypes */
+#endif
+
+#endif /* !nb6xw2kq9tr0mvh4ju hash-h */
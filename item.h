@@ -1,13 +1,26 @@
 #ifndef npnta96oo91bqikdb8 /* item-h */
 #define npnta96oo91bqikdb8 /* item-h */
 
+#include <string.h>
+
+#include "alloc.h"
+
 #ifdef __cplusplus
 extern "C" { /* assume C declarations for C++ */
 #endif
 
 /* item
+ *
+ * freed nodes go to a per thread freelist of their type (at most
+ * ITEM_POOL_MAX of them), new nodes come from it first, so a steady
+ * flow of nodes does not reach the allocator, name##_pool_trim()
+ * gives them back
  */
 
+#ifndef ITEM_POOL_MAX
+#define ITEM_POOL_MAX 4096
+#endif
+
 #define DEFINE_ITEM_HEADER(name, st_members)				\
 	struct name {							\
 		int _position;						\
@@ -25,6 +38,8 @@ extern "C" { /* assume C declarations for C++ */
 	struct name *name##_tail0(struct name *x, struct name *tail);	\
 	struct name *name##_new0(struct name *tail);	\
 	void name##_free0(struct name *x);			\
+	void name##_recycle(struct name *x);				\
+	void name##_pool_trim();					\
 	struct name **name##_as_array(struct name *x);	\
 	int name##_len(struct name *x);				\
 	void name##_backward(struct name##_iterator *i, struct name *x); \
@@ -40,23 +55,48 @@ extern "C" { /* assume C declarations for C++ */
 		x->tail = tail;						\
 		return x;						\
 	}								\
+	static __thread struct name *_##name##_pool = NULL;		\
+	static __thread int _##name##_pool_len = 0;			\
 	struct name *name##_new0(struct name *tail) {	\
 		struct name *r;					\
-		r = (struct name*)calloc(1, sizeof(struct name)); \
+		if ((r = _##name##_pool)) {				\
+			_##name##_pool = r->tail;			\
+			_##name##_pool_len--;				\
+			memset(r, 0, sizeof(struct name));		\
+		} else {						\
+			r = (struct name*)alloc_calloc(ALLOC_ITEM, 1, sizeof(struct name)); \
+		}							\
 		r = name##_tail0(r, tail);				\
 		return r;						\
 	}								\
+	void name##_recycle(struct name *x) {				\
+		if (_##name##_pool_len < ITEM_POOL_MAX) {		\
+			x->tail = _##name##_pool;			\
+			_##name##_pool = x;				\
+			_##name##_pool_len++;				\
+		} else {						\
+			alloc_free(ALLOC_ITEM, x);			\
+		}							\
+	}								\
+	void name##_pool_trim() {					\
+		while (_##name##_pool) {				\
+			struct name *t = _##name##_pool->tail;		\
+			alloc_free(ALLOC_ITEM, _##name##_pool);		\
+			_##name##_pool = t;				\
+		}							\
+		_##name##_pool_len = 0;					\
+	}								\
 	void name##_free0(struct name *x) {			\
 		while (x) {						\
 			struct name *t = x->tail;			\
-			free(x);					\
+			name##_recycle(x);				\
 			x = t;						\
 		}							\
 	}								\
 	struct name **name##_as_array(struct name *x) {	\
 		struct name *t, **r;				\
 		if (!x) return NULL;					\
-		r = (struct name**)calloc(x->_position + 1, sizeof(struct name*)); \
+		r = (struct name**)alloc_calloc(ALLOC_ITEM, x->_position + 1, sizeof(struct name*)); \
 		for (t=x; t; t=t->tail) {				\
 			r[t->_position] = t;				\
 		}							\
@@ -92,7 +132,7 @@ extern "C" { /* assume C declarations for C++ */
 		i->next = NULL;						\
 		i->end = NULL;						\
 		i->v1 = NULL;						\
-		free(i->v0);						\
+		alloc_free(ALLOC_ITEM, i->v0);				\
 		i->v0 = NULL;						\
 	}								\
 	static inline struct name *_##name##_next_f(struct name##_iterator *i) {	\
@@ -122,21 +162,20 @@ extern "C" { /* assume C declarations for C++ */
 			((name##_end_func*)i->end)(i);			\
 		}							\
 	}								\
-	static inline struct name *name##_reverse0(struct name *parent, struct name *h, int pos) { \
-		if (h->tail) {						\
-			struct name *r;				\
-			r = name##_reverse0(h, h->tail, pos + 1);	\
-			h->_position = pos;				\
-			h->tail = parent;				\
-			return r;					\
-		}							\
-		h->_position = pos;					\
-		h->tail = parent;					\
-		return h;						\
-	}								\
 	struct name *name##_reverse(struct name *h) {	\
-		if (!h) return NULL;					\
-		return name##_reverse0(NULL, h, 0);			\
+		struct name *r = NULL;				\
+		int pos = -1;						\
+		while (h) {						\
+			struct name *t = h->tail;			\
+			h->tail = r;					\
+			r = h;						\
+			h = t;						\
+			pos++;						\
+		}							\
+		for (h = r; h; h = h->tail) {				\
+			h->_position = pos--;				\
+		}							\
+		return r;						\
 	}								\
 	struct name *name##_foreach(struct name *x[2]) {	\
 		if (x[1]) {						\
@@ -166,13 +205,13 @@ extern "C" { /* assume C declarations for C++ */
 
 #define DEFINE_QUEUE_IMPLEMENTATION(name, item)				\
 	struct name *name##_new0() {				\
-		return (struct name*)calloc(1, sizeof(struct name)); \
+		return (struct name*)alloc_calloc(ALLOC_ITEM, 1, sizeof(struct name)); \
 	}								\
 	void name##_free0(struct name *x) {			\
 		if (x) {						\
 			item##_free0(x->enqueue);			\
 			item##_free0(x->dequeue);			\
-			free(x);					\
+			alloc_free(ALLOC_ITEM, x);			\
 		}							\
 	}								\
 	int name##_len(struct name *x) {				\
@@ -200,6 +239,284 @@ extern "C" { /* assume C declarations for C++ */
 	DEFINE_QUEUE_HEADER(name, item);	\
 	DEFINE_QUEUE_IMPLEMENTATION(name, item)
 
+/* fifo, intrusive: items are linked through their own "tail" member
+ * (read it as "next" here), O(1) enqueue, dequeue, requeue and len
+ */
+
+#define DEFINE_FIFO_HEADER(name, item)					\
+	struct name {							\
+		struct item *head; /* dequeue side */			\
+		struct item *last; /* enqueue side */			\
+		int len;						\
+	};								\
+	struct name *name##_new0();					\
+	void name##_free0(struct name *x);				\
+	int name##_len(struct name *x);				\
+	void name##_enqueue(struct name *q, struct item *x);		\
+	void name##_requeue(struct name *q, struct item *x);		\
+	struct item *name##_dequeue(struct name *q);			\
+	struct item *name##_first(struct name *q)
+
+#define DEFINE_FIFO_IMPLEMENTATION(name, item)				\
+	struct name *name##_new0() {					\
+		return (struct name*)alloc_calloc(ALLOC_ITEM, 1, sizeof(struct name)); \
+	}								\
+	void name##_free0(struct name *x) {				\
+		if (x) {						\
+			item##_free0(x->head);				\
+			alloc_free(ALLOC_ITEM, x);			\
+		}							\
+	}								\
+	int name##_len(struct name *x) {				\
+		return x ? x->len : 0;					\
+	}								\
+	void name##_enqueue(struct name *q, struct item *x) {		\
+		x->tail = NULL;						\
+		if (q->last) {						\
+			q->last->tail = x;				\
+		} else {						\
+			q->head = x;					\
+		}							\
+		q->last = x;						\
+		q->len++;						\
+	}								\
+	void name##_requeue(struct name *q, struct item *x) {		\
+		x->tail = q->head;					\
+		q->head = x;						\
+		if (q->last == NULL) q->last = x;			\
+		q->len++;						\
+	}								\
+	struct item *name##_dequeue(struct name *q) {			\
+		struct item *r = q->head;				\
+		if (r) {						\
+			q->head = r->tail;				\
+			if (q->head == NULL) q->last = NULL;		\
+			r->tail = NULL;					\
+			q->len--;					\
+		}							\
+		return r;						\
+	}								\
+	struct item *name##_first(struct name *q) {			\
+		return q->head;						\
+	}
+
+#define DEFINE_FIFO(name, item)			\
+	DEFINE_FIFO_HEADER(name, item);		\
+	DEFINE_FIFO_IMPLEMENTATION(name, item)
+
+/* fifo, intrusive, one consumer and (any number of) producers, no
+ * locks (reference: Dmitry Vyukov's intrusive MPSC node-based queue),
+ * a stub item keeps the list never empty, len is the producers' count
+ * less the consumer's, approximate while both sides are running
+ */
+
+#define DEFINE_FIFO_MPSC_HEADER(name, item)				\
+	struct name {							\
+		struct item *head; /* consumer */			\
+		unsigned int dequeued;					\
+		char _pad0[64 - sizeof(struct item *) - sizeof(unsigned int)]; \
+		struct item *last; /* producers */			\
+		unsigned int enqueued;					\
+		char _pad1[64 - sizeof(struct item *) - sizeof(unsigned int)]; \
+		struct item stub;					\
+	};								\
+	struct name *name##_new0();					\
+	void name##_free0(struct name *x);				\
+	int name##_len(struct name *x);				\
+	void name##_enqueue(struct name *q, struct item *x);		\
+	struct item *name##_dequeue(struct name *q)
+
+#define DEFINE_FIFO_MPSC_IMPLEMENTATION(name, item)			\
+	struct name *name##_new0() {					\
+		struct name *r = (struct name*)alloc_calloc(ALLOC_ITEM, 1, sizeof(struct name)); \
+		if (r) {						\
+			r->head = &r->stub;				\
+			r->last = &r->stub;				\
+		}							\
+		return r;						\
+	}								\
+	static inline void _##name##_push(struct name *q, struct item *x) { \
+		struct item *prev;					\
+		__atomic_store_n(&x->tail, NULL, __ATOMIC_RELAXED);	\
+		prev = __atomic_exchange_n(&q->last, x, __ATOMIC_ACQ_REL); \
+		__atomic_store_n(&prev->tail, x, __ATOMIC_RELEASE);	\
+	}								\
+	void name##_enqueue(struct name *q, struct item *x) {		\
+		_##name##_push(q, x);					\
+		/* same line as last, already owned by this producer */ \
+		__atomic_add_fetch(&q->enqueued, 1, __ATOMIC_RELAXED);	\
+	}								\
+	struct item *name##_dequeue(struct name *q) {			\
+		struct item *head = q->head;				\
+		struct item *next = __atomic_load_n(&head->tail, __ATOMIC_ACQUIRE); \
+		if (head == &q->stub) {					\
+			if (next == NULL) return NULL;			\
+			q->head = next;					\
+			head = next;					\
+			next = __atomic_load_n(&next->tail, __ATOMIC_ACQUIRE); \
+		}							\
+		if (next == NULL) {					\
+			if (head != __atomic_load_n(&q->last, __ATOMIC_ACQUIRE)) { \
+				return NULL; /* a producer is halfway */ \
+			}						\
+			_##name##_push(q, &q->stub);			\
+			next = __atomic_load_n(&head->tail, __ATOMIC_ACQUIRE); \
+			if (next == NULL) return NULL;			\
+		}							\
+		q->head = next;						\
+		head->tail = NULL;					\
+		/* only the consumer writes it, no read-modify-write */	\
+		__atomic_store_n(&q->dequeued, q->dequeued + 1, __ATOMIC_RELAXED); \
+		return head;						\
+	}								\
+	int name##_len(struct name *x) {				\
+		int n;							\
+		if (x == NULL) return 0;				\
+		n = (int)(__atomic_load_n(&x->enqueued, __ATOMIC_RELAXED) - \
+			  __atomic_load_n(&x->dequeued, __ATOMIC_RELAXED)); \
+		return n > 0 ? n : 0; /* pushed before counted */	\
+	}								\
+	void name##_free0(struct name *x) {				\
+		if (x) {						\
+			struct item *i;					\
+			while ((i = name##_dequeue(x))) {		\
+				item##_free0(i);			\
+			}						\
+			alloc_free(ALLOC_ITEM, x);			\
+		}							\
+	}
+
+#define DEFINE_FIFO_MPSC(name, item)			\
+	DEFINE_FIFO_MPSC_HEADER(name, item);		\
+	DEFINE_FIFO_MPSC_IMPLEMENTATION(name, item)
+
+/* ring, fixed capacity (a power of two), values are copied in and out,
+ * head and tail are free running counters (wrap is fine, unsigned)
+ */
+
+#define DEFINE_RING_HEADER(name, type)					\
+	struct name {							\
+		unsigned int mask;					\
+		unsigned int head; /* next to pop */			\
+		unsigned int tail; /* next to push */			\
+		type *v;						\
+	};								\
+	struct name *name##_new0(int capacity);			\
+	void name##_free0(struct name *x);				\
+	int name##_len(struct name *x);				\
+	int name##_push(struct name *x, type v);			\
+	int name##_pop(struct name *x, type *v)
+
+#define DEFINE_RING_IMPLEMENTATION(name, type)				\
+	struct name *name##_new0(int capacity) {			\
+		struct name *r;						\
+		if (capacity < 1 || (capacity & (capacity - 1))) return NULL; \
+		r = (struct name*)alloc_calloc(ALLOC_ITEM, 1, sizeof(struct name)); \
+		if (r == NULL) return NULL;				\
+		r->v = (type*)alloc_calloc(ALLOC_ITEM, capacity, sizeof(type)); \
+		if (r->v == NULL) {					\
+			alloc_free(ALLOC_ITEM, r);			\
+			return NULL;					\
+		}							\
+		r->mask = capacity - 1;					\
+		return r;						\
+	}								\
+	void name##_free0(struct name *x) {				\
+		if (x) {						\
+			alloc_free(ALLOC_ITEM, x->v);			\
+			alloc_free(ALLOC_ITEM, x);			\
+		}							\
+	}								\
+	int name##_len(struct name *x) {				\
+		return x ? (int)(x->tail - x->head) : 0;		\
+	}								\
+	int name##_push(struct name *x, type v) {			\
+		if (x->tail - x->head > x->mask) return -1; /* full */ \
+		x->v[x->tail++ & x->mask] = v;				\
+		return 0;						\
+	}								\
+	int name##_pop(struct name *x, type *v) {			\
+		if (x->tail == x->head) return -1; /* empty */		\
+		*v = x->v[x->head++ & x->mask];				\
+		return 0;						\
+	}
+
+#define DEFINE_RING(name, type)			\
+	DEFINE_RING_HEADER(name, type);		\
+	DEFINE_RING_IMPLEMENTATION(name, type)
+
+/* ring, one producer thread and one consumer thread, no locks, each
+ * side caches the other's counter so the shared cache line is only
+ * touched when the cached view says full (or empty)
+ */
+
+#define DEFINE_RING_SPSC_HEADER(name, type)				\
+	struct name {							\
+		unsigned int mask;					\
+		type *v;						\
+		char _pad0[64 - sizeof(unsigned int) - sizeof(type *)]; \
+		unsigned int head; /* written by consumer */		\
+		unsigned int tail_cached;				\
+		char _pad1[64 - 2 * sizeof(unsigned int)];		\
+		unsigned int tail; /* written by producer */		\
+		unsigned int head_cached;				\
+		char _pad2[64 - 2 * sizeof(unsigned int)];		\
+	};								\
+	struct name *name##_new0(int capacity);			\
+	void name##_free0(struct name *x);				\
+	int name##_len(struct name *x);				\
+	int name##_push(struct name *x, type v);			\
+	int name##_pop(struct name *x, type *v)
+
+#define DEFINE_RING_SPSC_IMPLEMENTATION(name, type)			\
+	struct name *name##_new0(int capacity) {			\
+		struct name *r;						\
+		if (capacity < 1 || (capacity & (capacity - 1))) return NULL; \
+		r = (struct name*)alloc_calloc(ALLOC_ITEM, 1, sizeof(struct name)); \
+		if (r == NULL) return NULL;				\
+		r->v = (type*)alloc_calloc(ALLOC_ITEM, capacity, sizeof(type)); \
+		if (r->v == NULL) {					\
+			alloc_free(ALLOC_ITEM, r);			\
+			return NULL;					\
+		}							\
+		r->mask = capacity - 1;					\
+		return r;						\
+	}								\
+	void name##_free0(struct name *x) {				\
+		if (x) {						\
+			alloc_free(ALLOC_ITEM, x->v);			\
+			alloc_free(ALLOC_ITEM, x);			\
+		}							\
+	}								\
+	int name##_len(struct name *x) {				\
+		return x ? (int)(__atomic_load_n(&x->tail, __ATOMIC_ACQUIRE) - \
+				 __atomic_load_n(&x->head, __ATOMIC_ACQUIRE)) : 0; \
+	}								\
+	int name##_push(struct name *x, type v) {			\
+		unsigned int tail = x->tail;				\
+		if (tail - x->head_cached > x->mask) {			\
+			x->head_cached = __atomic_load_n(&x->head, __ATOMIC_ACQUIRE); \
+			if (tail - x->head_cached > x->mask) return -1; /* full */ \
+		}							\
+		x->v[tail & x->mask] = v;				\
+		__atomic_store_n(&x->tail, tail + 1, __ATOMIC_RELEASE); \
+		return 0;						\
+	}								\
+	int name##_pop(struct name *x, type *v) {			\
+		unsigned int head = x->head;				\
+		if (head == x->tail_cached) {				\
+			x->tail_cached = __atomic_load_n(&x->tail, __ATOMIC_ACQUIRE); \
+			if (head == x->tail_cached) return -1; /* empty */ \
+		}							\
+		*v = x->v[head & x->mask];				\
+		__atomic_store_n(&x->head, head + 1, __ATOMIC_RELEASE); \
+		return 0;						\
+	}
+
+#define DEFINE_RING_SPSC(name, type)			\
+	DEFINE_RING_SPSC_HEADER(name, type);		\
+	DEFINE_RING_SPSC_IMPLEMENTATION(name, type)
+
 #ifdef __cplusplus
 }; /* end of function prototypes */
 #endif
@@ -0,0 +1,359 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * nginx access log parse stage, see nginx.h
+ *
+ * a log_format is cut into literals and variables, a line matches when
+ * every literal is found where expected, a variable runs up to the
+ * next literal (the scan is strview_find, SSE2/AVX2), nginx escapes
+ * '"' in quoted variables so "$request" can't end early
+ *
+ * status, method and host values are interned: a hash lookup on the
+ * view into the line gives the counter, only a value seen for the
+ * first time is copied (once, to the arena) and named
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "debug0.h"
+#include "str.h"
+#include "stats.h"
+#include "hash.h"
+#include "alloc.h"
+
+#include "nginx.h"
+
+#define NGINX_ELEM_MAX 64
+#define NGINX_LINE_MAX 0x10000 /* 65536, a longer line is taken as is */
+#define NGINX_ARENA_BLOCK 0x4000 /* 16384 */
+
+enum nginx_var {
+	NGINX_LITERAL = -1,
+	NGINX_VAR_OTHER = 0, /* not looked at */
+	NGINX_VAR_STATUS,
+	NGINX_VAR_METHOD,
+	NGINX_VAR_REQUEST,
+	NGINX_VAR_HOST,
+	NGINX_VAR_BYTES,
+	NGINX_VAR_REQUEST_TIME,
+	NGINX_VARS
+};
+
+static struct {
+	const char *name;
+	int var;
+} nginx_var_names[] = {
+	{"status", NGINX_VAR_STATUS},
+	{"request_method", NGINX_VAR_METHOD},
+	{"request", NGINX_VAR_REQUEST},
+	{"host", NGINX_VAR_HOST},
+	{"server_name", NGINX_VAR_HOST},
+	{"http_host", NGINX_VAR_HOST},
+	{"body_bytes_sent", NGINX_VAR_BYTES},
+	{"bytes_sent", NGINX_VAR_BYTES},
+	{"request_time", NGINX_VAR_REQUEST_TIME},
+	{NULL, 0}
+};
+
+enum nginx_kind {
+	NGINX_STATUS = 0,
+	NGINX_METHOD,
+	NGINX_HOST,
+	NGINX_KINDS
+};
+
+static const char *nginx_kind_names[NGINX_KINDS] = {"status", "method", "host"};
+
+static const int nginx_buckets[] = {1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000}; /* msec */
+
+#define NGINX_BUCKETS ((int)(sizeof(nginx_buckets) / sizeof(nginx_buckets[0])))
+
+struct nginx_elem {
+	int var; /* NGINX_LITERAL for text */
+	struct strview text[1]; /* the literal */
+};
+
+struct nginx_key {
+	int kind;
+	struct strview v;
+};
+
+static unsigned int nginx_key_hash(struct nginx_key k)
+{
+	return hash_u64(((unsigned long long)k.kind << 32) | hash_bytes(k.v.s, k.v.len));
+}
+
+static int nginx_key_eq(struct nginx_key a, struct nginx_key b)
+{
+	return a.kind == b.kind && strview_equal(&a.v, &b.v);
+}
+
+DEFINE_HASH(nginx_keys, struct nginx_key, long long *, nginx_key_hash, nginx_key_eq);
+
+struct nginx {
+	struct str format[1]; /* literals are views into it */
+	struct nginx_elem elems[NGINX_ELEM_MAX];
+	int n;
+	struct nginx_keys *keys;
+	struct str_arena *arena; /* interned values */
+	int nkeys[NGINX_KINDS];
+	long long *other[NGINX_KINDS];
+	long long *lines;
+	long long *unparsed;
+	long long *bytes_sent;
+	long long *time_total;
+	long long *time_bucket[NGINX_BUCKETS + 1];
+	struct strframer framer[1]; /* per source */
+};
+
+static int is_var_char(int c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+static int is_key_char(int c)
+{
+	return is_var_char(c) || c == '.' || c == ':' || c == '-';
+}
+
+static int nginx_format_parse(struct nginx *x)
+{
+	const char *p = x->format->s;
+	const char *end = p + x->format->len;
+
+	while (p < end) {
+		struct nginx_elem *e = x->elems + x->n;
+		const char *q;
+		int i;
+		if (x->n == NGINX_ELEM_MAX) return -1;
+		if (*p == '$') {
+			for (q = p + 1; q < end && is_var_char(*q); q++)
+				;
+			if (q == p + 1) return -1;
+			/* a literal is what tells two variables apart
+			 */
+			if (x->n && x->elems[x->n - 1].var != NGINX_LITERAL) return -1;
+			e->var = NGINX_VAR_OTHER;
+			for (i = 0; nginx_var_names[i].name; i++) {
+				if ((int)strlen(nginx_var_names[i].name) == q - p - 1 &&
+				    memcmp(nginx_var_names[i].name, p + 1, q - p - 1) == 0) {
+					e->var = nginx_var_names[i].var;
+					break;
+				}
+			}
+		} else {
+			for (q = p + 1; q < end && *q != '$'; q++)
+				;
+			e->var = NGINX_LITERAL;
+			strview_init(e->text, p, q - p);
+		}
+		x->n++;
+		p = q;
+	}
+	return x->n ? 0 : -1;
+}
+
+static void nginx_framed(void *ctx, const char *p, int len)
+{
+	nginx_line(ctx, p, len);
+}
+
+struct nginx *nginx_new(const char *log_format)
+{
+	struct nginx *x;
+	int i;
+
+	if (strcmp(log_format, "combined") == 0) {
+		log_format = NGINX_COMBINED;
+	}
+
+	x = alloc_calloc(ALLOC_OTHER, 1, sizeof(struct nginx));
+	assert(x);
+	strframer_init(x->framer, NGINX_LINE_MAX, nginx_framed, x);
+	str_copyz(x->format, log_format);
+	if (nginx_format_parse(x)) {
+		nginx_free(x);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	x->keys = nginx_keys_new0();
+	x->arena = str_arena_new(NGINX_ARENA_BLOCK);
+	for (i = 0; i < NGINX_KINDS; i++) {
+		x->other[i] = stats_counter("nginx.%s._other", nginx_kind_names[i]);
+	}
+	x->lines = stats_counter("nginx.lines");
+	x->unparsed = stats_counter("nginx.unparsed_lines");
+	x->bytes_sent = stats_counter("nginx.bytes_sent");
+	x->time_total = stats_counter("nginx.request_time.total_ms");
+	for (i = 0; i < NGINX_BUCKETS; i++) {
+		x->time_bucket[i] = stats_counter("nginx.request_time.le_%ims", nginx_buckets[i]);
+	}
+	x->time_bucket[i] = stats_counter("nginx.request_time.gt_%ims", nginx_buckets[i - 1]);
+	return x;
+}
+
+void nginx_free(struct nginx *x)
+{
+	if (x == NULL) return;
+	strframer_free(x->framer);
+	nginx_keys_free0(x->keys);
+	if (x->arena) str_arena_free(x->arena);
+	str_free(x->format);
+	alloc_free(ALLOC_OTHER, x);
+}
+
+/* the counter of a status, method or host, interned on first sight
+ */
+static long long *nginx_counter(struct nginx *x, int kind, const struct strview *v)
+{
+	struct nginx_key k;
+	long long **c;
+	char name[NGINX_KEY_LEN + 1];
+	int i;
+
+	k.kind = kind;
+	strview_slice(&k.v, v, 0, NGINX_KEY_LEN);
+	if ((c = nginx_keys_get(x->keys, k))) {
+		return *c;
+	}
+	if (x->nkeys[kind] == NGINX_KEYS_MAX || k.v.len == 0) {
+		return x->other[kind];
+	}
+
+	for (i = 0; i < k.v.len; i++) {
+		name[i] = is_key_char(k.v.s[i]) ? k.v.s[i] : '_';
+	}
+	name[i] = 0;
+
+	{
+		DEFINE_STR_ARENA(interned, x->arena);
+		str_copyn(interned, k.v.s, k.v.len);
+		k.v.s = interned->s;
+	}
+	x->nkeys[kind]++;
+	c = nginx_keys_put(x->keys, k, NULL);
+	*c = stats_counter("nginx.%s.%s", nginx_kind_names[kind], name);
+	return *c;
+}
+
+/* leading digits, "-" and the like are 0
+ */
+static long long nginx_number(const struct strview *v, int *frac_msec)
+{
+	long long n = 0;
+	int i, ms = 0, scale = 100;
+	for (i = 0; i < v->len && v->s[i] >= '0' && v->s[i] <= '9'; i++) {
+		n = n * 10 + (v->s[i] - '0');
+	}
+	if (frac_msec) {
+		if (i < v->len && v->s[i] == '.') {
+			for (i++; i < v->len && scale && v->s[i] >= '0' && v->s[i] <= '9'; i++, scale /= 10) {
+				ms += (v->s[i] - '0') * scale;
+			}
+		}
+		*frac_msec = ms;
+	}
+	return n;
+}
+
+int nginx_line(struct nginx *x, const char *p, int len)
+{
+	struct strview v[1];
+	struct strview field[NGINX_VARS];
+	int i, j;
+
+	if (len && p[len - 1] == '\n') len--;
+	(*x->lines)++;
+
+	memset(field, 0, sizeof(field));
+	strview_init(v, p, len);
+	for (i = 0; i < x->n; i++) {
+		struct nginx_elem *e = x->elems + i;
+		if (e->var == NGINX_LITERAL) {
+			if (v->len < e->text->len || memcmp(v->s, e->text->s, e->text->len)) goto unparsed;
+			strview_slice(v, v, e->text->len, -1);
+			continue;
+		}
+		if (i + 1 == x->n) {
+			j = v->len;
+		} else if (e[1].text->len == 1) {
+			j = strview_find_byte(v, e[1].text->s[0]);
+		} else {
+			j = strview_find(v, e[1].text);
+		}
+		if (j < 0) goto unparsed;
+		strview_slice(field + e->var, v, 0, j);
+		strview_slice(v, v, j, -1);
+	}
+
+	if (field[NGINX_VAR_STATUS].s) {
+		(*nginx_counter(x, NGINX_STATUS, field + NGINX_VAR_STATUS))++;
+	}
+	if (field[NGINX_VAR_METHOD].s) {
+		(*nginx_counter(x, NGINX_METHOD, field + NGINX_VAR_METHOD))++;
+	} else if (field[NGINX_VAR_REQUEST].s) {
+		struct strview method[1];
+		j = strview_find_byte(field + NGINX_VAR_REQUEST, ' ');
+		strview_slice(method, field + NGINX_VAR_REQUEST, 0, j);
+		(*nginx_counter(x, NGINX_METHOD, method))++;
+	}
+	if (field[NGINX_VAR_HOST].s) {
+		(*nginx_counter(x, NGINX_HOST, field + NGINX_VAR_HOST))++;
+	}
+	if (field[NGINX_VAR_BYTES].s) {
+		*x->bytes_sent += nginx_number(field + NGINX_VAR_BYTES, NULL);
+	}
+	if (field[NGINX_VAR_REQUEST_TIME].s && field[NGINX_VAR_REQUEST_TIME].len &&
+	    field[NGINX_VAR_REQUEST_TIME].s[0] != '-') {
+		int ms;
+		long long msec = nginx_number(field + NGINX_VAR_REQUEST_TIME, &ms) * 1000 + ms;
+		for (i = 0; i < NGINX_BUCKETS && msec > nginx_buckets[i]; i++)
+			;
+		(*x->time_bucket[i])++;
+		*x->time_total += msec;
+	}
+	return 0;
+
+unparsed:
+	(*x->unparsed)++;
+	return -1;
+}
+
+void nginx_feed(struct nginx *x, ino_t ino, const char *p, int len)
+{
+	strframer_feed(x->framer, ino, p, len);
+}
+
+void nginx_flush(struct nginx *x, ino_t ino, int all)
+{
+	strframer_flush(x->framer, ino, all);
+}
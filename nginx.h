@@ -0,0 +1,51 @@
+#ifndef nw3h8d0qzv6m1xkc7t /* nginx-h */
+#define nw3h8d0qzv6m1xkc7t /* nginx-h */
+
+#include <sys/types.h>
+
+/* nginx access log parse stage, lines are matched against a log_format
+ * in place (fields are views into the line, nothing is copied) and
+ * counted into stats as they go by:
+ *
+ *   nginx.lines, nginx.unparsed_lines
+ *   nginx.bytes_sent ($body_bytes_sent or $bytes_sent, summed)
+ *   nginx.status.<status>
+ *   nginx.method.<method> ($request_method or from $request)
+ *   nginx.host.<host> ($host, $server_name or $http_host)
+ *   nginx.request_time.le_<N>ms, nginx.request_time.gt_10000ms (a line
+ *   counts in its bucket only), nginx.request_time.total_ms
+ *
+ * a format needs a literal between any two variables, keys are cut
+ * to NGINX_KEY_LEN and bytes other than [A-Za-z0-9._:-] become '_',
+ * past NGINX_KEYS_MAX different ones a line counts in <kind>._other
+ */
+
+#define NGINX_COMBINED "$remote_addr - $remote_user [$time_local] \"$request\" $status $body_bytes_sent \"$http_referer\" \"$http_user_agent\""
+
+#define NGINX_KEY_LEN 64
+#define NGINX_KEYS_MAX 256 /* per kind */
+
+struct nginx;
+
+/* "combined" for NGINX_COMBINED, NULL if the format is not valid and
+ * errno is set to EINVAL
+ */
+struct nginx *nginx_new(const char *log_format);
+void nginx_free(struct nginx *x);
+
+/* data read from ino, lines can span calls, the partial one is kept
+ * per source
+ */
+void nginx_feed(struct nginx *x, ino_t ino, const char *p, int len);
+
+/* the partial line of ino (of every source if all) is taken as is,
+ * the source is done
+ */
+void nginx_flush(struct nginx *x, ino_t ino, int all);
+
+/* one line, with or without its '\n', 0 if it matched the format, -1
+ * if not
+ */
+int nginx_line(struct nginx *x, const char *p, int len);
+
+#endif /* !nw3h8d0qzv6m1xkc7t nginx-h */
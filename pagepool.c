@@ -0,0 +1,173 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * page aligned buffers for vmsplice(2), a block handed to a pipe is
+ * referenced by the pipe (not copied), so it is kept busy until the
+ * reader went past it and only then recycled
+ *
+ * each block starts with a header, the caller gets the address right
+ * after the first page, so the data is page aligned as well
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "debug0.h"
+
+#include "pagepool.h"
+#include "stats.h"
+
+#define PAGE_POOL_CLASSES 9 /* 1 to 256 pages */
+#define PAGE_POOL_KEEP 32 /* free blocks kept per class */
+
+struct page_block {
+	struct page_block *next;
+	int capacity; /* usable bytes */
+	int klass; /* -1 if too big for the pool */
+	unsigned long long busy_until;
+};
+
+struct page_pool {
+	int page;
+	struct page_block *free[PAGE_POOL_CLASSES];
+	int nfree[PAGE_POOL_CLASSES];
+	struct page_block *busy; /* waiting for the pipe reader */
+	long long *hits;
+	long long *misses;
+	long long *busy_bytes;
+};
+
+struct page_pool *page_pool_new(void)
+{
+	struct page_pool *x = calloc(1, sizeof(struct page_pool));
+	assert(x);
+	x->page = sysconf(_SC_PAGESIZE);
+	assert(x->page >= (int)sizeof(struct page_block));
+	x->hits = stats_counter("page_pool.hits");
+	x->misses = stats_counter("page_pool.misses");
+	x->busy_bytes = stats_counter("page_pool.busy_bytes");
+	return x;
+}
+
+static void page_block_list_free(struct page_block *b)
+{
+	while (b) {
+		struct page_block *t = b->next;
+		free(b);
+		b = t;
+	}
+}
+
+void page_pool_free(struct page_pool *x)
+{
+	int i;
+	for (i = 0; i < PAGE_POOL_CLASSES; i++) {
+		page_block_list_free(x->free[i]);
+	}
+	page_block_list_free(x->busy);
+	free(x);
+}
+
+#define BLOCK_DATA(x, b) ((char*)(b) + (x)->page)
+#define DATA_BLOCK(x, p) ((struct page_block*)((char*)(p) - (x)->page))
+
+void *page_pool_get(struct page_pool *x, int size, int *capacity)
+{
+	struct page_block *b;
+	int pages = (size + x->page - 1) / x->page;
+	int k = 0;
+	void *p;
+
+	while (k < PAGE_POOL_CLASSES && (1 << k) < pages) k++;
+
+	if (k < PAGE_POOL_CLASSES && (b = x->free[k])) {
+		x->free[k] = b->next;
+		x->nfree[k]--;
+		*x->hits += 1;
+	} else {
+		int n = k < PAGE_POOL_CLASSES ? 1 << k : pages;
+		if (posix_memalign(&p, x->page, (n + 1) * (size_t)x->page)) {
+			return NULL;
+		}
+		b = p;
+		b->capacity = n * x->page;
+		b->klass = k < PAGE_POOL_CLASSES ? k : -1;
+		*x->misses += 1;
+	}
+
+	b->next = NULL;
+	b->busy_until = 0;
+	*capacity = b->capacity;
+	return BLOCK_DATA(x, b);
+}
+
+static void page_pool_recycle(struct page_pool *x, struct page_block *b)
+{
+	if (b->klass < 0 || x->nfree[b->klass] >= PAGE_POOL_KEEP) {
+		free(b);
+		return;
+	}
+	b->next = x->free[b->klass];
+	x->free[b->klass] = b;
+	x->nfree[b->klass]++;
+}
+
+void page_pool_put(struct page_pool *x, void *p, unsigned long long busy_until)
+{
+	struct page_block *b = DATA_BLOCK(x, p);
+	if (busy_until == 0) {
+		page_pool_recycle(x, b);
+		return;
+	}
+	b->busy_until = busy_until;
+	b->next = x->busy;
+	x->busy = b;
+	*x->busy_bytes += b->capacity;
+}
+
+int page_pool_busy(struct page_pool *x)
+{
+	return x->busy != NULL;
+}
+
+void page_pool_reclaim(struct page_pool *x, unsigned long long consumed)
+{
+	struct page_block **pb = &x->busy;
+	while (*pb) {
+		struct page_block *b = *pb;
+		if (b->busy_until <= consumed) {
+			*pb = b->next;
+			*x->busy_bytes -= b->capacity;
+			page_pool_recycle(x, b);
+		} else {
+			pb = &b->next;
+		}
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef nnv7c2kq0x5e1fjw8m /* pagepool-h */
+#define nnv7c2kq0x5e1fjw8m /* pagepool-h */
+
+struct page_pool;
+
+struct page_pool *page_pool_new(void);
+
+/* everything goes, busy or not, pipes must be closed by now
+ */
+void page_pool_free(struct page_pool *x);
+
+/* page aligned block of at least size bytes, NULL on error, the
+ * usable size is stored in capacity
+ */
+void *page_pool_get(struct page_pool *x, int size, int *capacity);
+
+/* give a block back, busy_until is the pipe position (bytes ever put
+ * in it) past which the reader no longer needs the block, 0 if it was
+ * never spliced
+ */
+void page_pool_put(struct page_pool *x, void *p, unsigned long long busy_until);
+
+/* any block waiting for the reader?
+ */
+int page_pool_busy(struct page_pool *x);
+
+/* recycle busy blocks the reader went past, consumed is the bytes
+ * ever put in the pipe minus what is still in it (FIONREAD)
+ */
+void page_pool_reclaim(struct page_pool *x, unsigned long long consumed);
+
+#endif /* !nnv7c2kq0x5e1fjw8m pagepool-h */
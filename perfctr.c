@@ -0,0 +1,136 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * perf_event_open counters, see perfctr.h
+ *
+ * reference: man 2 perf_event_open
+ *
+ * counters are opened one by one (inherit does not go along with
+ * group reads), and scaled by time enabled over time running, as the
+ * kernel may multiplex them
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "debug0.h"
+#include "stats.h"
+
+#include "perfctr.h"
+
+static struct {
+	const char *name;
+	int type;
+	int config;
+	int fd;
+	long long *total, *per_mb, *per_rotation;
+} counters[] = {
+	{"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1},
+	{"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1},
+	{"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+	{"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, -1},
+	{"page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, -1},
+};
+
+#define NCOUNTERS ((int)(sizeof(counters) / sizeof(counters[0])))
+
+static int counter_open(int type, int config, int exclude_kernel)
+{
+	struct perf_event_attr attr[1];
+	memset(attr, 0, sizeof(attr));
+	attr->size = sizeof(attr);
+	attr->type = type;
+	attr->config = config;
+	attr->inherit = 1;
+	attr->exclude_kernel = exclude_kernel;
+	attr->exclude_hv = 1;
+	attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	return syscall(SYS_perf_event_open, attr, 0 /* self */, -1 /* any cpu */, -1 /* no group */, PERF_FLAG_FD_CLOEXEC);
+}
+
+int perfctr_open()
+{
+	int i, opened = 0, save_errno = 0;
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		int fd = counter_open(counters[i].type, counters[i].config, 0);
+		if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+			/* perf_event_paranoid > 1, user space only then
+			 */
+			fd = counter_open(counters[i].type, counters[i].config, 1);
+		}
+		if (fd < 0) {
+			save_errno = errno;
+			DEBUG_INFO("perf_event_open(%s), errno=%i", counters[i].name, save_errno);
+			continue;
+		}
+		counters[i].fd = fd;
+		counters[i].total = stats_counter("perf.%s", counters[i].name);
+		counters[i].per_mb = stats_counter("perf.%s_per_mb", counters[i].name);
+		counters[i].per_rotation = stats_counter("perf.%s_per_rotation", counters[i].name);
+		opened++;
+	}
+
+	if (opened == 0) {
+		errno = save_errno;
+		return -1;
+	}
+	return 0;
+}
+
+void perfctr_stats(long long bytes, long long rotations)
+{
+	int i;
+
+	for (i = 0; i < NCOUNTERS; i++) {
+		unsigned long long v[3]; /* value, enabled, running */
+		long long value;
+		if (counters[i].fd < 0) continue;
+		if (read(counters[i].fd, v, sizeof(v)) != sizeof(v)) continue;
+		if (v[2] == 0) continue; /* never scheduled */
+		value = v[2] < v[1] ? (long long)((double)v[0] * v[1] / v[2]) : (long long)v[0];
+		*counters[i].total = value;
+		*counters[i].per_mb = bytes > 0 ? (long long)((double)value * 0x100000 / bytes) : 0;
+		*counters[i].per_rotation = rotations > 0 ? value / rotations : 0;
+	}
+}
+
+void perfctr_close()
+{
+	int i;
+	for (i = 0; i < NCOUNTERS; i++) {
+		if (counters[i].fd >= 0) {
+			close(counters[i].fd);
+			counters[i].fd = -1;
+		}
+	}
+}
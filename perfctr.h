@@ -0,0 +1,25 @@
+#ifndef nq7mzt2c5wbx0lfe3v /* perfctr-h */
+#define nq7mzt2c5wbx0lfe3v /* perfctr-h */
+
+/* self-profiling with perf_event_open: cycles, instructions, cache
+ * misses, context switches and page faults of this process, its
+ * threads and the children it spawns afterwards (inherited counters,
+ * a child adds up once it exits)
+ *
+ * results go to the stats surface as "perf.<name>" totals, plus
+ * "perf.<name>_per_mb" and "perf.<name>_per_rotation"
+ */
+
+/* 0 if at least one counter could be opened, -1 otherwise and errno
+ * is set appropriately (perf_event_paranoid, no PMU in a VM, ...)
+ */
+int perfctr_open();
+
+/* read counters into stats, bytes moved and rotations so far are the
+ * denominators, nothing if not open
+ */
+void perfctr_stats(long long bytes, long long rotations);
+
+void perfctr_close();
+
+#endif /* !nq7mzt2c5wbx0lfe3v perfctr-h */
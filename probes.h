@@ -0,0 +1,83 @@
+#ifndef nk3v8qz1fhw6ud2p0s /* probes-h */
+#define nk3v8qz1fhw6ud2p0s /* probes-h */
+
+/* USDT static tracepoints, provider "aimant", e.g.
+ *
+ *   bpftrace -e 'usdt:./aimant:aimant:sink_write { @[arg0] = hist(arg1); }'
+ *   perf probe -x ./aimant sdt_aimant:rotate_rename
+ *
+ * a probe is a single nop plus an ELF note telling tracers where it
+ * is and where its arguments live, so it costs nothing while not
+ * attached (arguments must be cheap to compute, they are evaluated
+ * anyway)
+ *
+ * <sys/sdt.h> is used when present, otherwise the same notes are
+ * emitted here (x86-64 only, every argument passed as a 64-bit
+ * signed integer), define NO_PROBES to compile them out
+ */
+
+#if !defined(NO_PROBES) && defined(__has_include)
+# if __has_include(<sys/sdt.h>)
+#  define PROBES_SYS_SDT
+# endif
+#endif
+
+#if defined(NO_PROBES)
+
+#define PROBE1(name, a1) do {} while (0)
+#define PROBE2(name, a1, a2) do {} while (0)
+#define PROBE3(name, a1, a2, a3) do {} while (0)
+
+#elif defined(PROBES_SYS_SDT)
+
+#include <sys/sdt.h>
+
+#define PROBE1(name, a1) STAP_PROBE1(aimant, name, a1)
+#define PROBE2(name, a1, a2) STAP_PROBE2(aimant, name, a1, a2)
+#define PROBE3(name, a1, a2, a3) STAP_PROBE3(aimant, name, a1, a2, a3)
+
+#elif defined(__x86_64__)
+
+/* reference: https://sourceware.org/systemtap/wiki/UserSpaceProbeImplementation
+ */
+#define PROBE_ASM(name, args, ...) __asm__ __volatile__ ( \
+	"990: nop\n" \
+	".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+	".balign 4\n" \
+	".4byte 992f-991f, 994f-993f, 3\n" \
+	"991: .asciz \"stapsdt\"\n" \
+	"992: .balign 4\n" \
+	"993: .8byte 990b\n" \
+	".8byte _.stapsdt.base\n" \
+	".8byte 0\n" \
+	".asciz \"aimant\"\n" \
+	".asciz \"" #name "\"\n" \
+	".asciz \"" args "\"\n" \
+	"994: .balign 4\n" \
+	".popsection\n" \
+	".ifndef _.stapsdt.base\n" \
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n" \
+	".hidden _.stapsdt.base\n" \
+	"_.stapsdt.base: .space 1\n" \
+	".size _.stapsdt.base, 1\n" \
+	".popsection\n" \
+	".endif\n" \
+	:: __VA_ARGS__)
+
+#define PROBE1(name, a1) PROBE_ASM(name, "-8@%0", \
+	"nor" ((long long)(a1)))
+#define PROBE2(name, a1, a2) PROBE_ASM(name, "-8@%0 -8@%1", \
+	"nor" ((long long)(a1)), "nor" ((long long)(a2)))
+#define PROBE3(name, a1, a2, a3) PROBE_ASM(name, "-8@%0 -8@%1 -8@%2", \
+	"nor" ((long long)(a1)), "nor" ((long long)(a2)), "nor" ((long long)(a3)))
+
+#else
+
+#define PROBE1(name, a1) do {} while (0)
+#define PROBE2(name, a1, a2) do {} while (0)
+#define PROBE3(name, a1, a2, a3) do {} while (0)
+
+#endif
+
+#endif /* !nk3v8qz1fhw6ud2p0s probes-h */
@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * flight recorder, see recorder.h
+ *
+ * the ring is static, so a dump from a signal handler needs nothing
+ * but open(), write() and close()
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+struct fr_event fr_ring[FR_SIZE];
+unsigned long long fr_pos = 0;
+
+static char dump_path[4096];
+static unsigned long long ts0 = 0, ns0 = 0;
+
+static const char *type_names[FR_TYPE_MAX][3] = {
+	[FR_NONE] = {"none", NULL, NULL},
+	[FR_TAP_READ] = {"tap_read", "fd", "bytes"},
+	[FR_TAP_EAGAIN] = {"tap_eagain", "fd", NULL},
+	[FR_TAP_EOF] = {"tap_eof", "fd", NULL},
+	[FR_ENQUEUE] = {"enqueue", "bytes", "offset"},
+	[FR_SINK_WRITE] = {"sink_write", "fd", "bytes"},
+	[FR_SINK_EAGAIN] = {"sink_eagain", "fd", NULL},
+	[FR_SINK_EOF] = {"sink_eof", "fd", NULL},
+	[FR_SINK_ERROR] = {"sink_error", "fd", "errno"},
+	[FR_ROTATE_RENAME] = {"rotate_rename", "input", "bytes"},
+	[FR_ROTATE_CHECKPOINT] = {"rotate_checkpoint", NULL, "ino"},
+	[FR_ROTATE_SIGNAL] = {"rotate_signal", "pid", "errno"},
+	[FR_ROTATE_SWAP] = {"rotate_swap", "input", NULL},
+	[FR_ROTATE_SETTLE] = {"rotate_settle", "result", NULL},
+	[FR_CHILD_SPAWN] = {"child_spawn", "pid", "usec"},
+	[FR_CHILD_EXIT] = {"child_exit", "pid", "status"},
+	[FR_DUMP] = {"dump", "signal", NULL},
+};
+
+const char *fr_type_name(int type)
+{
+	if (type < 0 || type >= FR_TYPE_MAX) return NULL;
+	return type_names[type][0];
+}
+
+const char *fr_type_a(int type)
+{
+	if (type < 0 || type >= FR_TYPE_MAX) return NULL;
+	return type_names[type][1];
+}
+
+const char *fr_type_b(int type)
+{
+	if (type < 0 || type >= FR_TYPE_MAX) return NULL;
+	return type_names[type][2];
+}
+
+static unsigned long long clock_ns(clockid_t clock)
+{
+	struct timespec ts[1];
+	clock_gettime(clock, ts);
+	return (unsigned long long)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	while (len) {
+		ssize_t n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		p += n;
+		len -= n;
+	}
+	return 0;
+}
+
+int fr_dump(int fd, int signo)
+{
+	struct fr_header h[1];
+
+	fr_record(FR_DUMP, signo, 0);
+
+	memset(h, 0, sizeof(h));
+	memcpy(h->magic, FR_MAGIC, sizeof(h->magic));
+	h->size = FR_SIZE;
+	h->event_size = sizeof(struct fr_event);
+	h->pos = __atomic_load_n(&fr_pos, __ATOMIC_RELAXED);
+#if defined(__x86_64__) || defined(__i386__)
+	h->tsc = 1;
+#endif
+	h->signo = signo;
+	h->pid = getpid();
+	h->ts0 = ts0;
+	h->ns0 = ns0;
+	h->ts1 = fr_now();
+	h->ns1 = clock_ns(CLOCK_MONOTONIC);
+	h->realtime_ns1 = clock_ns(CLOCK_REALTIME);
+
+	if (write_all(fd, h, sizeof(h))) return -1;
+	return write_all(fd, fr_ring, sizeof(fr_ring));
+}
+
+static void dump_handler(int signo)
+{
+	int save_errno = errno;
+	int fd;
+
+	if ((fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) >= 0) {
+		fr_dump(fd, signo);
+		close(fd);
+	}
+
+	if (signo != SIGUSR2) {
+		/* the action is back to default (SA_RESETHAND), it is
+		 * delivered once we return, faults would refault anyway
+		 */
+		raise(signo);
+	}
+
+	errno = save_errno;
+}
+
+int fr_init(const char *path)
+{
+	static char altstack[65536];
+	static const int fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+	struct sigaction sa[1];
+	stack_t ss[1];
+	int i;
+
+	if (strlen(path) >= sizeof(dump_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(dump_path, path);
+
+	ts0 = fr_now();
+	ns0 = clock_ns(CLOCK_MONOTONIC);
+
+	/* so a stack overflow still gets dumped
+	 */
+	ss->ss_sp = altstack;
+	ss->ss_size = sizeof(altstack);
+	ss->ss_flags = 0;
+	if (sigaltstack(ss, NULL)) return -1;
+
+	memset(sa, 0, sizeof(sa));
+	sa->sa_handler = dump_handler;
+	sigemptyset(&sa->sa_mask);
+	sa->sa_flags = SA_RESTART;
+	if (sigaction(SIGUSR2, sa, NULL)) return -1;
+
+	sa->sa_flags = SA_RESETHAND | SA_ONSTACK;
+	for (i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+		if (sigaction(fatal[i], sa, NULL)) return -1;
+	}
+
+	return 0;
+}
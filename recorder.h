@@ -0,0 +1,105 @@
+#ifndef nrqwm7fe6yp7bm4xk2 /* recorder-h */
+#define nrqwm7fe6yp7bm4xk2 /* recorder-h */
+
+#include <time.h>
+
+/* flight recorder, a fixed ring of compact binary events, always on
+ * and cheap enough for hot paths (an atomic increment, a timestamp
+ * and three stores), dumped to a file on SIGUSR2 or on a fatal
+ * signal, flightdump decodes it
+ *
+ * timestamps are TSC ticks where there is one, monotonic nanoseconds
+ * otherwise, the dump carries what is needed to convert them
+ */
+
+enum fr_type {
+	FR_NONE = 0,
+	FR_TAP_READ, /* fd, bytes */
+	FR_TAP_EAGAIN, /* fd */
+	FR_TAP_EOF, /* fd */
+	FR_ENQUEUE, /* bytes, file offset */
+	FR_SINK_WRITE, /* fd, bytes */
+	FR_SINK_EAGAIN, /* fd */
+	FR_SINK_EOF, /* fd */
+	FR_SINK_ERROR, /* fd, errno */
+	FR_ROTATE_RENAME, /* current input, bytes read */
+	FR_ROTATE_CHECKPOINT, /* -, new inode */
+	FR_ROTATE_SIGNAL, /* pid, errno (0 if sent) */
+	FR_ROTATE_SWAP, /* current input */
+	FR_ROTATE_SETTLE, /* result */
+	FR_CHILD_SPAWN, /* pid, usec */
+	FR_CHILD_EXIT, /* pid, exit status */
+	FR_DUMP, /* signal */
+	FR_TYPE_MAX
+};
+
+struct fr_event {
+	unsigned long long ts;
+	unsigned int type;
+	int a;
+	long long b;
+};
+
+#define FR_MAGIC "AIMFR001"
+#define FR_SIZE 65536 /* events, a power of two */
+
+/* what a dump starts with, the ring follows as is, the oldest event
+ * is at pos % size once it wrapped
+ */
+struct fr_header {
+	char magic[8];
+	unsigned int size;
+	unsigned int event_size;
+	unsigned long long pos; /* events recorded so far */
+	int tsc; /* ts are TSC ticks, nanoseconds otherwise */
+	int signo; /* what triggered the dump */
+	int pid;
+	int pad;
+	unsigned long long ts0, ns0; /* ts and monotonic ns at fr_init() */
+	unsigned long long ts1, ns1; /* same at dump */
+	long long realtime_ns1; /* wall clock at dump */
+};
+
+extern struct fr_event fr_ring[FR_SIZE];
+extern unsigned long long fr_pos;
+
+static inline unsigned long long fr_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec ts[1];
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	return (unsigned long long)ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+#endif
+}
+
+/* from any thread, events racing with a dump may come out torn
+ */
+static inline void fr_record(int type, int a, long long b)
+{
+	unsigned long long i = __atomic_fetch_add(&fr_pos, 1, __ATOMIC_RELAXED);
+	struct fr_event *e = fr_ring + (i & (FR_SIZE - 1));
+	e->ts = fr_now();
+	e->type = type;
+	e->a = a;
+	e->b = b;
+}
+
+/* install the SIGUSR2 and fatal signal handlers that dump to path
+ * (copied), 0 on success, -1 on error and errno is set appropriately
+ */
+int fr_init(const char *path);
+
+/* write header and ring to fd, async-signal-safe, 0 on success, -1 on
+ * error and errno is set appropriately
+ */
+int fr_dump(int fd, int signo);
+
+/* name of an event type and of its a and b fields (NULL if unused)
+ */
+const char *fr_type_name(int type);
+const char *fr_type_a(int type);
+const char *fr_type_b(int type);
+
+#endif /* !nrqwm7fe6yp7bm4xk2 recorder-h */
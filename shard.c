@@ -0,0 +1,515 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#define _GNU_SOURCE /* sched_setaffinity(2), CPU_SET(3) */
+
+/*
+ * sharded mode supervisor, see shard.h
+ *
+ * the single file loop keeps process-wide state (timers, children,
+ * checkpoint, page pool), so a shard is a worker process and not a
+ * thread, the supervisor forwards stdin and worker output, pins and
+ * moves workers, and sums what they dump with -S
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/select.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "debug0.h"
+#include "str.h"
+#include "stats.h"
+#include "timer.h"
+#include "subprocess.h"
+
+#include "shard.h"
+
+#define MAX2(a, b) ((a) >= (b) ? (a) : (b))
+
+#define SHARD_BALANCE_MSEC 1000
+#define SHARD_STATS_SIZE 0x10000 /* 65536, a worker stats dump */
+
+struct supervisor {
+	struct shard *shards;
+	int n;
+	int cpus[CPU_SETSIZE];
+	int ncpus;
+	const char *stats_path;
+	long long ticked; /* timer_now_msec() */
+	struct timer balance[1];
+};
+
+static char stats_buf[SHARD_STATS_SIZE];
+
+static int write_exact(int fd, void *buf, int len)
+{
+	int i, wrote = 0;
+	do {
+		if ((i = write(fd, buf + wrote, len - wrote)) <= 0) return i;
+		wrote += i;
+	} while (wrote < len);
+	return len;
+}
+
+/* every thread of pid, sched_setaffinity(2) on a pid only moves its
+ * main thread, 0 on success, -1 on error and errno is set
+ * appropriately
+ */
+static int pin(int pid, int cpu)
+{
+	char path[64];
+	cpu_set_t set[1];
+	struct dirent *e;
+	DIR *d;
+	int r = 0;
+
+	CPU_ZERO(set);
+	CPU_SET(cpu, set);
+
+	snprintf(path, sizeof(path), "/proc/%i/task", pid);
+	if ((d = opendir(path)) == NULL) {
+		return sched_setaffinity(pid, sizeof(set), set);
+	}
+	while ((e = readdir(d))) {
+		int tid = atoi(e->d_name);
+		/* threads may be gone meanwhile
+		 */
+		if (tid > 0 && sched_setaffinity(tid, sizeof(set), set) && errno != ESRCH) {
+			r = -1;
+		}
+	}
+	closedir(d);
+	return r;
+}
+
+static void shard_pin(struct supervisor *s, struct shard *x, int cpu)
+{
+	if (pin(x->sp->pid, s->cpus[cpu])) {
+		DEBUG("pin(pid=%i, cpu=%i), errno=%i", x->sp->pid, s->cpus[cpu], errno);
+		return;
+	}
+	DEBUG_INFO("shard pid %i pinned to cpu %i", x->sp->pid, s->cpus[cpu]);
+	x->cpu = cpu;
+}
+
+/* fn on every "name value" line of the last worker dump, 0 on
+ * success, -1 on error and errno is set appropriately (ENOENT until
+ * the worker dumps for the first time)
+ */
+static int stats_each(struct shard *x, void (*fn)(struct shard *x, struct strview *name, long long value))
+{
+	struct strview v[1], line[1], name[1];
+	int fd, n, len = 0;
+
+	if ((fd = open(x->stats_path, O_RDONLY)) < 0) {
+		return -1;
+	}
+	while (len < SHARD_STATS_SIZE - 1 && (n = read(fd, stats_buf + len, SHARD_STATS_SIZE - 1 - len)) > 0) {
+		len += n;
+	}
+	close(fd);
+	stats_buf[len] = 0; /* strtoll() stops here at last */
+
+	strview_init(v, stats_buf, len);
+	while (strview_split(v, '\n', line)) {
+		int i = strview_find_byte(line, ' ');
+		if (i <= 0) {
+			continue;
+		}
+		strview_slice(name, line, 0, i);
+		fn(x, name, strtoll(line->s + i + 1, NULL, 10));
+	}
+	return 0;
+}
+
+static void stats_zero(struct shard *x, struct strview *name, long long value)
+{
+	*stats_counter("%.*s", name->len, name->s) = 0;
+}
+
+static void stats_add(struct shard *x, struct strview *name, long long value)
+{
+	*stats_counter("%.*s", name->len, name->s) += value;
+}
+
+/* x->bytes is summed over sink.N.written_bytes, the primary and any
+ * tee, so it is zeroed first
+ */
+static void stats_rate(struct shard *x, struct strview *name, long long value)
+{
+	static const char prefix[] = "sink.", suffix[] = ".written_bytes";
+	int np = sizeof(prefix) - 1, ns = sizeof(suffix) - 1;
+	struct strview k[1];
+	if (name->len > np + ns && memcmp(name->s, prefix, np) == 0 &&
+	    memcmp(name->s + name->len - ns, suffix, ns) == 0) {
+		x->bytes += value;
+	}
+	strview_ofz(k, "rotate.count");
+	if (strview_equal(name, k)) {
+		x->rotations = value;
+	}
+}
+
+/* greedy, hottest first, a worker that just rotated moves to the
+ * least loaded cpu if that lowers the load it leaves, so the spread
+ * only improves and a move never splits a rotation
+ */
+static void shard_balance(struct supervisor *s, const int *rotated)
+{
+	long long load[CPU_SETSIZE];
+	int order[SHARD_MAX];
+	int i, j;
+
+	memset(load, 0, sizeof(load[0]) * s->ncpus);
+	for (i = 0; i < s->n; i++) {
+		struct shard *x = s->shards + i;
+		if (!x->done && x->cpu >= 0) {
+			load[x->cpu] += x->rate;
+		}
+		for (j = i; j > 0 && s->shards[order[j - 1]].rate < x->rate; j--) {
+			order[j] = order[j - 1];
+		}
+		order[j] = i;
+	}
+
+	for (i = 0; i < s->n; i++) {
+		struct shard *x = s->shards + order[i];
+		int src = x->cpu, dst = 0;
+		if (x->done || src < 0 || !rotated[order[i]]) {
+			continue;
+		}
+		for (j = 1; j < s->ncpus; j++) {
+			if (load[j] < load[dst]) {
+				dst = j;
+			}
+		}
+		if (load[dst] + x->rate < load[src]) {
+			shard_pin(s, x, dst);
+			if (x->cpu == dst) {
+				load[src] -= x->rate;
+				load[dst] += x->rate;
+				x->migrations++;
+			}
+		}
+	}
+}
+
+static void shard_tick(struct timer *t, void *arg)
+{
+	struct supervisor *s = arg;
+	int rotated[SHARD_MAX];
+	long long now = timer_now_msec();
+	long long dt = MAX2(now - s->ticked, 1);
+	int i;
+
+	for (i = 0; i < s->n; i++) {
+		struct shard *x = s->shards + i;
+		long long bytes = x->bytes, rotations = x->rotations;
+		rotated[i] = 0;
+		if (x->done) {
+			continue;
+		}
+		x->bytes = 0;
+		if (stats_each(x, stats_rate)) {
+			x->bytes = bytes;
+			continue;
+		}
+		/* smoothed over a few ticks, one burst should not move
+		 * anything
+		 */
+		x->rate = (x->rate + (x->bytes - bytes) * 1000 / dt) / 2;
+		rotated[i] = x->rotations != rotations;
+	}
+	s->ticked = now;
+
+	if (s->ncpus > 1) {
+		shard_balance(s, rotated);
+	}
+
+	if (s->stats_path) {
+		for (i = 0; i < s->n; i++) {
+			stats_each(s->shards + i, stats_zero);
+		}
+		for (i = 0; i < s->n; i++) {
+			struct shard *x = s->shards + i;
+			stats_each(x, stats_add);
+			*stats_counter("shard.%i.pid", i) = x->sp->pid;
+			*stats_counter("shard.%i.cpu", i) = x->cpu >= 0 ? s->cpus[x->cpu] : -1;
+			*stats_counter("shard.%i.rate_bytes", i) = x->rate;
+			*stats_counter("shard.%i.migrations", i) = x->migrations;
+		}
+		if (stats_dump(s->stats_path)) {
+			perror(s->stats_path);
+		}
+	}
+
+	timer_arm(t, SHARD_BALANCE_MSEC);
+}
+
+/* worker output goes to our stderr, -1 once there is no more
+ */
+static int forward(int fd)
+{
+	char buf[4096];
+	int n;
+	if ((n = read(fd, buf, sizeof(buf))) > 0) {
+		write_exact(STDERR_FILENO, buf, n);
+		return 0;
+	}
+	if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+		return 0;
+	}
+	return -1;
+}
+
+/* EOF on their stdin is how aimant is told to do a clean exit
+ */
+static void shard_stop_all(struct supervisor *s)
+{
+	int i;
+	for (i = 0; i < s->n; i++) {
+		struct shard *x = s->shards + i;
+		if (!x->done && x->sp->child_fdin >= 0) {
+			subprocess_close_child_fdin(x->sp);
+		}
+	}
+}
+
+static int shard_reap(struct supervisor *s, struct shard *x)
+{
+	int status;
+
+	while (x->sp->child_fdout >= 0 && forward(x->sp->child_fdout) == 0)
+		;
+	while (x->sp->child_fderr >= 0 && forward(x->sp->child_fderr) == 0)
+		;
+
+	assert(subprocess_terminate(x->sp) == 0);
+	x->done = 1;
+
+	status = x->sp->exit_status;
+	if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+		DEBUG_INFO("shard %i, pid %i, is done", (int)(x - s->shards), x->sp->pid);
+		return 0;
+	}
+	DEBUG("shard %i, pid %i, exited with status %i, stopping the others", (int)(x - s->shards), x->sp->pid, status);
+	shard_stop_all(s);
+	return -1;
+}
+
+static int shard_cpus(struct supervisor *s, const int *cpus, int ncpus)
+{
+	cpu_set_t set[1];
+	int i;
+
+	if (ncpus) {
+		memcpy(s->cpus, cpus, sizeof(int) * ncpus);
+		return ncpus;
+	}
+	if (sched_getaffinity(0, sizeof(set), set)) {
+		DEBUG("sched_getaffinity(), errno=%i, workers are not pinned", errno);
+		return 0;
+	}
+	for (i = 0; i < CPU_SETSIZE; i++) {
+		if (CPU_ISSET(i, set)) {
+			s->cpus[ncpus++] = i;
+		}
+	}
+	return ncpus;
+}
+
+int shard_run(struct shard *shards, int n, const int *cpus, int ncpus, const char *stats_path)
+{
+	struct supervisor s[1];
+	int stdin_fd = STDIN_FILENO;
+	char pending[4096]; /* read from stdin, not yet taken by shard 0 */
+	int pending_pos = 0, pending_len = 0;
+	int stopping = 0; /* stdin is closed, stop once pending is taken */
+	int live = 0;
+	int result = 0;
+	int tfd;
+	int i;
+
+	assert(n > 0 && n <= SHARD_MAX);
+
+	memset(s, 0, sizeof(s));
+	s->shards = shards;
+	s->n = n;
+	s->ncpus = shard_cpus(s, cpus, ncpus);
+	s->stats_path = stats_path;
+
+	for (i = 0; i < n; i++) {
+		struct shard *x = shards + i;
+		x->sp->argv = x->argv;
+		x->cpu = -1;
+		if (subprocess_spawn(x->sp)) {
+			int save_errno = errno;
+			DEBUG("subprocess_spawn(shard %i), errno=%i", i, save_errno);
+			shard_stop_all(s);
+			while (--i >= 0) {
+				shard_reap(s, shards + i);
+			}
+			errno = save_errno;
+			return -1;
+		}
+		live++;
+		if (s->ncpus) {
+			shard_pin(s, x, i % s->ncpus);
+		}
+	}
+
+	if ((tfd = timer_fd()) < 0) {
+		perror("timer_fd()");
+		exit(1);
+	}
+	s->ticked = timer_now_msec();
+	timer_init(s->balance, shard_tick, s);
+	timer_arm(s->balance, SHARD_BALANCE_MSEC);
+
+	while (live) {
+		int selfpipe = subprocess_get_selfpipe_read_fd();
+		int max_fds = MAX2(selfpipe, tfd);
+		int fdin = shards->sp->child_fdin;
+		fd_set rfds[1], wfds[1];
+		int r;
+
+		if (pending_len && fdin < 0) {
+			pending_len = 0; /* shard 0 is stopped or gone */
+		}
+		if (stopping && !pending_len) {
+			stopping = 0;
+			shard_stop_all(s);
+			fdin = -1;
+		}
+
+		FD_ZERO(rfds);
+		FD_ZERO(wfds);
+		FD_SET(selfpipe, rfds);
+		FD_SET(tfd, rfds);
+		/* stdin waits while shard 0 is behind, its stdin is non
+		 * blocking
+		 */
+		if (pending_len) {
+			FD_SET(fdin, wfds);
+			max_fds = MAX2(fdin, max_fds);
+		} else if (stdin_fd >= 0) {
+			FD_SET(stdin_fd, rfds);
+			max_fds = MAX2(stdin_fd, max_fds);
+		}
+		for (i = 0; i < n; i++) {
+			struct subprocess *sp = shards[i].sp;
+			if (sp->child_fdout >= 0) {
+				FD_SET(sp->child_fdout, rfds);
+				max_fds = MAX2(sp->child_fdout, max_fds);
+			}
+			if (sp->child_fderr >= 0) {
+				FD_SET(sp->child_fderr, rfds);
+				max_fds = MAX2(sp->child_fderr, max_fds);
+			}
+		}
+
+		if ((r = select(max_fds + 1, rfds, wfds, NULL, NULL)) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("select()");
+			exit(1);
+		}
+
+		if (FD_ISSET(tfd, rfds)) {
+			timer_run();
+		}
+
+		if (!pending_len && stdin_fd >= 0 && FD_ISSET(stdin_fd, rfds)) {
+			int m = read(stdin_fd, pending, sizeof(pending));
+			if (m > 0 && fdin >= 0) {
+				/* same as without shards, what comes on stdin
+				 * goes along the first log
+				 */
+				pending_pos = 0;
+				pending_len = m;
+				FD_SET(fdin, wfds); /* try right away */
+			} else if (m == 0 || (m < 0 && errno != EINTR && errno != EAGAIN)) {
+				DEBUG_INFO("stdin is closed, stopping shards");
+				stdin_fd = -1;
+				stopping = 1;
+			}
+		}
+
+		if (pending_len && FD_ISSET(fdin, wfds)) {
+			int m = write(fdin, pending + pending_pos, pending_len - pending_pos);
+			if (m > 0) {
+				pending_pos += m;
+			} else if (m < 0 && errno != EINTR && errno != EAGAIN) {
+				DEBUG("write(shard 0 stdin), errno=%i", errno);
+				pending_pos = pending_len;
+			}
+			if (pending_pos == pending_len) {
+				pending_len = 0;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			struct subprocess *sp = shards[i].sp;
+			if (sp->child_fdout >= 0 && FD_ISSET(sp->child_fdout, rfds) && forward(sp->child_fdout)) {
+				subprocess_close_child_fdout(sp);
+			}
+			if (sp->child_fderr >= 0 && FD_ISSET(sp->child_fderr, rfds) && forward(sp->child_fderr)) {
+				subprocess_close_child_fderr(sp);
+			}
+		}
+
+		if (FD_ISSET(selfpipe, rfds)) {
+			assert(subprocess_read_selfpipe() == 0);
+			for (i = 0; i < n; i++) {
+				struct shard *x = shards + i;
+				if (!x->done && x->sp->is_gone) {
+					if (shard_reap(s, x)) {
+						result = -1;
+					}
+					live--;
+				}
+			}
+		}
+	}
+
+	timer_cancel(s->balance);
+
+	/* workers dump once more on their way out
+	 */
+	shard_tick(s->balance, s);
+	timer_cancel(s->balance);
+
+	return result;
+}
@@ -0,0 +1,37 @@
+#ifndef nk5rj8wq2xe0tz6fvm /* shard-h */
+#define nk5rj8wq2xe0tz6fvm /* shard-h */
+
+#include "subprocess.h"
+
+/* sharded mode, one worker process per log file, each with its own
+ * event loop, buffer pool and svlogd, pinned to a cpu
+ *
+ * the supervisor spreads workers over cpus by the byte rate they
+ * report, a worker only moves right after it rotated, and sums their
+ * counters into its own stats
+ */
+
+#define SHARD_MAX 64
+
+struct shard {
+	char **argv; /* worker command line, set by the caller */
+	char stats_path[512]; /* the worker -S, set by the caller */
+	struct subprocess sp[1];
+	int cpu; /* pinned to, -1 if not */
+	long long bytes; /* sink.N.written_bytes summed, last read */
+	long long rotations; /* rotate.count, last read */
+	long long rate; /* bytes per second, smoothed */
+	long long migrations;
+	int done; /* exited and reaped */
+};
+
+/* spawn the workers and supervise them until they are all gone, our
+ * stdin goes to the first one and EOF on it stops them all, cpus are
+ * the ones to spread workers over (all we may run on if ncpus is 0),
+ * stats_path may be NULL
+ *
+ * 0 if every worker exited with 0, -1 otherwise
+ */
+int shard_run(struct shard *shards, int n, const int *cpus, int ncpus, const char *stats_path);
+
+#endif /* !nk5rj8wq2xe0tz6fvm shard-h */
@@ -0,0 +1,148 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "debug0.h"
+#include "str.h"
+#include "item.h"
+#include "subprocess.h"
+
+#include "stats.h"
+
+DEFINE_ITEM(stats_item,
+	    struct str name[1];
+	    long long value;
+  );
+
+static struct stats_item *items = NULL; /* newest first */
+static struct str_arena *scratch = NULL; /* stats_dump() strings, reset every time */
+
+#define SCRATCH_SIZE 0x10000 /* 65536 */
+
+static int write_exact(int fd, void *buf, int len)
+{
+	int i, wrote = 0;
+	do {
+		if ((i = write(fd, buf + wrote, len - wrote)) <= 0) return i;
+		wrote += i;
+	} while (wrote < len);
+	return len;
+}
+
+long long *stats_counter(const char *fmt, ...)
+{
+	struct stats_item *x;
+	DEFINE_STR(name);
+	va_list va;
+
+	va_start(va, fmt);
+	str_vformat(name, 0, fmt, va);
+	va_end(va);
+
+	for (x = items; x; x = x->tail) {
+		if (str_diff(x->name, name) == 0) {
+			str_free(name);
+			return &x->value;
+		}
+	}
+
+	items = stats_item_new0(items);
+	*items->name = *name; /* take ownership */
+
+	return &items->value;
+}
+
+int stats_dump(const char *path)
+{
+	int fd, r;
+	struct stats_item **v;
+	DEFINE_STR(tmp_path);
+	DEFINE_STR(data);
+
+	if (scratch == NULL) {
+		scratch = str_arena_new(SCRATCH_SIZE);
+	}
+	str_arena_reset(scratch);
+	tmp_path->arena = scratch;
+	data->arena = scratch;
+
+	/* oldest first, so the output order is stable
+	 */
+	if ((v = stats_item_as_array(items))) {
+		int i;
+		for (i = 0; i < stats_item_len(items); i++) {
+			str_catf(data, "%s %lli\n", v[i]->name->s, v[i]->value);
+		}
+		alloc_free(ALLOC_ITEM, v);
+	} else {
+		str_copyz(data, "");
+	}
+
+	str_copyz(tmp_path, path);
+	str_catz(tmp_path, ".tmp");
+
+	if ((fd = open(tmp_path->s, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		int save_errno = errno;
+		DEBUG("open(tmp_path=[%s]), errno=%i", tmp_path->s, save_errno);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+	if (write_exact(fd, data->s, data->len) != data->len) {
+		int save_errno = errno;
+		DEBUG("writing stats [%s], errno=%i", tmp_path->s, save_errno);
+		close(fd);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+	assert(close(fd) == 0);
+
+	if ((r = rename(tmp_path->s, path))) {
+		int save_errno = errno;
+		assert(r == -1);
+		DEBUG("rename(tmp_path=[%s], path=[%s]), errno=%i", tmp_path->s, path, save_errno);
+		str_free(tmp_path);
+		str_free(data);
+		errno = save_errno;
+		return -1;
+	}
+
+	str_free(tmp_path);
+	str_free(data);
+
+	return 0;
+}
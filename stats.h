@@ -0,0 +1,17 @@
+#ifndef nzb4p3zik5ywy59hm1 /* stats-h */
+#define nzb4p3zik5ywy59hm1 /* stats-h */
+
+/* named counters, dumped as "name value" lines to a file that is
+ * replaced atomically, so it can be polled by monitoring
+ */
+
+/* returns the counter (created on first use, starting at zero), the
+ * address is stable, callers in hot paths should keep it
+ */
+long long *stats_counter(const char *fmt, ...) __attribute__ ((format (printf, 1, 2)));
+
+/* 0 on success, -1 on error and errno is set appropriately
+ */
+int stats_dump(const char *path);
+
+#endif /* !nzb4p3zik5ywy59hm1 stats-h */
@@ -32,34 +32,221 @@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define STR_SIMD_X86
+#endif
+
+#include "alloc.h"
 #include "str.h"
 
 #define FATAL(msg) do {fprintf(stderr, "fatal:%s:%i:%s\n", __FILE__, __LINE__, msg); exit(1);} while (0)
 
 static void *realloc_(void *x, int m, int n)
 {
-  void *y = malloc(n);
+  void *y = alloc_malloc(ALLOC_STR, n);
   if (!y) return NULL;
   memcpy(y, x, m);
-  free(x);
+  alloc_free(ALLOC_STR, x);
   return y;
 }
 
+/* simd
+ *
+ * byte scans go 32 (AVX2, when the cpu has it) or 16 (SSE2) bytes at
+ * a time, never reading past the end, the tail goes byte by byte,
+ * each vector loop returns a match or -1 with *i where it stopped
+ */
+
+#ifdef STR_SIMD_X86
+
+static int has_avx2()
+{
+  static int r = -1;
+  if (r < 0) {
+    __builtin_cpu_init();
+    r = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+  return r;
+}
+
+__attribute__((target("avx2")))
+static int find_byte_avx2(const char *s, int n, int c, int *i)
+{
+  __m256i v = _mm256_set1_epi8(c);
+  for (; *i + 32 <= n; *i += 32) {
+    unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + *i)), v));
+    if (m) return *i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+static int find_byte_sse2(const char *s, int n, int c, int *i)
+{
+  __m128i v = _mm_set1_epi8(c);
+  for (; *i + 16 <= n; *i += 16) {
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + *i)), v));
+    if (m) return *i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+#define FIND_ANY_SIMD_MAX 8 /* set bytes compared one by one per vector */
+
+__attribute__((target("avx2")))
+static int find_any_avx2(const char *s, int n, const char *set, int nset, int *i)
+{
+  __m256i v[FIND_ANY_SIMD_MAX];
+  int k;
+  for (k = 0; k < nset; k++) v[k] = _mm256_set1_epi8(set[k]);
+  for (; *i + 32 <= n; *i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(s + *i));
+    __m256i eq = _mm256_cmpeq_epi8(x, v[0]);
+    unsigned m;
+    for (k = 1; k < nset; k++) eq = _mm256_or_si256(eq, _mm256_cmpeq_epi8(x, v[k]));
+    if ((m = _mm256_movemask_epi8(eq))) return *i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+static int find_any_sse2(const char *s, int n, const char *set, int nset, int *i)
+{
+  __m128i v[FIND_ANY_SIMD_MAX];
+  int k;
+  for (k = 0; k < nset; k++) v[k] = _mm_set1_epi8(set[k]);
+  for (; *i + 16 <= n; *i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(s + *i));
+    __m128i eq = _mm_cmpeq_epi8(x, v[0]);
+    unsigned m;
+    for (k = 1; k < nset; k++) eq = _mm_or_si128(eq, _mm_cmpeq_epi8(x, v[k]));
+    if ((m = _mm_movemask_epi8(eq))) return *i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+__attribute__((target("avx2")))
+static int count_byte_avx2(const char *s, int n, int c, int *i)
+{
+  __m256i v = _mm256_set1_epi8(c);
+  int r = 0;
+  for (; *i + 32 <= n; *i += 32) {
+    r += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(s + *i)), v)));
+  }
+  return r;
+}
+
+static int count_byte_sse2(const char *s, int n, int c, int *i)
+{
+  __m128i v = _mm_set1_epi8(c);
+  int r = 0;
+  for (; *i + 16 <= n; *i += 16) {
+    r += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + *i)), v)));
+  }
+  return r;
+}
+
+__attribute__((target("avx2")))
+static int mismatch_avx2(const char *a, const char *b, int n, int *i)
+{
+  for (; *i + 32 <= n; *i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(a + *i));
+    __m256i y = _mm256_loadu_si256((const __m256i *)(b + *i));
+    unsigned m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+    if (m) return *i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+static int mismatch_sse2(const char *a, const char *b, int n, int *i)
+{
+  for (; *i + 16 <= n; *i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(a + *i));
+    __m128i y = _mm_loadu_si128((const __m128i *)(b + *i));
+    unsigned m = ~_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+    if (m) return *i + __builtin_ctz(m);
+  }
+  return -1;
+}
+
+#endif
+
+/* index of c in s[0..n), -1 if not there
+ */
+static int find_byte(const char *s, int n, int c)
+{
+  int i = 0;
+#ifdef STR_SIMD_X86
+  int r;
+  if (n >= 32 && has_avx2() && (r = find_byte_avx2(s, n, c, &i)) >= 0) return r;
+  if ((r = find_byte_sse2(s, n, c, &i)) >= 0) return r;
+#endif
+  for (; i < n; i++) {
+    if (s[i] == (char)c) return i;
+  }
+  return -1;
+}
+
+/* index of the first byte of s[0..n) found in set[0..nset), -1 if none
+ */
+static int find_any(const char *s, int n, const char *set, int nset)
+{
+  unsigned char map[256];
+  int i = 0, k;
+  if (nset == 0) return -1;
+  if (nset == 1) return find_byte(s, n, set[0]);
+#ifdef STR_SIMD_X86
+  if (nset <= FIND_ANY_SIMD_MAX) {
+    int r;
+    if (n >= 32 && has_avx2() && (r = find_any_avx2(s, n, set, nset, &i)) >= 0) return r;
+    if ((r = find_any_sse2(s, n, set, nset, &i)) >= 0) return r;
+  }
+#endif
+  memset(map, 0, sizeof(map));
+  for (k = 0; k < nset; k++) map[(unsigned char)set[k]] = 1;
+  for (; i < n; i++) {
+    if (map[(unsigned char)s[i]]) return i;
+  }
+  return -1;
+}
+
+static int count_byte(const char *s, int n, int c)
+{
+  int i = 0, r = 0;
+#ifdef STR_SIMD_X86
+  if (n >= 32 && has_avx2()) r += count_byte_avx2(s, n, c, &i);
+  r += count_byte_sse2(s, n, c, &i);
+#endif
+  for (; i < n; i++) {
+    if (s[i] == (char)c) r++;
+  }
+  return r;
+}
+
+/* first index where a and b differ, n if they don't
+ */
+static int mismatch(const char *a, const char *b, int n)
+{
+  int i = 0;
+#ifdef STR_SIMD_X86
+  int r;
+  if (n >= 32 && has_avx2() && (r = mismatch_avx2(a, b, n, &i)) >= 0) return r;
+  if ((r = mismatch_sse2(a, b, n, &i)) >= 0) return r;
+#endif
+  for (; i < n; i++) {
+    if (a[i] != b[i]) return i;
+  }
+  return n;
+}
+
 static int bdiff(const void *s, int n, const void *t)
 {
   const char *x=s;
   const char *y=t;
-  for (;;) {
-    if (!n)
-      return 0;
-    if (*x != *y)
-      break;
-    ++x;
-    ++y;
-    --n;
-  }
-  return ((int)(unsigned char)*x)
-    - ((int)(unsigned char)*y);
+  int i = mismatch(x, y, n);
+  if (i == n)
+    return 0;
+  return ((int)(unsigned char)x[i])
+    - ((int)(unsigned char)y[i]);
 }
 
 static void bcopyl(void *to, int n, const void *from)
@@ -106,11 +293,116 @@ static int sdiffn(const char *s, const char *t, int len)
     - ((int)(unsigned char)*t);
 }
 
+/* arena
+ */
+
+struct str_arena_block {
+  struct str_arena_block *next;
+  int size;
+  int used;
+  char data[];
+};
+
+struct str_arena {
+  struct str_arena_block *blocks; /* current first */
+  int block_size;
+};
+
+#define ARENA_ALIGN(n) (((n) + 7) & ~7)
+
+struct str_arena *str_arena_new(int block_size)
+{
+  struct str_arena *x = alloc_calloc(ALLOC_STR, 1, sizeof(struct str_arena));
+  assert(x);
+  x->block_size = ARENA_ALIGN(block_size);
+  return x;
+}
+
+static void arena_block_list_free(struct str_arena_block *b)
+{
+  while (b) {
+    struct str_arena_block *t = b->next;
+    alloc_free(ALLOC_STR, b);
+    b = t;
+  }
+}
+
+void str_arena_reset(struct str_arena *x)
+{
+  struct str_arena_block *keep = NULL, *b = x->blocks;
+  while (b) {
+    struct str_arena_block *t = b->next;
+    if (keep == NULL && b->size == x->block_size) {
+      keep = b;
+      keep->next = NULL;
+      keep->used = 0;
+    } else {
+      alloc_free(ALLOC_STR, b);
+    }
+    b = t;
+  }
+  x->blocks = keep;
+}
+
+void str_arena_free(struct str_arena *x)
+{
+  if (x) {
+    arena_block_list_free(x->blocks);
+    alloc_free(ALLOC_STR, x);
+  }
+}
+
+static void *arena_alloc(struct str_arena *x, int n)
+{
+  struct str_arena_block *b = x->blocks;
+  char *p;
+  n = ARENA_ALIGN(n);
+  if (b == NULL || b->size - ARENA_ALIGN(b->used) < n) {
+    int size = n > x->block_size ? n : x->block_size;
+    b = alloc_malloc(ALLOC_STR, sizeof(struct str_arena_block) + size);
+    if (!b) FATAL("memory allocation failed");
+    b->size = size;
+    b->used = 0;
+    b->next = x->blocks;
+    x->blocks = b;
+  }
+  b->used = ARENA_ALIGN(b->used);
+  p = b->data + b->used;
+  b->used += n;
+  return p;
+}
+
+/* the last string of the current block grows in place
+ */
+static void arena_str_alloc(struct str *x, int n)
+{
+  struct str_arena_block *b = x->arena->blocks;
+  int i = ARENA_ALIGN(n + (n >> 3) + 30);
+  char *p;
+  if (x->s && b && x->s + x->a == b->data + b->used && b->size - b->used >= i - x->a) {
+    b->used += i - x->a;
+    x->a = i;
+    return;
+  }
+  p = arena_alloc(x->arena, i);
+  if (x->s) {
+    memcpy(p, x->s, x->len);
+  } else {
+    x->len = 0;
+  }
+  x->s = p;
+  x->a = i;
+}
+
 /* alloc/free
  */
 
 void str_alloc(struct str *x, int n)
 {
+  if (x->arena) {
+    if (x->s == NULL || n > x->a) arena_str_alloc(x, n);
+    return;
+  }
   if (x->s) {
     if (n > x->a) {
       int i = n + (n >> 3) + 30;
@@ -124,7 +416,7 @@ void str_alloc(struct str *x, int n)
     }
     return;
   }
-  x->s = malloc(n);
+  x->s = alloc_malloc(ALLOC_STR, n);
   assert(x->s);
   x->a = n;
   x->len = 0;
@@ -137,7 +429,8 @@ void str_free(struct str *x)
     x->s = NULL;
     x->len = 0;
     x->a = 0;
-    free(p);
+    if (x->arena) return; /* released with it */
+    alloc_free(ALLOC_STR, p);
     p = NULL;
   }
 }
@@ -224,21 +517,21 @@ void str_vformat(struct str *sa, int cat, const char *fmt, va_list va)
     /* truncated, try with more space
      */
     buf_len = 0xffff + 1/* 64K */;
-    assert((buf = malloc(buf_len)) != NULL);
+    assert((buf = alloc_malloc(ALLOC_STR, buf_len)) != NULL);
     assert((n = vsnprintf(buf, buf_len, fmt, va)) >= 0);
     if (n >= buf_len) {
-      free(buf);
+      alloc_free(ALLOC_STR, buf);
       buf_len = 0xfffff + 1 /* 1M */;
-      assert((buf = malloc(buf_len)) != NULL);
+      assert((buf = alloc_malloc(ALLOC_STR, buf_len)) != NULL);
       assert((n = vsnprintf(buf, buf_len, fmt, va)) >= 0);
       if (n >= buf_len) {
-        free(buf);
+        alloc_free(ALLOC_STR, buf);
         buf_len = 0xffffff + 1; /* 16M ! */
-        assert((buf = malloc(buf_len)) != NULL);
+        assert((buf = alloc_malloc(ALLOC_STR, buf_len)) != NULL);
         assert((n = vsnprintf(buf, buf_len, fmt, va)) >= 0);
         if (n >= buf_len) {
           /* give up */
-          free(buf);
+          alloc_free(ALLOC_STR, buf);
           fprintf(stderr, "error: str_vformat(): too large input (> %i)\n", 0xffffff + 1);
           exit(1);
         }
@@ -255,7 +548,7 @@ void str_vformat(struct str *sa, int cat, const char *fmt, va_list va)
   }
 
   if (buf && buf != buf0) {
-    free(buf);
+    alloc_free(ALLOC_STR, buf);
   }
 #else
   int n;
@@ -314,21 +607,21 @@ void str_formattime(struct str *sa, int cat, const char *fmt, struct tm *tm)
     /* try with more space
      */
     buf_len = 0x1fff + 1 /* 8192 */;
-    assert((buf = malloc(buf_len)) != NULL);
+    assert((buf = alloc_malloc(ALLOC_STR, buf_len)) != NULL);
     n = strftime(buf, buf_len, fmt, tm);
     if (n == 0 || n >= buf_len) {
-      free(buf);
+      alloc_free(ALLOC_STR, buf);
       buf_len = 0xffff + 1 /* 64K */;
-      assert((buf = malloc(buf_len)) != NULL);
+      assert((buf = alloc_malloc(ALLOC_STR, buf_len)) != NULL);
       n = strftime(buf, buf_len, fmt, tm);
       if (n == 0 || n >= buf_len) {
-        free(buf);
+        alloc_free(ALLOC_STR, buf);
         buf_len = 0xfffff + 1; /* 1M */
-        assert((buf = malloc(buf_len)) != NULL);
+        assert((buf = alloc_malloc(ALLOC_STR, buf_len)) != NULL);
         n = strftime(buf, buf_len, fmt, tm);
         if (n == 0 || n >= buf_len) {
           /* give up */
-          free(buf);
+          alloc_free(ALLOC_STR, buf);
           fprintf(stderr, "error: str_vformattime(): too large input (> %i)\n", 0xfffff + 1);
           exit(1);
         }
@@ -345,7 +638,7 @@ void str_formattime(struct str *sa, int cat, const char *fmt, struct tm *tm)
   }
 
   if (buf && buf != buf0) {
-    free(buf);
+    alloc_free(ALLOC_STR, buf);
   }
 }
 
@@ -552,3 +845,212 @@ int str_is_empty(struct str *x)
 {
   return str_len(x) == 0;
 }
+
+/* views
+ */
+
+void strview_init(struct strview *v, const char *s, int len)
+{
+  v->s = s;
+  v->len = len;
+}
+
+void strview_of(struct strview *v, const struct str *x)
+{
+  v->s = x->s;
+  v->len = x->s ? x->len : 0;
+}
+
+void strview_ofz(struct strview *v, const char *z)
+{
+  v->s = z;
+  v->len = strlen(z);
+}
+
+void strview_slice(struct strview *r, const struct strview *v, int start, int end)
+{
+  if (end < 0) end = v->len + end + 1;
+  if (end > v->len) end = v->len;
+  if (start < 0) start = 0;
+  if (start > end) start = end;
+  r->s = v->s + start;
+  r->len = end - start;
+}
+
+int strview_find_byte(const struct strview *v, int c)
+{
+  return find_byte(v->s, v->len, c);
+}
+
+int strview_find_any(const struct strview *v, const char *set)
+{
+  return find_any(v->s, v->len, set, strlen(set));
+}
+
+int strview_find(const struct strview *v, const struct strview *needle)
+{
+  int i = 0;
+  if (needle->len == 0) return 0;
+  while (v->len - i >= needle->len) {
+    int j = find_byte(v->s + i, v->len - i - needle->len + 1, needle->s[0]);
+    if (j < 0) return -1;
+    i += j;
+    if (mismatch(v->s + i, needle->s, needle->len) == needle->len) return i;
+    i++;
+  }
+  return -1;
+}
+
+int strview_count_byte(const struct strview *v, int c)
+{
+  return count_byte(v->s, v->len, c);
+}
+
+int strview_diff(const struct strview *a, const struct strview *b)
+{
+  int n = a->len < b->len ? a->len : b->len;
+  int y = bdiff(a->s, n, b->s);
+  if (y) return y;
+  return a->len > b->len ? 1 : a->len < b->len ? -1 : 0;
+}
+
+int strview_equal(const struct strview *a, const struct strview *b)
+{
+  return a->len == b->len && mismatch(a->s, b->s, a->len) == a->len;
+}
+
+int strview_split(struct strview *v, int c, struct strview *token)
+{
+  int i;
+  if (v->s == NULL) return 0;
+  token->s = v->s;
+  if ((i = find_byte(v->s, v->len, c)) < 0) {
+    token->len = v->len;
+    v->s = NULL; /* no delimiter left, this was the last one */
+    v->len = 0;
+    return 1;
+  }
+  token->len = i;
+  v->s += i + 1;
+  v->len -= i + 1;
+  return 1;
+}
+
+int strview_tokenize(struct strview *v, const char *set, struct strview *token)
+{
+  int nset = strlen(set), i;
+  while (v->len && memchr(set, v->s[0], nset)) {
+    v->s++;
+    v->len--;
+  }
+  if (v->len == 0) return 0;
+  token->s = v->s;
+  if ((i = find_any(v->s, v->len, set, nset)) < 0) i = v->len;
+  token->len = i;
+  v->s += i;
+  v->len -= i;
+  return 1;
+}
+
+void str_copyview(struct str *sa, const struct strview *v)
+{
+  str_copyn(sa, v->s, v->len);
+}
+
+void str_catview(struct str *sa, const struct strview *v)
+{
+  str_catn(sa, v->s, v->len);
+}
+
+/* line framer
+ */
+
+void strframer_init(struct strframer *x, int line_max, void (*line)(void *ctx, const char *p, int len), void *ctx)
+{
+  memset(x, 0, sizeof(*x));
+  x->line = line;
+  x->ctx = ctx;
+  x->line_max = line_max;
+}
+
+void strframer_free(struct strframer *x)
+{
+  int i;
+  for (i = 0; i < STRFRAMER_SOURCES; i++) {
+    str_free(x->sources[i].line);
+  }
+}
+
+/* the partial line goes as is, returns its length
+ */
+static int strframer_take(struct strframer *x, struct strframer_source *k)
+{
+  int n = k->line->len;
+  if (n) {
+    x->line(x->ctx, k->line->s, n);
+    k->line->len = 0;
+  }
+  return n;
+}
+
+struct strframer_source *strframer_source(struct strframer *x, unsigned long long id)
+{
+  struct strframer_source *k = x->sources;
+  int i;
+  for (i = 0; i < STRFRAMER_SOURCES; i++) {
+    if (x->sources[i].id == id && x->sources[i].used) {
+      k = x->sources + i;
+      break;
+    }
+    if (x->sources[i].used < k->used) {
+      k = x->sources + i;
+    }
+  }
+  if (k->id != id || k->used == 0) {
+    strframer_take(x, k);
+    k->id = id;
+    k->end = 0;
+  }
+  k->used = ++x->uses;
+  return k;
+}
+
+int strframer_feed(struct strframer *x, unsigned long long id, const char *p, int len)
+{
+  struct strframer_source *k = strframer_source(x, id);
+  struct strview v[1];
+  int i;
+
+  strview_init(v, p, len);
+
+  if (k->line->len && (i = find_byte(v->s, v->len, '\n')) >= 0) {
+    str_catn(k->line, v->s, i + 1);
+    strframer_take(x, k);
+    strview_slice(v, v, i + 1, -1);
+  }
+  if (k->line->len == 0) {
+    while ((i = find_byte(v->s, v->len, '\n')) >= 0) {
+      x->line(x->ctx, v->s, i + 1);
+      strview_slice(v, v, i + 1, -1);
+    }
+  }
+  if (v->len) {
+    str_catn(k->line, v->s, v->len);
+    if (k->line->len > x->line_max) {
+      strframer_take(x, k);
+    }
+  }
+  return k->line->len;
+}
+
+int strframer_flush(struct strframer *x, unsigned long long id, int all)
+{
+  int i, n = 0;
+  for (i = 0; i < STRFRAMER_SOURCES; i++) {
+    struct strframer_source *k = x->sources + i;
+    if (k->used && (all || k->id == id)) {
+      n += strframer_take(x, k);
+    }
+  }
+  return n;
+}
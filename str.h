@@ -13,18 +13,32 @@ extern "C" { /* assume C declarations for C++ */
 #define __attribute__(x)
 #endif
 
+struct str_arena;
+
 struct str {
   char *s;
   int len; /* can be changed between 0 and a-1 (inclusive) to truncate string */
   int a; /* allocated */
+  struct str_arena *arena; /* NULL if s is from the heap */
 };
 
-#define NULL_STR {NULL, 0, 0}
+#define NULL_STR {NULL, 0, 0, NULL}
 #define DEFINE_STR(sym) struct str sym[1] = {NULL_STR}
+#define DEFINE_STR_ARENA(sym, arena) struct str sym[1] = {{NULL, 0, 0, arena}}
 
 void str_alloc(struct str *x, int n);
 void str_free(struct str *x);
 
+/* arena: strings of a scope bump-allocated from blocks, released all
+ * together, str_free() on them only forgets the buffer
+ *
+ * str_arena_reset() releases them but keeps a block, so a scope that
+ * runs over and over (say, once a second) stops allocating
+ */
+struct str_arena *str_arena_new(int block_size);
+void str_arena_reset(struct str_arena *x);
+void str_arena_free(struct str_arena *x);
+
 void str_copyn(struct str *, const char *, int);
 void str_copy(struct str *, const struct str *);
 void str_copyz(struct str *, const char *);
@@ -67,6 +81,90 @@ void str_shiftl2(struct str *s, int start, int n, int pad);
 
 void str_from_file(struct str *s, const char *file);
 
+/* views: a slice of someone else's memory, nothing is copied or
+ * owned, nor null terminated, the scans (find, count, compare) use
+ * SSE2/AVX2 where available
+ */
+
+struct strview {
+  const char *s;
+  int len;
+};
+
+void strview_init(struct strview *v, const char *s, int len);
+void strview_of(struct strview *v, const struct str *x);
+void strview_ofz(struct strview *v, const char *z);
+
+/* start .. end (exclusive, -1 means len), clamped to v
+ */
+void strview_slice(struct strview *r, const struct strview *v, int start, int end);
+
+/* index or -1
+ */
+int strview_find_byte(const struct strview *v, int c);
+int strview_find_any(const struct strview *v, const char *set);
+int strview_find(const struct strview *v, const struct strview *needle);
+
+int strview_count_byte(const struct strview *v, int c);
+
+int strview_diff(const struct strview *a, const struct strview *b);
+int strview_equal(const struct strview *a, const struct strview *b);
+
+/* token is v up to the next c, v moves past it, "a,,b" gives "a", ""
+ * and "b", returns 0 once v is exhausted
+ */
+int strview_split(struct strview *v, int c, struct strview *token);
+
+/* token is the next run of bytes not in set, empty ones are skipped,
+ * returns 0 when there is none
+ */
+int strview_tokenize(struct strview *v, const char *set, struct strview *token);
+
+void str_copyview(struct str *sa, const struct strview *v);
+void str_catview(struct str *sa, const struct strview *v);
+
+/* line framer: data of several sources (by id, an inode say) cut into
+ * lines, each one (with its '\n') goes to line(), a whole one as a view
+ * into the data fed, the one cut by a call boundary from the partial
+ * line kept for its source
+ *
+ * a partial line past line_max goes as is, so does the one of the
+ * source fed least recently when all STRFRAMER_SOURCES are taken
+ */
+
+#define STRFRAMER_SOURCES 4 /* stdin and two files, and one spare */
+
+struct strframer_source {
+  unsigned long long id;
+  long long used; /* the source fed last, for eviction, 0 if free */
+  long long end; /* the caller's, say the source offset past the line */
+  struct str line[1]; /* partial */
+};
+
+struct strframer {
+  void (*line)(void *ctx, const char *p, int len);
+  void *ctx;
+  int line_max;
+  long long uses;
+  struct strframer_source sources[STRFRAMER_SOURCES];
+};
+
+void strframer_init(struct strframer *x, int line_max, void (*line)(void *ctx, const char *p, int len), void *ctx);
+void strframer_free(struct strframer *x);
+
+/* the source of id, taken (and a partial line evicted) if new
+ */
+struct strframer_source *strframer_source(struct strframer *x, unsigned long long id);
+
+/* returns the partial line length of id after p
+ */
+int strframer_feed(struct strframer *x, unsigned long long id, const char *p, int len);
+
+/* the partial line of id (of every source if all) goes as is, the
+ * source is done, returns the bytes that went
+ */
+int strframer_flush(struct strframer *x, unsigned long long id, int all);
+
 void str_formattime(struct str *sa, int cat, const char *fmt, struct tm *tm);
 void str_copyftime(struct str *sa, const char *fmt, struct tm *tm);
 void str_catftime(struct str *sa, const char *fmt, struct tm *tm);
@@ -22,6 +22,8 @@ OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
 ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#define _GNU_SOURCE /* pipe2(2), posix_spawn_file_actions_addclosefrom_np(3), P_PIDFD */
+
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -35,30 +37,23 @@ ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <unistd.h>
 #include <stdarg.h>
 #include <time.h>
+#include <spawn.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
 
 //#define NO_DEBUG
 #include "debug0.h"
-#include "dict.h"
+#include "timer.h"
+#include "probes.h"
 
 #include "subprocess.h"
 
-//#define DEBUG_INFO_ENABLED
-
-#ifndef DEBUG_INFO_ENABLED
-#  if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L
-#    define DEBUG_INFO(...)	    //
-#  elif defined (__GNUC__)
-#    define DEBUG_INFO(format...)   //
-#  endif
-#else
-#  define DEBUG_INFO DEBUG
-#endif
-
 #define USE_CLOCK_GETTIME
 #define MAX_WAIT_SUBPROCESS_EINTR_COUNT 25
 
-#define DELTA_USEC(a,b) (((a)->tv_sec - (b)->tv_sec) * 1000000 + (a)->tv_usec - (b)->tv_usec)
-#define DELTA_MSEC(a,b) (DELTA_USEC(a,b) / 1000)
 
 int make_fd_non_blocking(int fd)
 {
@@ -98,70 +93,6 @@ static int xclose(int fd)
 #define xclose close
 #endif
 
-/* children/child dictionary
- */
-
-DEFINE_DICT(children, child,
-	    struct subprocess *sp;
-  );
-
-struct child *child_new(struct subprocess *sp)
-{
-	struct child *c = child_new0();
-	assert(c);
-	c->sp = sp;
-	return c;
-}
-
-void child_free(struct child * x)
-{
-	if (x) {
-		x->sp->is_gone = 1;
-		child_free0(x);
-	}
-}
-
-int child_cmp(struct child *a, struct child *b)
-{
-	return a->sp->pid - b->sp->pid;
-}
-
-int child_cmp_by_pid(int a, struct child *b)
-{
-	return a - b->sp->pid;
-}
-
-struct child *children_search_by_pid(struct children * rbtree, int key)
-{
-	struct child *ret;
-	int cmp;
-	ret = rbtree->rbt_root;
-	while (ret != &rbtree->rbt_nil && (cmp = child_cmp_by_pid(key, ret)) != 0) {
-		if (cmp < 0) {
-			ret = rbtn_left_get(struct child, _meta, ret);
-		} else {
-			ret = rbtn_right_get(struct child, _meta, ret);
-		}
-	}
-	if (ret == &rbtree->rbt_nil) {
-		ret = NULL;
-	}
-	return ret;
-}
-
-void children_free(struct children * x)
-{
-    if (x) {
-	struct child *c, *n;
-	for (c = children_first(x); c; c = n) {
-	    n = children_next(x, c);
-	    children_remove(x, c);
-	    child_free(c);
-	}
-	free(x);
-    }
-}
-
 /*
  */
 
@@ -177,135 +108,57 @@ void get_current_timeval(struct timeval *tv)
 #endif
 }
 
-static int write_exact(int fd, void *buf, int len)
-{
-	int i, wrote = 0;
-	do {
-		if ((i = write(fd, buf + wrote, len - wrote)) <= 0) {
-			return i;
-		}
-		wrote += i;
-	} while (wrote < len);
-	return len;
-}
-
 #define MAX2(a, b) ((a) >= (b) ? (a) : (b))
 #define MAX3(a, b, c) MAX2(MAX2(a, b), c)
 
-static int selfpipe[2] = {-1, -1};
-static struct children *subprocesses = NULL;
-static volatile sig_atomic_t got_SIGCHLD = 0;
-static sigset_t sigset_SIGCHLD[1];
-
-int subprocess_get_selfpipe_read_fd()
-{
-	return selfpipe[0];
-}
-
-#define DEC_DIGIT(v) ((v) >= 0 && (v) < 10 ? "0123456789"[v] : '?')
-
-/* will fill 11 octets starting from s-1 (strrchr() compatible) and
- * going backwards
- */
-static void backfill_u4_dec(char *s, int v, int pad)
-{
-	char *r = s - 11;
-	assert(s);
-	if (v > 0) {
-		while (v) {
-			*--s = DEC_DIGIT(v % 10);
-			v = v / 10;
-		}
-	} else if (v < 0) {
-		unsigned int x = -v;
-		while (x) {
-			*--s = DEC_DIGIT(x % 10);
-			x = x / 10;
-		}
-		*--s = '-';
-	} else {
-		*--s = '0';
-	}
-	while (r < s) {
-		*--s = pad;
-	}
-}
-
-/*
- * please read `man 7 signal' in `Async-signal-safe functions' prior
- * to changing the handler below
+/* child tracker
  *
- * in stress tests, we were able to write 16384 signals before
- * blocking, a clear indication that a pipe (in linux 2.6) has a 65536
- * byte buffer, cool, lots of data
- *
- * reference: http://www.cs.utah.edu/dept/old/texinfo/glibc-manual-0.02/library_21.html
+ * every child gets a pidfd (linux >= 5.3), it turns readable when the
+ * child exits, all of them are registered in a single epoll fd, so
+ * the event loop has one fd to check and the child gone is found in
+ * O(1) (the epoll event points to its struct subprocess), there is no
+ * SIGCHLD handler at all, so no EINTR in anybody's select
  *
+ * without pidfd_open, SIGCHLD is blocked and read from a signalfd
+ * registered in the same epoll fd, the live children are then checked
+ * with waitid(WNOWAIT) (signals coalesce, so all of them are checked)
  */
-static void sigaction_SIGCHLD(int n, siginfo_t *si, void *vp)
-{
-	char msg[] = "sigaction_SIGCHLD(), pid_gone=-1234567890\n";
-
-	//assert(sizeof(si->si_pid) == sizeof(int));
-
-	backfill_u4_dec(msg + sizeof(msg) - 2 /* "\n\0" */, si->si_pid, ' ');
-	write_exact(STDERR_FILENO, msg, sizeof(msg) - 1);
 
-	if (selfpipe[1] != -1) {
-		int r = write(selfpipe[1], (void*)&si->si_pid, sizeof(si->si_pid));
-		if (r == -1 && errno == EAGAIN) {
-			char msg[] = "sigaction_SIGCHLD(), pipe buffer is full, drained -1234567890 bytes\n";
-			char buf[4096];
-			r = read(selfpipe[0], buf, sizeof(buf));
-			backfill_u4_dec(msg + sizeof(msg) - 8 /* " bytes\n\0" */, r, ' ');
-			write_exact(STDERR_FILENO, msg, sizeof(msg) - 1);
-		}
-	}
+static int tracker_fd = -1;
+static int tracker_sigfd = -1;
+static struct subprocess *tracked = NULL; /* live children */
+static sigset_t sigset_SIGCHLD[1];
 
-	got_SIGCHLD = 1;
+static int xpidfd_open(int pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
 }
 
-#if 0
-/* returns 0 if signal handler was reseted
- */
-static int reset_signal_handlers()
+int subprocess_get_selfpipe_read_fd()
 {
-	struct sigaction act[1];
-	memset(act, 0, sizeof(act));
-	sigaction(SIGCHLD, NULL, act);
-	if (act->sa_sigaction || act->sa_handler) {
-		memset(act, 0, sizeof(act));
-		sigaction(SIGCHLD, act, NULL);
-
-		assert(selfpipe[0] != -1);
-		assert(selfpipe[1] != -1);
-
-		assert(xclose(selfpipe[1]) == 0);
-		selfpipe[1] = -1;
-
-		assert(xclose(selfpipe[0]) == 0);
-		selfpipe[0] = -1;
-
-		return 0;
-	}
-	return 1;
+	return tracker_fd;
 }
-#endif
 
-static int selfpipe_setup()
+static int tracker_setup()
 {
-	int r;
-	static struct sigaction act;
 	static struct sigaction pip;
+	struct epoll_event ev[1];
+	int fd;
 
-	if (selfpipe[0] != -1) {
+	if (tracker_fd != -1) {
 		/* already initialized
 		 */
-		DEBUG_INFO("selfpipe already setup");
+		DEBUG_INFO("tracker already setup");
 		return 0;
 	}
 
-	/* check if there is a signal already installed
+	/* a SIGCHLD handler would steal our children, and SIG_IGN
+	 * would reap them
 	 */
 
 	{
@@ -318,26 +171,29 @@ static int selfpipe_setup()
 	/* setup
 	 */
 
-	if ((r = xpipe(selfpipe))) {
-		int save_errno = errno;
-		assert(r == -1);
-		DEBUG("pipe(selfpipe), errno=%i", save_errno);
-		errno = save_errno;
-		perror("pipe(selfpipe)");
+	if ((tracker_fd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		perror("epoll_create1()");
 		abort();
 	}
 
-	assert(make_fd_non_blocking(selfpipe[0]) == 0);
-	assert(make_fd_non_blocking(selfpipe[1]) == 0);
-
-	/* SIGCHLD signal handling
-	 */
+	assert(sigemptyset(sigset_SIGCHLD) == 0);
+	assert(sigaddset(sigset_SIGCHLD, SIGCHLD) == 0);
 
-	memset(&act, 0, sizeof(act));
-	sigemptyset(&act.sa_mask);
-	act.sa_sigaction = sigaction_SIGCHLD;
-	act.sa_flags = SA_SIGINFO;
-	assert(sigaction(SIGCHLD, &act, NULL) == 0);
+	if ((fd = xpidfd_open(getpid())) >= 0) {
+		assert(xclose(fd) == 0);
+		DEBUG_INFO("tracking children with pidfds");
+	} else {
+		DEBUG_INFO("pidfd_open(), errno=%i, tracking children with a signalfd", errno);
+		assert(sigprocmask(SIG_BLOCK, sigset_SIGCHLD, NULL) == 0);
+		if ((tracker_sigfd = signalfd(-1, sigset_SIGCHLD, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+			perror("signalfd()");
+			abort();
+		}
+		memset(ev, 0, sizeof(ev));
+		ev->events = EPOLLIN;
+		ev->data.ptr = NULL;
+		assert(epoll_ctl(tracker_fd, EPOLL_CTL_ADD, tracker_sigfd, ev) == 0);
+	}
 
 	/* SIGPIPE signal handling
 	 */
@@ -347,55 +203,142 @@ static int selfpipe_setup()
 	pip.sa_handler = SIG_IGN;
 	assert(sigaction(SIGPIPE, &pip, NULL) == 0);
 
-	/* sigset_SIGCHLD
-	 */
+	return 0;
+}
 
-	assert(sigemptyset(sigset_SIGCHLD) == 0);
-	assert(sigaddset(sigset_SIGCHLD, SIGCHLD) == 0);
+static void tracker_add(struct subprocess *sp)
+{
+	assert(sp->pid > 0);
 
-	/*
-	 */
+	sp->pidfd = -1;
+	if (tracker_sigfd == -1) {
+		struct epoll_event ev[1];
+		/* the child may be gone already, but it is not reaped,
+		 * so the pid is still ours and the pidfd gets readable
+		 */
+		assert((sp->pidfd = xpidfd_open(sp->pid)) >= 0);
+		memset(ev, 0, sizeof(ev));
+		ev->events = EPOLLIN;
+		ev->data.ptr = sp;
+		assert(epoll_ctl(tracker_fd, EPOLL_CTL_ADD, sp->pidfd, ev) == 0);
+	}
 
-	subprocesses = children_new0();
-	assert(subprocesses);
+	sp->tracked_prev = NULL;
+	if ((sp->tracked_next = tracked)) {
+		tracked->tracked_prev = sp;
+	}
+	tracked = sp;
+}
 
-	return 0;
+/* the child is gone (not reaped yet), stop watching it
+ */
+static void tracker_gone(struct subprocess *sp)
+{
+	if (sp->is_gone) {
+		return;
+	}
+	DEBUG_INFO("child pid %i is gone", sp->pid);
+	if (sp->pidfd >= 0) {
+		assert(epoll_ctl(tracker_fd, EPOLL_CTL_DEL, sp->pidfd, NULL) == 0);
+	}
+	if (sp->tracked_prev) {
+		sp->tracked_prev->tracked_next = sp->tracked_next;
+	} else {
+		assert(tracked == sp);
+		tracked = sp->tracked_next;
+	}
+	if (sp->tracked_next) {
+		sp->tracked_next->tracked_prev = sp->tracked_prev;
+	}
+	sp->tracked_next = sp->tracked_prev = NULL;
+	sp->is_gone = 1;
 }
 
-void interrupt_safe_sleep(int msec)
+/* signalfd fallback, a SIGCHLD may stand for several children
+ */
+static void tracker_scan()
 {
+	struct signalfd_siginfo ssi[8];
+	struct subprocess *sp, *next;
+
+	while (read(tracker_sigfd, ssi, sizeof(ssi)) > 0)
+		;
+
+	for (sp = tracked; sp; sp = next) {
+		siginfo_t si;
+		next = sp->tracked_next;
+		memset(&si, 0, sizeof(si));
+		if (waitid(P_PID, sp->pid, &si, WEXITED | WNOHANG | WNOWAIT) == 0 && si.si_pid == sp->pid) {
+			tracker_gone(sp);
+		}
+	}
+}
+
+/* waitid() on the pidfd, it fills exit_status (waitpid(2) format) and
+ * waitpid_pid, returns the pid, or 0 if still running (WNOHANG)
+ */
+static int subprocess_reap(struct subprocess *sp, int options)
+{
+	siginfo_t si;
 	int r;
-	struct timeval start;
-	struct timeval current;
-	struct timeval tv;
-	long usec;
-	long dmsec;
 
-	get_current_timeval(&start);
+	memset(&si, 0, sizeof(si));
+	do {
+		if (sp->pidfd >= 0) {
+			r = waitid(P_PIDFD, sp->pidfd, &si, WEXITED | options);
+		} else {
+			r = waitid(P_PID, sp->pid, &si, WEXITED | options);
+		}
+	} while (r == -1 && errno == EINTR);
+	if (r == -1) {
+		DEBUG("waitid(pid=%i), errno=%i", sp->pid, errno);
+		return -1;
+	}
+	if (si.si_pid == 0) {
+		return 0;
+	}
 
-	DEBUG_INFO("interrupt_safe_sleep(%u)", msec);
+	assert(si.si_pid == sp->pid);
+	switch (si.si_code) {
+	case CLD_EXITED:
+		sp->exit_status = (si.si_status & 0xff) << 8;
+		break;
+	case CLD_DUMPED:
+		sp->exit_status = si.si_status | 0x80;
+		break;
+	default:
+		sp->exit_status = si.si_status & 0x7f;
+		break;
+	}
+	sp->waitpid_pid = si.si_pid;
 
-	tv.tv_sec = 0;
-	tv.tv_usec = msec * 1000;
-	r = select(0, NULL, NULL, NULL, &tv);
-	while (r < 0) {
-		assert(r == -1);
-		assert(errno == EINTR);
+	tracker_gone(sp);
+	if (sp->pidfd >= 0) {
+		assert(xclose(sp->pidfd) == 0);
+		sp->pidfd = -1;
+	}
 
-		get_current_timeval(&current);
-		if ((dmsec = DELTA_MSEC(&current, &start)) >= msec) {
+	return sp->pid;
+}
+
+void interrupt_safe_sleep(int msec)
+{
+	struct timeval tv;
+	long long start = timer_now_msec();
+	long long dmsec = 0;
+
+	DEBUG_INFO("interrupt_safe_sleep(%u)", msec);
+
+	do {
+		timer_msec_to_timeval(&tv, msec - dmsec);
+		if (select(0, NULL, NULL, NULL, &tv) == 0) {
 			break;
 		}
+		assert(errno == EINTR);
+		DEBUG_INFO("resuming interrupt safe sleep, %lli milliseconds to go, total %i", msec - dmsec, msec);
+	} while ((dmsec = timer_now_msec() - start) < msec);
 
-		DEBUG_INFO("resuming interrupt safe sleep, %li milliseconds to go, total %i", msec - dmsec, msec);
-		tv.tv_sec = 0;
-		tv.tv_usec = (msec - dmsec) * 1000;
-		r = select(0, NULL, NULL, NULL, &tv);
-	}
-
-	get_current_timeval(&current);
-	usec = DELTA_USEC(&current, &start);
-	DEBUG_INFO("%li milliseconds elapsed (%lu usecs)", usec / 1000, usec);
+	DEBUG_INFO("%lli milliseconds elapsed", timer_now_msec() - start);
 }
 
 void subprocess_close_child_fdin(struct subprocess *sp)
@@ -425,78 +368,36 @@ void subprocess_close_child_fderr(struct subprocess *sp)
 	}
 }
 
+static void terminating_reap();
+
 /* returns 0 on success
  */
-static int subprocess_read_selfpipe0()
+int subprocess_read_selfpipe()
 {
-	DEBUG_INFO("subprocess_read_selfpipe(): begin");
-	for (;;) {
-		char buf_selfpipe[10 * sizeof(int)]; /* maybe read 10 pids at a time */
-		int n = read(selfpipe[0], buf_selfpipe, sizeof(buf_selfpipe));
-		DEBUG_INFO("subprocess_read_selfpipe(): read(selfpipe[0], buf_selfpipe, sizeof(buf_selfpipe)): %i", n);
+	struct epoll_event evs[16];
+	int i, n;
+
+	do {
+		n = epoll_wait(tracker_fd, evs, sizeof(evs) / sizeof(evs[0]), 0);
 		if (n < 0) {
-			int save_errno = errno;
-			assert(n == -1);
 			if (errno == EINTR) {
-				DEBUG_INFO("subprocess_read_selfpipe(): received an EINTR");
-				break;
-			}
-			if (errno == EAGAIN) {
-				DEBUG_INFO("subprocess_read_selfpipe(): received an EAGAIN");
-				break;
+				continue;
 			}
-			DEBUG("read(), errno=%i", save_errno);
-			errno = save_errno;
-			perror("reading selfpipe[0]");
+			perror("epoll_wait(tracker_fd)");
 			exit(1);
 		}
-		assert((n % sizeof(int)) == 0);
-		if (n) {
-			int *pid_gone = (int*)buf_selfpipe;
-			int m = n / sizeof(int);
-			do {
-				struct child *c;
-				if ((c = children_search_by_pid(subprocesses, *pid_gone))) {
-					assert(*pid_gone == c->sp->pid);
-					DEBUG_INFO("subprocess_read_selfpipe(): \x20\x20pid %i found at child %p", *pid_gone, c);
-					children_remove(subprocesses, c);
-					child_free(c);
-					c = NULL;
-				} else {
-					DEBUG_INFO("subprocess_read_selfpipe(): \x20\x20pid %i does not concern to us", *pid_gone);
-				}
-				pid_gone++;
-			} while (--m);
-			if (n == sizeof(buf_selfpipe)) {
-				/* last read filled all the buffer
-				 */
-				DEBUG_INFO("subprocess_read_selfpipe(): checking again");
-				continue;
+		for (i = 0; i < n; i++) {
+			if (evs[i].data.ptr) {
+				tracker_gone(evs[i].data.ptr);
+			} else {
+				tracker_scan();
 			}
 		}
-		break;
-	}
-	DEBUG_INFO("subprocess_read_selfpipe(): done");
-	return 0;
-}
+	} while (n == sizeof(evs) / sizeof(evs[0]));
 
-/* returns 0 on success
- */
-int subprocess_read_selfpipe()
-{
-	if (got_SIGCHLD) {
-		/* this may seem paranoid, but, is certainly the right
-		 * thing (sigprocmask) to do
-		 */
-		sigprocmask(SIG_BLOCK, sigset_SIGCHLD, NULL);
-		if (got_SIGCHLD) got_SIGCHLD = 0;
-		/* we can clear got_SIGCHLD early, since this is the
-		 * only place where it is checked for
-		 */
-		sigprocmask(SIG_UNBLOCK, sigset_SIGCHLD, NULL);
-		return subprocess_read_selfpipe0();
-	}
-	DEBUG_INFO("subprocess_read_selfpipe(): nothing new");
+	terminating_reap();
+
+	DEBUG_INFO("subprocess_read_selfpipe(): done");
 	return 0;
 }
 
@@ -507,14 +408,12 @@ int subprocess_read_selfpipe()
 int subprocess_wait(struct subprocess *sp, int msec)
 {
 	int r, pid = 0;
-	int eintr_count = 0;
-	fd_set rfds[1];
-	struct timeval start[1];
-	struct timeval tv[1];
-	long dmsec;
+	struct pollfd pfd[1];
+	long long start;
+	long long dmsec = 0;
 
 	assert(sp->pid > 0);
-	assert(selfpipe[0] != -1);
+	assert(tracker_fd != -1);
 	assert(sp->waitpid_pid == 0); /* you can't wait on a terminated process */
 
 	if (sp->is_gone) {
@@ -523,73 +422,43 @@ int subprocess_wait(struct subprocess *sp, int msec)
 		return sp->pid;
 	}
 
-	get_current_timeval(start);
+	start = timer_now_msec();
 
 	DEBUG_INFO("subprocess_wait(pid=%i) for %i milliseconds", sp->pid, msec);
 
-	FD_ZERO(rfds);
+	/* the pidfd is all we need, otherwise any child gone wakes us
+	 */
+	pfd->fd = sp->pidfd >= 0 ? sp->pidfd : tracker_fd;
+	pfd->events = POLLIN;
 
 	for (;;) {
-		FD_SET(selfpipe[0], rfds);
-
-		if (msec) {
-			struct timeval current[1];
-			get_current_timeval(current);
-			if ((dmsec = DELTA_MSEC(current, start)) > msec) {
-				DEBUG_INFO("elapsed time");
-				break;
-			}
-			tv->tv_sec = 0;
-			tv->tv_usec = (msec - dmsec) * 1000;
-		} else {
-			dmsec = 0;
-			tv->tv_sec = 0;
-			tv->tv_usec = 0;
-		}
-
-		DEBUG_INFO("select(selfpipe[0]+1) for %li milliseconds", msec - dmsec);
-		r = select(selfpipe[0]+1, rfds, NULL, NULL, tv);
+		r = poll(pfd, 1, msec - dmsec);
 		if (r < 0) {
-			int save_errno = errno;
 			assert(r == -1);
-			if (errno == EINTR) {
-				eintr_count++;
-				DEBUG_INFO("select() received an EINTR, count=%i, retrying", eintr_count);
-				if (eintr_count == MAX_WAIT_SUBPROCESS_EINTR_COUNT) {
-					DEBUG_INFO("too much EINTR, giving up select");
-					break;
-				}
-				continue;
+			if (errno != EINTR) {
+				perror("poll()");
+				exit(1);
 			}
-			DEBUG("select(), errno=%i", save_errno);
-			errno = save_errno;
-			perror("select()");
-			exit(1);
 		} else if (r) {
-			DEBUG_INFO("select()=%i", r);
-			if (FD_ISSET(selfpipe[0], rfds)) {
-				eintr_count = 0;
+			if (sp->pidfd >= 0) {
+				tracker_gone(sp);
+			} else {
 				assert(subprocess_read_selfpipe() == 0);
-				if (sp->is_gone) {
-					DEBUG_INFO("sp=[pid=%i] is gone", sp->pid);
-					pid = sp->pid;
-					break;
-				}
 			}
-		} else {
-			DEBUG_INFO("select() timeout");
+			if (sp->is_gone) {
+				DEBUG_INFO("sp=[pid=%i] is gone", sp->pid);
+				pid = sp->pid;
+				break;
+			}
+		}
+		if ((dmsec = timer_now_msec() - start) >= msec) {
+			DEBUG_INFO("elapsed time");
 			break;
 		}
 	}
 
-	{
-		struct timeval current[1];
-		long usec;
-		get_current_timeval(current);
-		usec = DELTA_USEC(current, start);
-		DEBUG_INFO("subprocess_wait(pid=%i gone? %s), %li milliseconds elapsed (%lu usecs), total %i", sp->pid, pid ? "yes" : "no",
-		      usec / 100, usec, msec);
-	}
+	DEBUG_INFO("subprocess_wait(pid=%i gone? %s), %lli milliseconds elapsed, total %i", sp->pid, pid ? "yes" : "no",
+		   timer_now_msec() - start, msec);
 
 	/* timeout or other child gone
 	 */
@@ -622,9 +491,9 @@ static int loop_child_pipes(struct subprocess *sp, struct subprocess_callbacks *
 
 	for (;;) {
 		max_fds = -1;
-		if (selfpipe[0] != -1) {
-			FD_SET(selfpipe[0], rfds);
-			max_fds = MAX2(selfpipe[0], max_fds);
+		if (tracker_fd != -1) {
+			FD_SET(tracker_fd, rfds);
+			max_fds = MAX2(tracker_fd, max_fds);
 		}
 		if (sp->child_fdout != -1) {
 			FD_SET(sp->child_fdout, rfds);
@@ -637,8 +506,7 @@ static int loop_child_pipes(struct subprocess *sp, struct subprocess_callbacks *
 
 		assert(max_fds >= 0);
 
-		tv.tv_sec = 0;
-		tv.tv_usec = cb->ctimeout * 1000;
+		timer_msec_to_timeval(&tv, cb->ctimeout);
 
 		r = select(max_fds+1, rfds, NULL, NULL, &tv);
 		if (r < 0) {
@@ -742,7 +610,7 @@ static int loop_child_pipes(struct subprocess *sp, struct subprocess_callbacks *
 
 			/* sometimes stdout and stderr get closed by
 			 * child process (subprocess) before
-			 * selfpipe[0] gets ready
+			 * tracker_fd gets ready
 			 */
 
 			if (sp->child_fdout == -1 && sp->child_fderr == -1) {
@@ -755,11 +623,11 @@ static int loop_child_pipes(struct subprocess *sp, struct subprocess_callbacks *
 				}
 			}
 
-			/* rfds/selfpipe[0]
+			/* rfds/tracker_fd
 			 */
 
-			if (selfpipe[0] != -1 && (n = FD_ISSET(selfpipe[0], rfds))) {
-				DEBUG_INFO("FD_ISSET(selfpipe[0], rfds): %i", n);
+			if (tracker_fd != -1 && (n = FD_ISSET(tracker_fd, rfds))) {
+				DEBUG_INFO("FD_ISSET(tracker_fd, rfds): %i", n);
 				assert(subprocess_read_selfpipe() == 0);
 				if (sp->is_gone) break;
 			}
@@ -770,8 +638,7 @@ static int loop_child_pipes(struct subprocess *sp, struct subprocess_callbacks *
 		BURST:
 			if (sp->child_fdin != -1 && cb->produce_stdin) {
 				FD_SET(sp->child_fdin, wfds);
-				tv.tv_sec = 0;
-				tv.tv_usec = cb->ptimeout;
+				timer_msec_to_timeval(&tv, cb->ptimeout);
 				r = select(sp->child_fdin+1, NULL, wfds, NULL, &tv);
 				if (r == -1) {
 					int save_errno = errno;
@@ -853,7 +720,7 @@ int subprocess_fork0(struct subprocess *sp)
 
 	assert(sp);
 
-	assert(selfpipe_setup() == 0);
+	assert(tracker_setup() == 0);
 
 	/* cleanup for next execution
 	 */
@@ -882,6 +749,12 @@ int subprocess_fork0(struct subprocess *sp)
 	 */
 
 	if ((sp->pid = fork()) == 0) {
+		if (tracker_sigfd != -1) {
+			/* SIGCHLD is only blocked for the signalfd
+			 */
+			sigprocmask(SIG_UNBLOCK, sigset_SIGCHLD, NULL);
+		}
+
 		/* prepare standard file descriptors
 		 */
 		assert(dup2(child_stdin[0], STDIN_FILENO) == STDIN_FILENO);
@@ -908,6 +781,7 @@ int subprocess_fork0(struct subprocess *sp)
 
 	DEBUG_INFO("parent pid: %i", (int) getpid());
 	DEBUG_INFO("child pid:  %i", (int) sp->pid);
+	PROBE1(subprocess_fork0, sp->pid);
 
 	/* close fds that doesn't concern to us
 	 */
@@ -933,7 +807,7 @@ int subprocess_fork0(struct subprocess *sp)
 	DEBUG_INFO("sp->child_fdout=%i", sp->child_fdout);
 	DEBUG_INFO("sp->child_fderr=%i", sp->child_fderr);
 
-	children_insert(subprocesses, child_new(sp));
+	tracker_add(sp);
 
 	return sp->pid;
 }
@@ -987,16 +861,117 @@ int subprocess_fork(struct subprocess *sp)
 	return 0;
 }
 
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 34))
+#define HAVE_ADDCLOSEFROM
+#endif
+
+extern char **environ;
+
+/* same as subprocess_fork, but with posix_spawn (the parent memory is
+ * not copied, there is no fork), only the standard fds are left open
+ * in the child, return 0 on success, -1 on error and errno is set
+ * appropriately (ENOENT if not found, unlike subprocess_fork)
+ */
+int subprocess_spawn(struct subprocess *sp)
+{
+	int child_stdin[2] = {0, 0};
+	int child_stdout[2] = {0, 0};
+	int child_stderr[2] = {0, 0};
+	posix_spawn_file_actions_t fa[1];
+	posix_spawnattr_t attr[1];
+	sigset_t none[1];
+	int r;
+
+	assert(sp);
+	assert(sp->argv);
+	assert(sp->argv[0]);
+
+	if (sp->envp && sp->search_path) {
+		DEBUG_INFO("it is not allowed to use search path while specifying environment variables");
+		errno = EINVAL;
+		return -1;
+	}
+
+	assert(tracker_setup() == 0);
+
+	sp->exit_status = 0;
+	sp->pid = 0;
+	sp->waitpid_pid = 0;
+	sp->is_gone = 0;
+
+	/* close-on-exec, so later children do not inherit them
+	 */
+
+	assert(pipe2(child_stdin, O_CLOEXEC) == 0);
+	assert(pipe2(child_stdout, O_CLOEXEC) == 0);
+	assert(pipe2(child_stderr, O_CLOEXEC) == 0);
+
+	assert(posix_spawn_file_actions_init(fa) == 0);
+	assert(posix_spawn_file_actions_adddup2(fa, child_stdin[0], STDIN_FILENO) == 0);
+	assert(posix_spawn_file_actions_adddup2(fa, child_stdout[1], STDOUT_FILENO) == 0);
+	assert(posix_spawn_file_actions_adddup2(fa, child_stderr[1], STDERR_FILENO) == 0);
+#ifdef HAVE_ADDCLOSEFROM
+	assert(posix_spawn_file_actions_addclosefrom_np(fa, STDERR_FILENO + 1) == 0);
+#endif
+
+	/* SIGCHLD is only blocked for the signalfd
+	 */
+	assert(posix_spawnattr_init(attr) == 0);
+	if (tracker_sigfd != -1) {
+		assert(sigemptyset(none) == 0);
+		assert(posix_spawnattr_setsigmask(attr, none) == 0);
+		assert(posix_spawnattr_setflags(attr, POSIX_SPAWN_SETSIGMASK) == 0);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+
+	if (sp->search_path) {
+		r = posix_spawnp(&sp->pid, sp->argv[0], fa, attr, sp->argv, environ);
+	} else {
+		r = posix_spawn(&sp->pid, sp->argv[0], fa, attr, sp->argv, sp->envp ? sp->envp : environ);
+	}
+
+	assert(posix_spawnattr_destroy(attr) == 0);
+	assert(posix_spawn_file_actions_destroy(fa) == 0);
+
+	assert(xclose(child_stdin[0]) == 0);
+	assert(xclose(child_stdout[1]) == 0);
+	assert(xclose(child_stderr[1]) == 0);
+
+	if (r) {
+		DEBUG("posix_spawn(%s), errno=%i", sp->argv[0], r);
+		assert(xclose(child_stdin[1]) == 0);
+		assert(xclose(child_stdout[0]) == 0);
+		assert(xclose(child_stderr[0]) == 0);
+		sp->pid = 0;
+		errno = r;
+		return -1;
+	}
+
+	DEBUG_INFO("spawned pid: %i", (int) sp->pid);
+	PROBE1(subprocess_spawn, sp->pid);
+
+	sp->child_fdin = child_stdin[1];
+	sp->child_fdout = child_stdout[0];
+	sp->child_fderr = child_stderr[0];
+
+	assert(make_fd_non_blocking(sp->child_fdin) == 0);
+	assert(make_fd_non_blocking(sp->child_fdout) == 0);
+	assert(make_fd_non_blocking(sp->child_fderr) == 0);
+
+	tracker_add(sp);
+
+	return 0;
+}
+
 int subprocess_terminate(struct subprocess *sp)
 {
 	DEBUG_INFO("subprocess_terminate(pid=%i)", sp->pid);
+	PROBE1(subprocess_terminate__start, sp->pid);
 
 	assert(sp->waitpid_pid == 0); /* you can't terminated a terminated process */
 
-	/* this is required to release children dictionary
-	 */
-	assert(subprocess_read_selfpipe() == 0);
-
 	/* close child stdin (this clearly tells child that we don't
 	 * want to produce anymore)
 	 */
@@ -1007,9 +982,7 @@ int subprocess_terminate(struct subprocess *sp)
 	subprocess_close_child_fdout(sp);
 	subprocess_close_child_fderr(sp);
 
-	if ((sp->waitpid_pid = waitpid(sp->pid, &sp->exit_status, WNOHANG))) {
-		assert(sp->waitpid_pid == sp->pid);
-	} else {
+	if (subprocess_reap(sp, WNOHANG) == 0) {
 		assert(sp->waitpid_pid == 0);
 		if (subprocess_wait(sp, 5000 /* 5 seconds */) == 0) {
 			/* we tried to be nice, giving hints to subprocess to
@@ -1021,11 +994,9 @@ int subprocess_terminate(struct subprocess *sp)
 				/* still alive, this is the last resort, we must
 				 * retry SIGKILL indefinitely
 				 */
-#ifdef DEBUG_INFO_ENABLED
 				int tries = 0;
 				DEBUG_INFO("still alive after 5 seconds with kill(child_pid=%i, SIGTERM)", sp->pid);
 				DEBUG_INFO("send SIGKILL to child pid %i", sp->pid);
-#endif
 				for (;;) {
 					/* we can't go, if we go, we
 					 * run the risk of resource
@@ -1044,34 +1015,164 @@ int subprocess_terminate(struct subprocess *sp)
 		}
 
 		/* the child has terminated, that's for sure, we do a
-		 * waitpid here just to avoid zombie (defunct)
+		 * waitid here just to avoid zombie (defunct)
 		 * processes and to get the proper exit status
 		 */
-		assert((sp->waitpid_pid = waitpid(sp->pid, &sp->exit_status, WNOHANG)) == sp->pid);
+		assert(subprocess_reap(sp, WNOHANG) == sp->pid);
 	}
 
-	if (sp->is_gone == 0) {
-		/* some SIGCHLD may be lost if they arrive at same
-		 * time (see test-subprocess-13.c)
+	assert(sp->is_gone);
+
+	PROBE2(subprocess_terminate__done, sp->pid, sp->exit_status);
+
+	return 0;
+}
+
+/* background termination, the same escalation as
+ * subprocess_terminate, driven by the caller event loop (timers and
+ * the tracker fd)
+ */
+
+#define TERMINATE_GRACE_MSEC 5000
+#define TERMINATE_SIGTERM_MSEC 5000
+#define TERMINATE_SIGKILL_MSEC 10000
+
+struct terminating {
+	struct subprocess sp[1]; /* first, tracked children point here */
+	int stage; /* 0 grace, 1 SIGTERM sent, 2 SIGKILL sent */
+	struct timer deadline[1];
+	void (*done)(struct subprocess *sp, void *arg);
+	void *arg;
+	struct terminating *next;
+};
+
+static struct terminating *terminating = NULL;
+static int terminating_count = 0;
+
+/* the deadline passed and the child is still there
+ */
+static void terminating_escalate(struct timer *timer, void *arg)
+{
+	struct terminating *t = arg;
+
+	if (t->sp->is_gone) {
+		return;
+	}
+
+	if (t->stage == 0) {
+		DEBUG_INFO("send SIGTERM to child pid %i", t->sp->pid);
+		assert(kill(t->sp->pid, SIGTERM) == 0);
+		t->stage = 1;
+		timer_arm(t->deadline, TERMINATE_SIGTERM_MSEC);
+	} else {
+		/* we can't give up, see subprocess_terminate
 		 */
-		struct child *c;
+		DEBUG_INFO("send SIGKILL to child pid %i", t->sp->pid);
+		assert(kill(t->sp->pid, SIGKILL) == 0);
+		t->stage = 2;
+		timer_arm(t->deadline, TERMINATE_SIGKILL_MSEC);
+	}
+}
 
-		DEBUG_INFO("selfpipe failed for pid %i", sp->pid);
+static void terminating_reap()
+{
+	struct terminating **pt = &terminating;
+	while (*pt) {
+		struct terminating *t = *pt;
+		if (t->sp->waitpid_pid || (t->sp->is_gone && subprocess_reap(t->sp, WNOHANG) == t->sp->pid)) {
+			DEBUG_INFO("child %i reaped in background, stage %i", t->sp->pid, t->stage);
+			*pt = t->next;
+			terminating_count--;
+			timer_cancel(t->deadline);
+			if (t->done) {
+				t->done(t->sp, t->arg);
+			}
+			free(t);
+			continue;
+		}
+		pt = &t->next;
+	}
+}
+
+int subprocess_terminate_async(struct subprocess *sp, void (*done)(struct subprocess *sp, void *arg), void *arg)
+{
+	struct terminating *t;
 
-		assert(c = children_search_by_pid(subprocesses, sp->pid));
-		DEBUG_INFO("\x20\x20pid %i found at child %p", sp->pid, c);
+	DEBUG_INFO("subprocess_terminate_async(pid=%i)", sp->pid);
 
-		children_remove(subprocesses, c);
+	assert(sp->waitpid_pid == 0); /* you can't terminated a terminated process */
+	assert(!sp->terminating);
+
+	subprocess_close_child_fdin(sp);
+	subprocess_close_child_fdout(sp);
+	subprocess_close_child_fderr(sp);
 
-		child_free(c);
-		c = NULL;
+	if (!(t = calloc(1, sizeof(struct terminating)))) {
+		return -1;
+	}
 
-		sp->is_gone = 1;
+	/* move the child, the tracker must point to our copy
+	 */
+	*t->sp = *sp;
+	t->sp->terminating = 1;
+	if (!sp->is_gone) {
+		if (sp->pidfd >= 0) {
+			struct epoll_event ev[1];
+			memset(ev, 0, sizeof(ev));
+			ev->events = EPOLLIN;
+			ev->data.ptr = t->sp;
+			assert(epoll_ctl(tracker_fd, EPOLL_CTL_MOD, sp->pidfd, ev) == 0);
+		}
+		if (sp->tracked_prev) {
+			sp->tracked_prev->tracked_next = t->sp;
+		} else {
+			assert(tracked == sp);
+			tracked = t->sp;
+		}
+		if (sp->tracked_next) {
+			sp->tracked_next->tracked_prev = t->sp;
+		}
+	}
+	sp->pid = 0;
+	sp->pidfd = -1;
+	sp->is_gone = 1;
+	sp->tracked_next = sp->tracked_prev = NULL;
+
+	t->done = done;
+	t->arg = arg;
+	timer_init(t->deadline, terminating_escalate, t);
+	timer_arm(t->deadline, TERMINATE_GRACE_MSEC);
+	t->next = terminating;
+	terminating = t;
+	terminating_count++;
+
+	if (subprocess_reap(t->sp, WNOHANG)) {
+		/* already gone
+		 */
+		terminating_reap();
 	}
 
 	return 0;
 }
 
+int subprocess_terminate_pending()
+{
+	return terminating_count;
+}
+
+void subprocess_terminate_flush()
+{
+	while (terminating) {
+		struct pollfd pfd[1];
+		pfd->fd = tracker_fd;
+		pfd->events = POLLIN;
+		if (poll(pfd, 1, timer_next_msec()) > 0) {
+			assert(subprocess_read_selfpipe() == 0);
+		}
+		timer_run();
+	}
+}
+
 void subprocess_exit_debug(struct subprocess *sp)
 {
 	int status = sp->exit_status;
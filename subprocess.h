@@ -13,7 +13,11 @@ struct subprocess
 	int child_fdin;
 	int child_fdout;
 	int child_fderr;
-	int is_gone; /* self-pipe trick */
+	int is_gone; /* exited, but not reaped yet */
+	int pidfd; /* -1 without pidfd_open (linux < 5.3) */
+	struct subprocess *tracked_next; /* live children */
+	struct subprocess *tracked_prev;
+	int terminating; /* owned by subprocess_terminate_async */
 };
 
 struct subprocess_callbacks
@@ -28,7 +32,7 @@ struct subprocess_callbacks
 	int (*produce_timeout)(struct subprocess *sp); /* return non-zero to terminate child */
 };
 
-#define ST_SUBPROCESS(v) struct subprocess v[1] = {{NULL, NULL, 0, 0, 0, 0, NULL, 0, 0, 0, 0}};
+#define ST_SUBPROCESS(v) struct subprocess v[1] = {{NULL, NULL, 0, 0, 0, 0, NULL, 0, 0, 0, 0, -1, NULL, NULL, 0}};
 #define ST_SUBPROCESS_CALLBACKS(v) struct subprocess_callbacks v[1] = {{0, 0, 0, NULL, NULL, NULL, NULL, NULL}};
 
 void interrupt_safe_sleep(int ms);
@@ -51,14 +55,38 @@ int subprocess_fork0(struct subprocess *sp);
  */
 int subprocess_fork(struct subprocess *sp);
 
+/* 0 on success, -1 on error and errno is set appropriately, same as
+ * subprocess_fork without a fork (posix_spawn), exec errors are
+ * reported here
+ */
+int subprocess_spawn(struct subprocess *sp);
+
 int subprocess_terminate(struct subprocess *sp);
+
+/* same escalation as subprocess_terminate, but it returns right away,
+ * the child is moved out of sp (sp can be reused at once, pid is 0)
+ * and done is called with the exit status filled once it is reaped
+ * (maybe before returning), the escalation deadlines are timers (see
+ * timer.h), 0 on success, -1 on error
+ */
+int subprocess_terminate_async(struct subprocess *sp, void (*done)(struct subprocess *sp, void *arg), void *arg);
+
+/* children still being terminated
+ */
+int subprocess_terminate_pending();
+
+/* blocks until every background termination is done
+ */
+void subprocess_terminate_flush();
 void subprocess_exit_debug(struct subprocess *sp);
 
-/* returns a fd on success (just check for readiness on it) or -1 on error
+/* returns a fd on success (just check for readiness on it) or -1 on
+ * error, it gets readable when any child exits (an epoll fd over the
+ * children pidfds, the name is kept from the self-pipe days)
  */
 int subprocess_get_selfpipe_read_fd();
 
-/* returns 0 on success
+/* marks the children gone (is_gone), returns 0 on success
  */
 int subprocess_read_selfpipe();
 
@@ -0,0 +1,222 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * monotonic timers, see timer.h
+ *
+ * the heap is an array of pointers to caller-owned timers, each timer
+ * knows its index, so cancel and re-arm do not search
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+
+static struct timer **heap = NULL;
+static int heap_len = 0;
+static int heap_cap = 0;
+static int tfd = -1;
+static long long tfd_deadline = -1; /* what tfd is armed to */
+
+long long timer_now_msec()
+{
+	struct timespec ts[1];
+	assert(clock_gettime(CLOCK_MONOTONIC, ts) == 0);
+	return (long long)ts->tv_sec * 1000 + ts->tv_nsec / 1000000;
+}
+
+long long timer_now_usec()
+{
+	struct timespec ts[1];
+	assert(clock_gettime(CLOCK_MONOTONIC, ts) == 0);
+	return (long long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+void timer_msec_to_timeval(struct timeval *tv, long msec)
+{
+	if (msec < 0) msec = 0;
+	tv->tv_sec = msec / 1000;
+	tv->tv_usec = (msec % 1000) * 1000;
+}
+
+static void heap_set(int i, struct timer *t)
+{
+	heap[i] = t;
+	t->index = i;
+}
+
+static void heap_up(int i)
+{
+	struct timer *t = heap[i];
+	while (i > 0) {
+		int parent = (i - 1) / 2;
+		if (heap[parent]->deadline <= t->deadline) break;
+		heap_set(i, heap[parent]);
+		i = parent;
+	}
+	heap_set(i, t);
+}
+
+static void heap_down(int i)
+{
+	struct timer *t = heap[i];
+	for (;;) {
+		int child = i * 2 + 1;
+		if (child >= heap_len) break;
+		if (child + 1 < heap_len && heap[child + 1]->deadline < heap[child]->deadline) child++;
+		if (t->deadline <= heap[child]->deadline) break;
+		heap_set(i, heap[child]);
+		i = child;
+	}
+	heap_set(i, t);
+}
+
+/* keep the timerfd on the heap top
+ */
+static void tfd_update()
+{
+	struct itimerspec its[1];
+	long long deadline = heap_len ? heap[0]->deadline : -1;
+
+	if (tfd < 0 || deadline == tfd_deadline) {
+		return;
+	}
+
+	memset(its, 0, sizeof(its));
+	if (deadline >= 0) {
+		/* 0 would disarm it, a deadline is never at the epoch
+		 */
+		its->it_value.tv_sec = deadline / 1000;
+		its->it_value.tv_nsec = (deadline % 1000) * 1000000 + 1;
+	}
+	assert(timerfd_settime(tfd, TFD_TIMER_ABSTIME, its, NULL) == 0);
+	tfd_deadline = deadline;
+}
+
+void timer_init(struct timer *t, void (*fn)(struct timer *t, void *arg), void *arg)
+{
+	t->deadline = 0;
+	t->index = -1;
+	t->fn = fn;
+	t->arg = arg;
+}
+
+int timer_armed(struct timer *t)
+{
+	return t->index >= 0;
+}
+
+void timer_cancel(struct timer *t)
+{
+	int i = t->index;
+
+	if (i < 0) {
+		return;
+	}
+
+	assert(heap[i] == t);
+	t->index = -1;
+	if (--heap_len > i) {
+		heap_set(i, heap[heap_len]);
+		heap_up(i);
+		heap_down(heap[i]->index);
+	}
+	tfd_update();
+}
+
+void timer_arm(struct timer *t, long msec)
+{
+	timer_cancel(t);
+
+	if (heap_len == heap_cap) {
+		int cap = heap_cap ? heap_cap * 2 : 16;
+		struct timer **h = realloc(heap, cap * sizeof(struct timer *));
+		assert(h);
+		heap = h;
+		heap_cap = cap;
+	}
+
+	t->deadline = timer_now_msec() + (msec < 0 ? 0 : msec);
+	heap_set(heap_len++, t);
+	heap_up(t->index);
+	tfd_update();
+}
+
+int timer_next_msec()
+{
+	long long d;
+
+	if (heap_len == 0) {
+		return -1;
+	}
+
+	d = heap[0]->deadline - timer_now_msec();
+	return d < 0 ? 0 : d;
+}
+
+int timer_run()
+{
+	long long now;
+	int fired = 0;
+
+	if (tfd >= 0) {
+		unsigned long long expirations;
+		while (read(tfd, &expirations, sizeof(expirations)) > 0)
+			;
+	}
+
+	if (heap_len == 0) {
+		return 0;
+	}
+
+	now = timer_now_msec();
+	while (heap_len && heap[0]->deadline <= now) {
+		struct timer *t = heap[0];
+		timer_cancel(t);
+		fired++;
+		t->fn(t, t->arg);
+	}
+
+	return fired;
+}
+
+int timer_fd()
+{
+	if (tfd < 0) {
+		if ((tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+			return -1;
+		}
+		tfd_deadline = -1;
+		tfd_update();
+	}
+	return tfd;
+}
@@ -0,0 +1,56 @@
+#ifndef nw1r6f0b3jzq8kx5da /* timer-h */
+#define nw1r6f0b3jzq8kx5da /* timer-h */
+
+#include <sys/time.h>
+
+/* deadlines on CLOCK_MONOTONIC (wall clock jumps do not matter), kept
+ * in a binary heap, so the next one is O(1) and arming is O(log n)
+ *
+ * the event loop either waits at most timer_next_msec() or watches
+ * timer_fd() (a timerfd always armed to the next deadline), and then
+ * calls timer_run()
+ */
+
+struct timer {
+	long long deadline; /* monotonic milliseconds */
+	int index; /* heap position, -1 if not armed */
+	void (*fn)(struct timer *t, void *arg);
+	void *arg;
+};
+
+/* monotonic milliseconds, only differences make sense
+ */
+long long timer_now_msec();
+
+/* same clock, in microseconds, for short intervals
+ */
+long long timer_now_usec();
+
+/* msec (any value, unlike tv_usec) as a timeval
+ */
+void timer_msec_to_timeval(struct timeval *tv, long msec);
+
+void timer_init(struct timer *t, void (*fn)(struct timer *t, void *arg), void *arg);
+
+/* fires in msec from now, re-arming moves the deadline
+ */
+void timer_arm(struct timer *t, long msec);
+
+void timer_cancel(struct timer *t);
+
+int timer_armed(struct timer *t);
+
+/* milliseconds to the next deadline, 0 if one is due, -1 if none
+ */
+int timer_next_msec();
+
+/* fires the due ones (callbacks may arm timers again), returns how
+ * many fired
+ */
+int timer_run();
+
+/* a timerfd readable when the next deadline is due, -1 on error
+ */
+int timer_fd();
+
+#endif /* !nw1r6f0b3jzq8kx5da timer-h */
@@ -0,0 +1,223 @@
+/*
+Copyright (c) 2012 Alexandre Girao <alexgirao@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+1. Redistributions of source code must retain the above copyright notice(s),
+   this list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice(s),
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDER(S) ``AS IS'' AND ANY EXPRESS
+OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO
+EVENT SHALL THE COPYRIGHT HOLDER(S) BE LIABLE FOR ANY DIRECT, INDIRECT,
+INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * minimal io_uring, raw syscalls, no liburing
+ *
+ * the submission queue is filled with uring_read/uring_write and
+ * handed to the kernel by uring_submit_and_wait, one syscall for the
+ * whole batch
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "debug0.h"
+
+#include "uring.h"
+
+struct uring {
+	int fd;
+	unsigned int entries;
+
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int sq_local; /* tail not yet published */
+	struct io_uring_sqe *sqes;
+
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *sq_ring;
+	size_t sq_ring_sz;
+	void *cq_ring;
+	size_t cq_ring_sz;
+	size_t sqes_sz;
+};
+
+struct uring *uring_new(int entries)
+{
+	struct io_uring_params p[1];
+	struct uring *x;
+	int save_errno;
+
+	x = calloc(1, sizeof(struct uring));
+	assert(x);
+
+	memset(p, 0, sizeof(p));
+	if ((x->fd = syscall(__NR_io_uring_setup, entries, p)) < 0) {
+		save_errno = errno;
+		DEBUG("io_uring_setup(entries=%i), errno=%i", entries, save_errno);
+		free(x);
+		errno = save_errno;
+		return NULL;
+	}
+
+	x->entries = p->sq_entries;
+	x->sq_ring_sz = p->sq_off.array + p->sq_entries * sizeof(unsigned int);
+	x->cq_ring_sz = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+	x->sqes_sz = p->sq_entries * sizeof(struct io_uring_sqe);
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		if (x->cq_ring_sz > x->sq_ring_sz) x->sq_ring_sz = x->cq_ring_sz;
+		x->cq_ring_sz = x->sq_ring_sz;
+	}
+
+	x->sq_ring = mmap(NULL, x->sq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			  x->fd, IORING_OFF_SQ_RING);
+	if (x->sq_ring == MAP_FAILED) goto fail;
+
+	if (p->features & IORING_FEAT_SINGLE_MMAP) {
+		x->cq_ring = x->sq_ring;
+	} else {
+		x->cq_ring = mmap(NULL, x->cq_ring_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				  x->fd, IORING_OFF_CQ_RING);
+		if (x->cq_ring == MAP_FAILED) {
+			x->cq_ring = NULL;
+			goto fail;
+		}
+	}
+
+	x->sqes = mmap(NULL, x->sqes_sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       x->fd, IORING_OFF_SQES);
+	if (x->sqes == MAP_FAILED) {
+		x->sqes = NULL;
+		goto fail;
+	}
+
+	x->sq_head = x->sq_ring + p->sq_off.head;
+	x->sq_tail = x->sq_ring + p->sq_off.tail;
+	x->sq_mask = x->sq_ring + p->sq_off.ring_mask;
+	x->sq_array = x->sq_ring + p->sq_off.array;
+	x->sq_local = *x->sq_tail;
+
+	x->cq_head = x->cq_ring + p->cq_off.head;
+	x->cq_tail = x->cq_ring + p->cq_off.tail;
+	x->cq_mask = x->cq_ring + p->cq_off.ring_mask;
+	x->cqes = x->cq_ring + p->cq_off.cqes;
+
+	return x;
+
+fail:
+	save_errno = errno;
+	DEBUG("mmap(io_uring), errno=%i", save_errno);
+	if (x->sq_ring == MAP_FAILED) x->sq_ring = NULL;
+	uring_free(x);
+	errno = save_errno;
+	return NULL;
+}
+
+void uring_free(struct uring *x)
+{
+	if (x->sqes) munmap(x->sqes, x->sqes_sz);
+	if (x->cq_ring && x->cq_ring != x->sq_ring) munmap(x->cq_ring, x->cq_ring_sz);
+	if (x->sq_ring) munmap(x->sq_ring, x->sq_ring_sz);
+	close(x->fd);
+	free(x);
+}
+
+int uring_register_buffers(struct uring *x, struct iovec *iov, int n)
+{
+	return syscall(__NR_io_uring_register, x->fd, IORING_REGISTER_BUFFERS, iov, n) < 0 ? -1 : 0;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *x)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int i;
+	if (x->sq_local - __atomic_load_n(x->sq_head, __ATOMIC_ACQUIRE) >= x->entries) {
+		errno = EBUSY;
+		return NULL;
+	}
+	i = x->sq_local++ & *x->sq_mask;
+	sqe = x->sqes + i;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	x->sq_array[i] = i;
+	return sqe;
+}
+
+int uring_read(struct uring *x, int fd, void *buf, int len, int buf_index, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+	if ((sqe = uring_sqe(x)) == NULL) return -1;
+	sqe->opcode = buf_index < 0 ? IORING_OP_READ : IORING_OP_READ_FIXED;
+	sqe->fd = fd;
+	sqe->off = -1; /* current position, pipes have none */
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->buf_index = buf_index < 0 ? 0 : buf_index;
+	sqe->user_data = data;
+	return 0;
+}
+
+int uring_write(struct uring *x, int fd, const void *buf, int len, int link, unsigned long long data)
+{
+	struct io_uring_sqe *sqe;
+	if ((sqe = uring_sqe(x)) == NULL) return -1;
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->off = -1;
+	sqe->addr = (unsigned long)buf;
+	sqe->len = len;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = data;
+	return 0;
+}
+
+int uring_submit_and_wait(struct uring *x, int wait_nr)
+{
+	unsigned int n = x->sq_local - *x->sq_tail;
+	int r;
+	__atomic_store_n(x->sq_tail, x->sq_local, __ATOMIC_RELEASE);
+	do {
+		r = syscall(__NR_io_uring_enter, x->fd, n, wait_nr,
+			    wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (r < 0 && errno == EINTR);
+	return r;
+}
+
+int uring_complete(struct uring *x, unsigned long long *data, int *res)
+{
+	unsigned int head = *x->cq_head;
+	struct io_uring_cqe *cqe;
+	if (head == __atomic_load_n(x->cq_tail, __ATOMIC_ACQUIRE)) return -1;
+	cqe = x->cqes + (head & *x->cq_mask);
+	*data = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(x->cq_head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef nnq3w8hxk1v6tde0ra /* uring-h */
+#define nnq3w8hxk1v6tde0ra /* uring-h */
+
+#include <sys/uio.h>
+
+struct uring;
+
+/* NULL on error and errno is set appropriately (ENOSYS or EPERM when
+ * io_uring is not available, caller should fall back to select)
+ */
+struct uring *uring_new(int entries);
+
+void uring_free(struct uring *x);
+
+/* buf_index of uring_read refers to these, 0 on success, -1 on error
+ * and errno is set appropriately
+ */
+int uring_register_buffers(struct uring *x, struct iovec *iov, int n);
+
+/* queue a request, nothing is done until uring_submit_and_wait, 0 on
+ * success, -1 with EBUSY if the submission queue is full, buf_index
+ * is -1 for a buffer that was not registered, linked writes run in
+ * order and a short one cancels the rest (-ECANCELED)
+ */
+int uring_read(struct uring *x, int fd, void *buf, int len, int buf_index, unsigned long long data);
+int uring_write(struct uring *x, int fd, const void *buf, int len, int link, unsigned long long data);
+
+/* submit everything queued, wait for wait_nr completions, return the
+ * number submitted, -1 on error and errno is set appropriately
+ */
+int uring_submit_and_wait(struct uring *x, int wait_nr);
+
+/* 0 and the completion of one request (res is what read(2)/write(2)
+ * would return, or -errno), -1 if there is none
+ */
+int uring_complete(struct uring *x, unsigned long long *data, int *res);
+
+#endif /* !nnq3w8hxk1v6tde0ra uring-h */